@@ -0,0 +1,50 @@
+# frozen_string_literal: true
+
+# Measures how the throughput of Magic#buffer scales with the number of
+# threads, each using its own Magic object. Since the content of the buffer
+# is identified without holding the Global VM Lock, the throughput should
+# grow with the number of CPUs, rather than stay flat.
+#
+# Usage:
+#
+#   ruby -Ilib benchmark/buffer_threads.rb [seconds] [size in bytes]
+
+require 'etc'
+require 'magic'
+
+duration = Float(ARGV[0] || 3)
+size = Integer(ARGV[1] || 1024 * 1024)
+
+# Mostly text with some binary noise, so that the Magic library has to look
+# through the whole buffer, much like it would for a typical upload.
+buffer = Array.new(size / 64) { |i| "line #{i}: #{'x' * 48}\n"[0, 64] }.join
+buffer << "\0" * (size - buffer.bytesize) if buffer.bytesize < size
+
+threads = ([1, 2, 4, 8, 16, 32] << Etc.nprocessors).uniq.sort.select { |n| n <= Etc.nprocessors * 2 }
+
+puts "Magic#buffer, #{size} bytes, #{duration}s per run, #{Etc.nprocessors} CPUs"
+puts format('%-8s %12s %10s', 'threads', 'calls/s', 'speedup')
+
+baseline = nil
+
+threads.each do |count|
+  magics = Array.new(count) { Magic.new }
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+
+  calls = magics.map do |magic|
+    Thread.new do
+      n = 0
+      while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+        magic.buffer(buffer)
+        n += 1
+      end
+      n
+    end
+  end.sum(&:value)
+
+  rate = calls / duration
+  baseline ||= rate
+  puts format('%-8d %12.1f %9.2fx', count, rate, rate / baseline)
+ensure
+  magics&.each(&:close)
+end
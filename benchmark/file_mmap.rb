@@ -0,0 +1,61 @@
+# frozen_string_literal: true
+
+# Compares how fast Magic#file identifies files of different sizes when the
+# Magic library reads the beginning of each file into a buffer of its own,
+# and when the beginning of the file is mapped into memory instead. The
+# files are read from the page cache, thus it measures the cost of copying
+# the content rather than the cost of the storage.
+#
+# Usage:
+#
+#   ruby -Ilib benchmark/file_mmap.rb [seconds] [bytes max]
+
+require 'tmpdir'
+require 'magic'
+
+duration = Float(ARGV[0] || 2)
+bytes_max = ARGV[1] && Integer(ARGV[1])
+
+sizes = [4 * 1024, 64 * 1024, 1024 * 1024, 8 * 1024 * 1024, 64 * 1024 * 1024]
+
+# A file that starts with a known header, followed by binary data, so that the
+# Magic library does not have to look at the whole file as it would for text.
+def write_file(path, size)
+  File.open(path, 'wb') do |file|
+    file.write("\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\x10\0\0\0\x10\x08\x06\0\0\0".b)
+    chunk = Random.new(size).bytes(64 * 1024)
+    file.write(chunk[0, [size - file.pos, chunk.bytesize].min]) while file.pos < size
+  end
+end
+
+def measure(duration)
+  calls = 0
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+
+  while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    yield
+    calls += 1
+  end
+
+  calls / duration
+end
+
+magic = Magic.new
+magic.set_parameter(Magic::PARAM_BYTES_MAX, bytes_max) if bytes_max
+
+puts "Magic#file, #{duration}s per run, bytes max #{magic.get_parameter(Magic::PARAM_BYTES_MAX)}"
+puts format('%-12s %12s %12s %10s', 'size', 'read calls/s', 'mmap calls/s', 'speedup')
+
+Dir.mktmpdir do |dir|
+  sizes.each do |size|
+    path = File.join(dir, "file-#{size}")
+    write_file(path, size)
+
+    raise 'results differ' unless magic.file(path) == magic.file(path, io: :mmap)
+
+    read = measure(duration) { magic.file(path) }
+    mmap = measure(duration) { magic.file(path, io: :mmap) }
+
+    puts format('%-12d %12.1f %12.1f %9.2fx', size, read, mmap, mmap / read)
+  end
+end
@@ -0,0 +1,63 @@
+# frozen_string_literal: true
+
+# Counts how many system calls Magic#buffer and Magic#file make for each
+# file they identify, using strace(1). Each method is run twice under strace,
+# once with no calls at all and once with many calls, and the difference is
+# then divided by the number of calls, which leaves out everything else that
+# Ruby and the Magic library do, such as loading the Magic database.
+#
+# Usage:
+#
+#   ruby -Ilib benchmark/syscalls.rb [calls]
+
+require 'rbconfig'
+require 'tempfile'
+require 'magic'
+
+PATH = File.expand_path('../test/fixtures/ruby.png', __dir__)
+
+if ARGV[0] == '--run'
+  magic = Magic.new
+  magic.flags = Magic::MIME_TYPE
+  buffer = File.binread(PATH)
+
+  case ARGV[1]
+  when 'buffer' then Integer(ARGV[2]).times { magic.buffer(buffer) }
+  when 'file' then Integer(ARGV[2]).times { magic.file(PATH) }
+  end
+
+  exit
+end
+
+calls = Integer(ARGV[0] || 10_000)
+
+abort 'strace(1) is needed to count system calls' unless system('strace -V', out: File::NULL, err: File::NULL)
+
+# Runs the given number of calls under strace, and returns how many times
+# each system call was made, as reported by the summary of strace.
+def count(method, calls)
+  Tempfile.create('syscalls') do |file|
+    system('strace', '-f', '-c', '-o', file.path, RbConfig.ruby, *$LOAD_PATH.map { |path| "-I#{path}" },
+           __FILE__, '--run', method, calls.to_s, exception: true)
+
+    File.foreach(file.path).each_with_object({}) do |line, counts|
+      fields = line.split
+      next unless fields.size >= 5 && fields[3] =~ /\A\d+\z/ && fields.last != 'total'
+
+      counts[fields.last] = Integer(fields[3])
+    end
+  end
+end
+
+puts "System calls per call, over #{calls} calls"
+
+%w[buffer file].each do |method|
+  before = count(method, 0)
+  after = count(method, calls)
+
+  deltas = after.map { |name, number| [name, (number - before.fetch(name, 0)).fdiv(calls)] }
+  deltas = deltas.select { |_, number| number >= 0.5 }.sort_by { |name, number| [-number, name] }
+
+  puts format('%-12s %6.1f  %s', "Magic##{method}", deltas.sum { |_, number| number },
+              deltas.map { |name, number| format('%s: %.1f', name, number) }.join(', ')).rstrip
+end
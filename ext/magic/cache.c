@@ -0,0 +1,178 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "cache.h"
+
+static pthread_key_t magic_cache_key;
+
+static magic_cache_t *magic_cache_current(void);
+static void magic_cache_free(void *data);
+static void magic_cache_evict(magic_cache_entry_t *entry);
+static int magic_params_equal(const magic_params_t *a,
+			      const magic_params_t *b);
+
+static const magic_params_t magic_params_default;
+
+/*
+ * Creates the key under which each thread keeps its own cache of Magic
+ * cookies. The cache of a thread is freed, together with the cookies, when
+ * the thread exits.
+ */
+int
+magic_cache_init(void)
+{
+	return pthread_key_create(&magic_cache_key, magic_cache_free);
+}
+
+/*
+ * Returns a Magic cookie that belongs to the current thread, and that was
+ * loaded from the given database and opened with the given flags and
+ * parameters (or with the default parameters, when none are given), opening
+ * and loading a new cookie when the thread does not have one yet. The most
+ * recently used cookies are kept, and the least recently used cookie is
+ * closed when the cache is full.
+ */
+magic_t
+magic_cache_get(magic_database_t *database, int flags,
+		const magic_params_t *params)
+{
+	int local_errno;
+	magic_cache_t *cache;
+	magic_cache_entry_t entry;
+
+	assert(database != NULL &&
+	       "Must be a valid pointer to `magic_database_t' type");
+
+	if (!params)
+		params = &magic_params_default;
+
+	cache = magic_cache_current();
+	if (!cache)
+		return NULL;
+
+	for (size_t i = 0; i < cache->count; i++) {
+		entry = cache->entries[i];
+		if (entry.database != database || entry.flags != flags ||
+		    !magic_params_equal(&entry.params, params))
+			continue;
+
+		memmove(&cache->entries[1], &cache->entries[0],
+			i * sizeof(magic_cache_entry_t));
+		cache->entries[0] = entry;
+
+		return entry.cookie;
+	}
+
+	entry = (magic_cache_entry_t) {
+		.cookie = magic_database_open(database, flags),
+		.database = database,
+		.params = *params,
+		.flags = flags,
+	};
+
+	if (!entry.cookie)
+		return NULL;
+
+	magic_params_set(entry.cookie, params);
+
+	if (cache->count == MAGIC_CACHE_SIZE) {
+		local_errno = errno;
+		magic_cache_evict(&cache->entries[--cache->count]);
+		errno = local_errno;
+	}
+
+	memmove(&cache->entries[1], &cache->entries[0],
+		cache->count * sizeof(magic_cache_entry_t));
+
+	entry.database = magic_database_ref(database);
+	cache->entries[0] = entry;
+	cache->count++;
+
+	return entry.cookie;
+}
+
+/*
+ * Saves the values of all the parameters that the Magic library supports,
+ * so that they can be set on another Magic cookie.
+ */
+void
+magic_params_get(magic_t magic, magic_params_t *params)
+{
+	params->count = 0;
+
+	while (params->count < MAGIC_PARAMS_MAX &&
+	       magic_getparam_wrapper(magic, (int)params->count,
+				      &params->values[params->count]) == 0)
+		params->count++;
+}
+
+void
+magic_params_set(magic_t magic, const magic_params_t *params)
+{
+	for (size_t i = 0; i < params->count; i++)
+		magic_setparam_wrapper(magic, (int)i, &params->values[i]);
+}
+
+static magic_cache_t *
+magic_cache_current(void)
+{
+	magic_cache_t *cache;
+
+	cache = pthread_getspecific(magic_cache_key);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (pthread_setspecific(magic_cache_key, cache) != 0) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return cache;
+}
+
+static void
+magic_cache_free(void *data)
+{
+	magic_cache_t *cache = data;
+
+	if (!cache)
+		return;
+
+	for (size_t i = 0; i < cache->count; i++)
+		magic_cache_evict(&cache->entries[i]);
+
+	free(cache);
+}
+
+static void
+magic_cache_evict(magic_cache_entry_t *entry)
+{
+	if (entry->cookie)
+		magic_close_wrapper(entry->cookie);
+
+	magic_database_unref(entry->database);
+
+	entry->cookie = NULL;
+	entry->database = NULL;
+}
+
+static int
+magic_params_equal(const magic_params_t *a, const magic_params_t *b)
+{
+	if (a->count != b->count)
+		return 0;
+
+	return memcmp(a->values, b->values, a->count * sizeof(size_t)) == 0;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,44 @@
+#if !defined(_CACHE_H)
+#define _CACHE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+#include "functions.h"
+#include "database.h"
+
+#define MAGIC_CACHE_SIZE 8
+#define MAGIC_PARAMS_MAX 16
+
+typedef struct magic_params {
+	size_t count;
+	size_t values[MAGIC_PARAMS_MAX];
+} magic_params_t;
+
+typedef struct magic_cache_entry {
+	magic_t cookie;
+	magic_database_t *database;
+	magic_params_t params;
+	int flags;
+} magic_cache_entry_t;
+
+typedef struct magic_cache {
+	size_t count;
+	magic_cache_entry_t entries[MAGIC_CACHE_SIZE];
+} magic_cache_t;
+
+extern int magic_cache_init(void);
+
+extern magic_t magic_cache_get(magic_database_t *database, int flags,
+			       const magic_params_t *params);
+
+extern void magic_params_get(magic_t magic, magic_params_t *params);
+extern void magic_params_set(magic_t magic, const magic_params_t *params);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _CACHE_H */
@@ -25,12 +25,15 @@ extern "C" {
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <magic.h>
 
 #include <ruby.h>
 #include <ruby/version.h>
+#include <ruby/encoding.h>
 
 #if defined(HAVE_RUBY_IO_H)
 # include <ruby/io.h>
@@ -38,8 +41,39 @@ extern "C" {
 # include <rubyio.h>
 #endif /* HAVE_RUBY_IO_H */
 
+#if defined(HAVE_RUBY_RACTOR_H)
+# include <ruby/ractor.h>
+#endif /* HAVE_RUBY_RACTOR_H */
+
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+# include <ruby/fiber/scheduler.h>
+#endif /* HAVE_RUBY_FIBER_SCHEDULER_H */
+
+#if defined(HAVE_RUBY_MEMORY_VIEW_H)
+# include <ruby/memory_view.h>
+#endif /* HAVE_RUBY_MEMORY_VIEW_H */
+
+#if defined(HAVE_RUBY_IO_BUFFER_H)
+# include <ruby/io/buffer.h>
+#endif /* HAVE_RUBY_IO_BUFFER_H */
+
+#if defined(HAVE_SYS_MMAN_H)
+# include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H */
+
+#if defined(HAVE_SYS_SOCKET_H)
+# include <sys/socket.h>
+#endif /* HAVE_SYS_SOCKET_H */
+
 #define BIT(n) (1 << (n))
 
+#define MAGIC_ATOMIC_LOAD(x)	  __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define MAGIC_ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define MAGIC_ATOMIC_INC(x)	  __atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define MAGIC_ATOMIC_DEC(x)	  __atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define MAGIC_ATOMIC_OR(x, v)	  __atomic_fetch_or(&(x), (v), __ATOMIC_SEQ_CST)
+#define MAGIC_ATOMIC_FETCH_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_SEQ_CST)
+
 #if !defined(UNUSED)
 # define UNUSED(x) (void)(x)
 #endif /* UNUSED */
@@ -120,6 +154,8 @@ extern "C" {
 	* HAVE_RB_GC_MARK_MOVABLE
 	*/
 
+#define NSEC_PER_SEC 1000000000ULL
+
 #define CLASS_NAME(o) (NIL_P((o)) ? "nil" : rb_obj_classname((o)))
 
 #if !defined(T_INTEGER)
@@ -138,6 +174,16 @@ extern "C" {
 
 #define NOGVL_FUNCTION (VALUE(*)(void *))
 
+#if defined(HAVE_RB_NOGVL) && \
+    defined(HAVE_RUBY_THREAD_H) && HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+# define NOGVL_WAIT(f, d, u, a) \
+	rb_nogvl((f), (d), (u), (a), RB_NOGVL_INTR_FAIL)
+#endif /*
+	* HAVE_RB_NOGVL
+	* HAVE_RUBY_THREAD_H
+	*/
+
 #if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && \
     defined(HAVE_RUBY_THREAD_H) && HAVE_RUBY_THREAD_H
 # include <ruby/thread.h>
@@ -166,6 +212,55 @@ fake_blocking_region(VALUE (*f)(ANYARGS), void *data)
 	* HAVE_RUBY_THREAD_H
 	*/
 
+#if !defined(NOGVL_WAIT)
+# if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#  define NOGVL_WAIT(f, d, u, a) \
+	rb_thread_call_without_gvl((f), (d), (u), (a))
+# else
+#  define NOGVL_WAIT(f, d, u, a) \
+	NOGVL((f), (d))
+# endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+#endif /* NOGVL_WAIT */
+
+static inline unsigned long long
+magic_clock_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * NSEC_PER_SEC +
+	       (unsigned long long)ts.tv_nsec;
+}
+
+static inline void
+magic_clock_deadline(struct timespec *ts, double timeout)
+{
+	time_t seconds = (time_t)timeout;
+
+	clock_gettime(CLOCK_REALTIME, ts);
+
+	ts->tv_sec += seconds;
+	ts->tv_nsec += (long)((timeout - (double)seconds) * (double)NSEC_PER_SEC);
+
+	if (ts->tv_nsec >= (long)NSEC_PER_SEC) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= (long)NSEC_PER_SEC;
+	}
+}
+
+static inline size_t
+magic_cpu_count(void)
+{
+	long count = -1;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+	count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif /* _SC_NPROCESSORS_ONLN */
+
+	return count > 0 ? (size_t)count : 1;
+}
+
 #if defined(__cplusplus)
 }
 #endif
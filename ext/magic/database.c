@@ -0,0 +1,557 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "database.h"
+
+static int magic_database_grow(magic_database_t *database, size_t *capacity);
+static int magic_database_map(magic_database_t *database);
+static int magic_database_map_path(const char *path, void **pointer,
+				   size_t *size);
+static int magic_database_map_file(int fd, size_t size, void **pointer);
+static void magic_database_unmap(magic_database_t *database);
+static void magic_database_list(magic_database_t *database);
+static void magic_database_unlist(magic_database_t *database);
+static int magic_database_empty(const char *path);
+static char *magic_database_compiled_path(const char *path);
+
+/*
+ * The databases that are not resolved yet, each of which has a lock that a
+ * thread might be holding while resolving it when the process forks, see
+ * magic_database_after_fork().
+ */
+static pthread_mutex_t magic_databases_lock = PTHREAD_MUTEX_INITIALIZER;
+static magic_database_t *magic_databases;
+
+static inline unsigned int
+swap_uint32(unsigned int value)
+{
+	return ((value & 0x000000ffU) << 24) |
+	       ((value & 0x0000ff00U) << 8)  |
+	       ((value & 0x00ff0000U) >> 8)  |
+	       ((value & 0xff000000U) >> 24);
+}
+
+static inline int
+open_flags(void)
+{
+	int flags = O_RDONLY;
+
+#if defined(HAVE_O_CLOEXEC)
+	flags |= O_CLOEXEC;
+#endif
+
+	return flags;
+}
+
+static magic_database_t *
+magic_database_alloc(void)
+{
+	magic_database_t *database;
+
+	database = calloc(1, sizeof(*database));
+	if (!database)
+		return NULL;
+
+	database->refcount = 1;
+	pthread_mutex_init(&database->lock, NULL);
+
+	return database;
+}
+
+/*
+ * Creates a database that refers to the Magic database files found in the
+ * colon-separated list of paths. The files themselves are not looked at until
+ * the database is resolved, which happens once, when the database is used to
+ * load a Magic cookie for the first time.
+ */
+magic_database_t *
+magic_database_new(const char *paths)
+{
+	magic_database_t *database;
+
+	database = magic_database_alloc();
+	if (!database)
+		return NULL;
+
+	database->paths = strdup(paths ? paths : "");
+	if (!database->paths) {
+		magic_database_unref(database);
+		return NULL;
+	}
+
+	magic_database_list(database);
+
+	return database;
+}
+
+/*
+ * Creates a database from a copy of the given compiled Magic database
+ * buffers. The Magic library uses the buffers in place, thus every cookie
+ * loaded from this database will share the same copy of the buffers.
+ */
+magic_database_t *
+magic_database_new_buffers(void **buffers, size_t *sizes, size_t count)
+{
+	magic_database_t *database;
+
+	database = magic_database_alloc();
+	if (!database)
+		return NULL;
+
+	database->resolved = 1;
+
+	database->pointers = calloc(count, sizeof(void *));
+	database->sizes = calloc(count, sizeof(size_t));
+	if (!database->pointers || !database->sizes)
+		goto error;
+
+	for (size_t i = 0; i < count; i++) {
+		database->pointers[i] = malloc(sizes[i] ? sizes[i] : 1);
+		if (!database->pointers[i])
+			goto error;
+
+		memcpy(database->pointers[i], buffers[i], sizes[i]);
+		database->sizes[i] = sizes[i];
+		database->count++;
+	}
+
+	return database;
+error:
+	magic_database_unref(database);
+	errno = ENOMEM;
+	return NULL;
+}
+
+magic_database_t *
+magic_database_ref(magic_database_t *database)
+{
+	if (database)
+		MAGIC_ATOMIC_INC(database->refcount);
+
+	return database;
+}
+
+void
+magic_database_unref(magic_database_t *database)
+{
+	if (!database || MAGIC_ATOMIC_DEC(database->refcount) > 0)
+		return;
+
+	magic_database_unlist(database);
+	magic_database_unmap(database);
+
+	pthread_mutex_destroy(&database->lock);
+
+	free(database->paths);
+	free(database);
+}
+
+/*
+ * Attempts to find a compiled Magic database file for every path, and to map
+ * each of them into memory, so that cookies can be loaded from the buffers
+ * without reading and parsing the files again. When this is not possible,
+ * for instance, when one of the paths refers to a source Magic file or to a
+ * directory, then the database falls back to loading from the paths.
+ */
+int
+magic_database_resolve(magic_database_t *database)
+{
+	assert(database != NULL &&
+	       "Must be a valid pointer to `magic_database_t' type");
+	/*
+	 * Once resolved, the database never changes, and thus the lock is not
+	 * needed, which also makes a database resolved before fork usable in
+	 * the child process regardless of the state of the lock.
+	 */
+	if (MAGIC_ATOMIC_LOAD(database->resolved))
+		return database->count > 0 ? 0 : -1;
+
+	pthread_mutex_lock(&database->lock);
+
+	if (!database->resolved) {
+		if (magic_database_map(database) < 0)
+			magic_database_unmap(database);
+
+		MAGIC_ATOMIC_STORE(database->resolved, 1);
+		magic_database_unlist(database);
+	}
+
+	pthread_mutex_unlock(&database->lock);
+
+	return database->count > 0 ? 0 : -1;
+}
+
+/*
+ * Only the thread that called fork exists in the child process, thus a
+ * database that some other thread was resolving is left with its lock held
+ * and with only some of its files mapped. Such a database is put back the
+ * way it was before it was first resolved, to be resolved again when used.
+ */
+void
+magic_database_after_fork(void)
+{
+	magic_database_t *database;
+
+	pthread_mutex_init(&magic_databases_lock, NULL);
+
+	for (database = magic_databases; database; database = database->next) {
+		pthread_mutex_init(&database->lock, NULL);
+		magic_database_unmap(database);
+	}
+}
+
+int
+magic_database_load(magic_database_t *database, magic_t magic, int flags)
+{
+	assert(database != NULL &&
+	       "Must be a valid pointer to `magic_database_t' type");
+
+	if (magic_database_resolve(database) == 0)
+		return magic_load_buffers_wrapper(magic,
+						  database->pointers,
+						  database->sizes,
+						  database->count,
+						  flags);
+
+	return magic_load_wrapper(magic, database->paths, flags);
+}
+
+magic_t
+magic_database_open(magic_database_t *database, int flags)
+{
+	int local_errno;
+	magic_t magic;
+
+	magic = magic_open_wrapper(flags);
+	if (!magic) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (magic_database_load(database, magic, flags) < 0) {
+		local_errno = errno;
+		magic_close_wrapper(magic);
+		errno = local_errno;
+		return NULL;
+	}
+
+	return magic;
+}
+
+static int
+magic_database_grow(magic_database_t *database, size_t *capacity)
+{
+	void **pointers;
+	size_t *sizes;
+	size_t n = *capacity ? *capacity * 2 : 4;
+
+	pointers = realloc(database->pointers, n * sizeof(void *));
+	if (pointers)
+		database->pointers = pointers;
+
+	sizes = realloc(database->sizes, n * sizeof(size_t));
+	if (sizes)
+		database->sizes = sizes;
+
+	if (!pointers || !sizes)
+		return -1;
+
+	*capacity = n;
+
+	return 0;
+}
+
+static int
+magic_database_map(magic_database_t *database)
+{
+	int rv = 0;
+	size_t size = 0, capacity = 0;
+	void *pointer = NULL;
+	char *paths, *path, *next;
+
+	paths = strdup(database->paths);
+	if (!paths)
+		return -1;
+
+#if defined(HAVE_SYS_MMAN_H)
+	database->mapped = 1;
+#endif /* HAVE_SYS_MMAN_H */
+
+	for (path = paths; path; path = next) {
+		next = strchr(path, MAGIC_DATABASE_SEPARATOR);
+		if (next)
+			*next++ = '\0';
+
+		if (*path == '\0')
+			continue;
+
+		if (database->count == capacity &&
+		    magic_database_grow(database, &capacity) < 0) {
+			rv = -1;
+			break;
+		}
+
+		rv = magic_database_map_path(path, &pointer, &size);
+		if (rv < 0)
+			break;
+
+		if (rv == 0)
+			continue;
+
+		database->pointers[database->count] = pointer;
+		database->sizes[database->count] = size;
+		database->count++;
+	}
+
+	free(paths);
+
+	if (rv < 0 || database->count == 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+magic_database_map_path(const char *path, void **pointer, size_t *size)
+{
+	int fd;
+	int local_errno;
+	char *compiled;
+	struct stat sb;
+	unsigned int magicno;
+
+	compiled = magic_database_compiled_path(path);
+	if (!compiled)
+		return -1;
+
+	fd = open(compiled, open_flags());
+	local_errno = errno;
+	free(compiled);
+
+	if (fd < 0) {
+		if (local_errno != ENOENT)
+			return -1;
+		/*
+		 * There is no compiled Magic database file for this path,
+		 * thus it is either a source Magic file, or it does not exist
+		 * at all, in which case the Magic library would skip it.
+		 */
+		return magic_database_empty(path);
+	}
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size < (off_t)(2 * sizeof(magicno)))
+		goto error;
+
+	*size = (size_t)sb.st_size;
+
+	if (magic_database_map_file(fd, *size, pointer) < 0)
+		goto error;
+
+	close(fd);
+
+	memcpy(&magicno, *pointer, sizeof(magicno));
+	if (magicno != MAGIC_DATABASE_MAGICNO &&
+	    swap_uint32(magicno) != MAGIC_DATABASE_MAGICNO) {
+#if defined(HAVE_SYS_MMAN_H)
+		munmap(*pointer, *size);
+#else
+		free(*pointer);
+#endif
+		return -1;
+	}
+
+	return 1;
+error:
+	close(fd);
+	return -1;
+}
+
+static int
+magic_database_map_file(int fd, size_t size, void **pointer)
+{
+#if defined(HAVE_SYS_MMAN_H)
+	/*
+	 * The mapping is private and writable only because the Magic library
+	 * swaps bytes in place when the database was compiled on a machine of
+	 * different endianness. Otherwise, the pages are never written to, and
+	 * thus are shared with every other process that maps the same file,
+	 * including processes forked from the current one.
+	 */
+	*pointer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (*pointer == MAP_FAILED) {
+		*pointer = NULL;
+		return -1;
+	}
+# if defined(MADV_WILLNEED)
+	madvise(*pointer, size, MADV_WILLNEED);
+# endif
+#else
+	ssize_t n;
+	size_t offset = 0;
+
+	*pointer = malloc(size);
+	if (!*pointer)
+		return -1;
+
+	while (offset < size) {
+		n = read(fd, (char *)*pointer + offset, size - offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			free(*pointer);
+			*pointer = NULL;
+			return -1;
+		}
+
+		offset += (size_t)n;
+	}
+#endif /* HAVE_SYS_MMAN_H */
+
+	return 0;
+}
+
+static void
+magic_database_list(magic_database_t *database)
+{
+	pthread_mutex_lock(&magic_databases_lock);
+
+	database->prev = NULL;
+	database->next = magic_databases;
+	if (magic_databases)
+		magic_databases->prev = database;
+
+	magic_databases = database;
+	database->listed = 1;
+
+	pthread_mutex_unlock(&magic_databases_lock);
+}
+
+static void
+magic_database_unlist(magic_database_t *database)
+{
+	pthread_mutex_lock(&magic_databases_lock);
+
+	if (database->listed) {
+		if (database->prev)
+			database->prev->next = database->next;
+		else
+			magic_databases = database->next;
+
+		if (database->next)
+			database->next->prev = database->prev;
+
+		database->prev = NULL;
+		database->next = NULL;
+		database->listed = 0;
+	}
+
+	pthread_mutex_unlock(&magic_databases_lock);
+}
+
+static void
+magic_database_unmap(magic_database_t *database)
+{
+	for (size_t i = 0; i < database->count; i++) {
+#if defined(HAVE_SYS_MMAN_H)
+		if (database->mapped) {
+			munmap(database->pointers[i], database->sizes[i]);
+			continue;
+		}
+#endif /* HAVE_SYS_MMAN_H */
+		free(database->pointers[i]);
+	}
+
+	free(database->pointers);
+	free(database->sizes);
+
+	database->pointers = NULL;
+	database->sizes = NULL;
+	database->count = 0;
+}
+
+/*
+ * Returns 0 when the source Magic file does not exist or consists only of
+ * comments and blank lines (such as the default /etc/magic file), since the
+ * Magic library would not load anything from it, or -1 otherwise.
+ */
+static int
+magic_database_empty(const char *path)
+{
+	int fd;
+	ssize_t n;
+	int comment = 0;
+	char buffer[BUFSIZ];
+	struct stat sb;
+
+	fd = open(path, open_flags());
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size > MAGIC_DATABASE_EMPTY_MAX)
+		goto error;
+
+	while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto error;
+		}
+
+		for (ssize_t i = 0; i < n; i++) {
+			if (buffer[i] == '\n') {
+				comment = 0;
+				continue;
+			}
+
+			if (comment)
+				continue;
+
+			if (buffer[i] == ' ' || buffer[i] == '\t' ||
+			    buffer[i] == '\r')
+				continue;
+
+			if (buffer[i] == '#') {
+				comment = 1;
+				continue;
+			}
+
+			goto error;
+		}
+	}
+
+	close(fd);
+	return 0;
+error:
+	close(fd);
+	return -1;
+}
+
+static char *
+magic_database_compiled_path(const char *path)
+{
+	char *compiled;
+	size_t length = strlen(path);
+	size_t extension = strlen(MAGIC_DATABASE_EXTENSION);
+
+	if (length >= extension &&
+	    strcmp(path + length - extension, MAGIC_DATABASE_EXTENSION) == 0)
+		return strdup(path);
+
+	compiled = malloc(length + extension + 1);
+	if (!compiled)
+		return NULL;
+
+	memcpy(compiled, path, length);
+	memcpy(compiled + length, MAGIC_DATABASE_EXTENSION, extension + 1);
+
+	return compiled;
+}
+
+#if defined(__cplusplus)
+}
+#endif
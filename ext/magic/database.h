@@ -0,0 +1,51 @@
+#if !defined(_DATABASE_H)
+#define _DATABASE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+#include "functions.h"
+
+#define MAGIC_DATABASE_SEPARATOR ':'
+#define MAGIC_DATABASE_EXTENSION ".mgc"
+
+#define MAGIC_DATABASE_MAGICNO	 0xF11E041C
+#define MAGIC_DATABASE_EMPTY_MAX (1024 * 1024)
+
+typedef struct magic_database {
+	struct magic_database *prev;
+	struct magic_database *next;
+	unsigned long refcount;
+	char *paths;
+	size_t count;
+	void **pointers;
+	size_t *sizes;
+	pthread_mutex_t lock;
+	int resolved;
+	unsigned int mapped:1;
+	unsigned int listed:1;
+} magic_database_t;
+
+extern magic_database_t *magic_database_new(const char *paths);
+extern magic_database_t *magic_database_new_buffers(void **buffers,
+						    size_t *sizes,
+						    size_t count);
+
+extern magic_database_t *magic_database_ref(magic_database_t *database);
+extern void magic_database_unref(magic_database_t *database);
+
+extern int magic_database_resolve(magic_database_t *database);
+extern int magic_database_load(magic_database_t *database, magic_t magic,
+			       int flags);
+
+extern magic_t magic_database_open(magic_database_t *database, int flags);
+
+extern void magic_database_after_fork(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _DATABASE_H */
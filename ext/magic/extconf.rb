@@ -401,8 +401,30 @@ def do_clean
 end
 
 have_func('rb_thread_call_without_gvl')
+have_func('rb_nogvl')
 have_func('rb_thread_blocking_region')
 have_func('rb_gc_mark_movable')
+have_func('rb_ext_ractor_safe')
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+have_func('rb_io_descriptor', 'ruby/io.h')
+
+if have_header('ruby/ractor.h')
+  have_func('rb_ractor_local_storage_value_newkey', 'ruby/ractor.h')
+end
+
+if have_header('ruby/fiber/scheduler.h')
+  have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+end
+
+if have_header('ruby/memory_view.h')
+  have_func('rb_memory_view_get', 'ruby/memory_view.h')
+end
+
+if have_header('ruby/io/buffer.h')
+  have_func('rb_io_buffer_get_bytes_for_reading', 'ruby/io/buffer.h')
+end
+
+have_library('pthread', 'pthread_create')
 
 unless have_header('magic.h')
   abort "\n" + (<<-EOS).gsub(/^[ ]{,3}/, '') + "\n"
@@ -458,6 +480,11 @@ def do_clean
   utime.h
   sys/types.h
   sys/time.h
+  sys/mman.h
+  sys/socket.h
+  dirent.h
+  fnmatch.h
+  linux/io_uring.h
 ].each do |h|
   have_header(h)
 end
@@ -465,10 +492,15 @@ def do_clean
 %w[
   utime
   utimes
+  fdopendir
+  fstatat
+  pipe2
 ].each do |f|
   have_func(f)
 end
 
+have_struct_member('struct dirent', 'd_type', 'dirent.h')
+
 create_header
 create_makefile('magic/magic')
 
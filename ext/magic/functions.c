@@ -4,12 +4,47 @@ extern "C" {
 
 #include "functions.h"
 
+#if defined(HAVE_WORKING_FORK)
+# include <sys/wait.h>
+#endif /* HAVE_WORKING_FORK */
+
 static int check_fd(int fd);
 static int safe_dup(int fd);
 static int safe_close(int fd);
 static int safe_cloexec(int fd);
 static int override_error_output(void *data);
 static int restore_error_output(void *data);
+static int redirect_error_output(save_t *s);
+static int reset_error_output(save_t *s);
+static int safe_write(int fd, const void *buffer, size_t size);
+static ssize_t safe_read(int fd, void *buffer, size_t size);
+static void capture_child(int fd, int trace, capture_function_t function,
+			  magic_t magic, void *data);
+static int capture_trace(capture_t *c, FILE *trace);
+
+/*
+ * The standard error output is shared by every thread in the process, thus
+ * it is redirected only once for as long as there is at least one call to
+ * the Magic library in progress, and restored after the last one completes.
+ */
+static pthread_mutex_t error_output_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long error_output_count;
+static save_t error_output;
+
+/*
+ * The debugging output of the Magic library is written to the standard
+ * error output, which is shared by every thread in the process, thus it
+ * is captured by identifying in a child process instead, whose standard
+ * error output is a temporary file owned by the call, and which sends the
+ * result back through a pipe, see magic_capture(). The standard error
+ * output of this process is never changed.
+ */
+typedef struct capture_header {
+	int status;
+	int error;
+	int magic_errno;
+	size_t length;
+} capture_header_t;
 
 static inline int
 check_fd(int fd)
@@ -93,18 +128,61 @@ error:
 
 static int
 override_error_output(void *data)
+{
+	int rv = 0;
+	save_t *s = data;
+
+	assert(s != NULL &&
+	       "Must be a valid pointer to `save_t' type");
+
+	pthread_mutex_lock(&error_output_lock);
+
+	if (error_output_count == 0)
+		rv = redirect_error_output(&error_output);
+
+	s->status = 0;
+	if (rv < 0)
+		s->status = errno;
+	else
+		error_output_count++;
+
+	pthread_mutex_unlock(&error_output_lock);
+
+	return rv;
+}
+
+static int
+restore_error_output(void *data)
+{
+	int rv = 0;
+	save_t *s = data;
+
+	assert(s != NULL &&
+	       "Must be a valid pointer to `save_t' type");
+
+	if (s->status != 0)
+		return -1;
+
+	pthread_mutex_lock(&error_output_lock);
+
+	if (--error_output_count == 0)
+		rv = reset_error_output(&error_output);
+
+	pthread_mutex_unlock(&error_output_lock);
+
+	return rv;
+}
+
+static int
+redirect_error_output(save_t *s)
 {
 	int local_errno;
 	int flags = O_WRONLY | O_APPEND;
-	save_t *s = data;
 
 #if defined(HAVE_O_CLOEXEC)
 	flags |= O_CLOEXEC;
 #endif
 
-	assert(s != NULL &&
-	       "Must be a valid pointer to `save_t' type");
-
 	s->file.old_fd = -1;
 	s->file.new_fd = -1;
 	s->status = -1;
@@ -151,13 +229,9 @@ error:
 }
 
 static int
-restore_error_output(void *data)
+reset_error_output(save_t *s)
 {
 	int local_errno;
-	save_t *s = data;
-
-	assert(s != NULL &&
-	       "Must be a valid pointer to `save_t' type");
 
 	if (s->file.old_fd < 0 && s->status != 0)
 		return -1;
@@ -325,7 +399,7 @@ magic_file_wrapper(magic_t magic, const char *filename, int flags)
 {
 	const char *cstring;
 
-	MAGIC_FUNCTION(magic_file, cstring, flags, magic, filename);
+	MAGIC_IDENTIFY_FUNCTION(magic_file, cstring, flags, magic, filename);
 
 	return cstring;
 }
@@ -335,7 +409,7 @@ magic_buffer_wrapper(magic_t magic, const void *buffer, size_t size, int flags)
 {
 	const char *cstring;
 
-	MAGIC_FUNCTION(magic_buffer, cstring, flags, magic, buffer, size);
+	MAGIC_IDENTIFY_FUNCTION(magic_buffer, cstring, flags, magic, buffer, size);
 
 	return cstring;
 }
@@ -351,7 +425,7 @@ magic_descriptor_wrapper(magic_t magic, int fd, int flags)
 		goto error;
 	}
 
-	MAGIC_FUNCTION(magic_descriptor, cstring, flags, magic, fd);
+	MAGIC_IDENTIFY_FUNCTION(magic_descriptor, cstring, flags, magic, fd);
 	return cstring;
 
 error:
@@ -365,6 +439,237 @@ magic_version_wrapper(void)
 	return magic_version();
 }
 
+/*
+ * Only the thread that called fork exists in the child process, thus a call
+ * to the Magic library that was in progress in any other thread will never
+ * complete, and the standard error output it redirected has to be restored.
+ */
+void
+magic_output_after_fork(void)
+{
+	pthread_mutex_init(&error_output_lock, NULL);
+
+	if (error_output_count > 0)
+		reset_error_output(&error_output);
+
+	error_output_count = 0;
+}
+
+static int
+safe_write(int fd, const void *buffer, size_t size)
+{
+	ssize_t n;
+	const char *p = buffer;
+
+	while (size > 0) {
+		n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		size -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static ssize_t
+safe_read(int fd, void *buffer, size_t size)
+{
+	ssize_t n;
+	size_t total = 0;
+	char *p = buffer;
+
+	while (total < size) {
+		n = read(fd, p + total, size - total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		total += (size_t)n;
+	}
+
+	return (ssize_t)total;
+}
+
+/*
+ * Runs in the child process, which has only the calling thread, and must
+ * not return, see magic_capture().
+ */
+static void
+capture_child(int fd, int trace, capture_function_t function, magic_t magic,
+	      void *data)
+{
+	const char *cstring;
+	capture_header_t header = { 0 };
+
+	if (dup2(trace, STDERR_FILENO) < 0)
+		_exit(127);
+
+	cstring = function(magic, data);
+	fflush(stderr);
+
+	if (!cstring) {
+		header.status = -1;
+		header.error = errno;
+		header.magic_errno = magic_errno_wrapper(magic);
+		cstring = magic_error_wrapper(magic);
+	}
+
+	if (cstring)
+		header.length = strlen(cstring);
+
+	if (safe_write(fd, &header, sizeof(header)) < 0 ||
+	    safe_write(fd, cstring, header.length) < 0)
+		_exit(127);
+
+	_exit(0);
+}
+
+static int
+capture_trace(capture_t *c, FILE *trace)
+{
+	struct stat sb;
+
+	if (fstat(fileno(trace), &sb) < 0)
+		return -1;
+
+	if (sb.st_size == 0)
+		return 0;
+
+	c->buffer = malloc((size_t)sb.st_size);
+	if (!c->buffer)
+		return -1;
+
+	if (lseek(fileno(trace), 0, SEEK_SET) < 0)
+		return -1;
+
+	c->size = (size_t)safe_read(fileno(trace), c->buffer,
+				    (size_t)sb.st_size);
+
+	return 0;
+}
+
+/*
+ * Identifies using the given function in a child process, and returns the
+ * result, or NULL when the Magic library failed, in which case the error
+ * message, if any, and the error number are returned instead. The result,
+ * or the error message, and the debugging output are allocated using
+ * malloc(), and must be released by the caller. When the child process
+ * could not be run, then -1 is returned and errno is set, otherwise 0.
+ */
+int
+magic_capture(magic_t magic, capture_t *c, capture_function_t function,
+	      void *data)
+{
+#if defined(HAVE_WORKING_FORK)
+	int status;
+	int local_errno;
+	int fds[2] = { -1, -1 };
+	pid_t pid;
+	FILE *trace;
+	capture_header_t header;
+#endif /* HAVE_WORKING_FORK */
+
+	assert(c != NULL &&
+	       "Must be a valid pointer to `capture_t' type");
+
+	*c = (capture_t) {
+		.status = -1,
+	};
+
+#if defined(HAVE_WORKING_FORK)
+	trace = tmpfile();
+	if (!trace)
+		return -1;
+
+	if (safe_cloexec(fileno(trace)) < 0) {
+		local_errno = errno;
+		goto error;
+	}
+
+#if defined(HAVE_PIPE2) && defined(HAVE_O_CLOEXEC)
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		local_errno = errno;
+		goto error;
+	}
+#else
+	if (pipe(fds) < 0 ||
+	    safe_cloexec(fds[0]) < 0 || safe_cloexec(fds[1]) < 0) {
+		local_errno = errno;
+		goto error;
+	}
+#endif /* HAVE_PIPE2 && HAVE_O_CLOEXEC */
+
+	pid = fork();
+	if (pid < 0) {
+		local_errno = errno;
+		goto error;
+	}
+
+	if (pid == 0) {
+		safe_close(fds[0]);
+		capture_child(fds[1], fileno(trace), function, magic, data);
+	}
+
+	safe_close(fds[1]);
+	fds[1] = -1;
+
+	if (safe_read(fds[0], &header, sizeof(header)) != sizeof(header)) {
+		header = (capture_header_t) {
+			.status = -1,
+			.magic_errno = -1,
+		};
+	}
+	else if (header.length > 0) {
+		c->message = malloc(header.length + 1);
+		if (c->message) {
+			if (safe_read(fds[0], c->message, header.length) < 0)
+				header.length = 0;
+
+			c->message[header.length] = '\0';
+		}
+	}
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	capture_trace(c, trace);
+
+	safe_close(fds[0]);
+	fclose(trace);
+
+	c->status = header.status;
+	c->magic_errno = header.magic_errno;
+
+	errno = header.error;
+	return 0;
+error:
+	safe_close(fds[0]);
+	safe_close(fds[1]);
+	fclose(trace);
+
+	errno = local_errno;
+	return -1;
+#else
+	UNUSED(magic);
+	UNUSED(function);
+	UNUSED(data);
+
+	errno = ENOSYS;
+	return -1;
+#endif /* HAVE_WORKING_FORK */
+}
+
 #if defined(__cplusplus)
 }
 #endif
@@ -19,6 +19,24 @@ extern "C" {
 		}					 \
 	} while (0)
 
+/*
+ * The Magic library only writes warnings to the standard error output while
+ * it parses the Magic database, which is when MAGIC_FUNCTION() is used, and
+ * otherwise reports errors through magic_error(). Identifying a file thus
+ * needs no redirection, which would cost about ten system calls each time,
+ * except when the content is decompressed, as older versions of the Magic
+ * library let the external programs they run write to it. As the standard
+ * error output is shared by the whole process, it stays redirected while any
+ * such identification is in progress; see the Magic::COMPRESS flag.
+ */
+#define MAGIC_IDENTIFY_FUNCTION(f, r, x, ...)			 \
+	do {							 \
+		if ((x) & MAGIC_COMPRESS)			 \
+			MAGIC_FUNCTION(f, r, (x), __VA_ARGS__);	 \
+		else						 \
+			r = f(__VA_ARGS__);			 \
+	} while (0)
+
 typedef struct file_data {
 	fpos_t position;
 	int old_fd;
@@ -30,6 +48,17 @@ typedef struct save {
 	int status;
 } save_t;
 
+typedef struct capture {
+	char *buffer;
+	size_t size;
+	char *message;
+	int magic_errno;
+	int status;
+	int error;
+} capture_t;
+
+typedef const char *(*capture_function_t)(magic_t magic, void *data);
+
 extern magic_t magic_open_wrapper(int flags);
 extern void magic_close_wrapper(magic_t magic);
 
@@ -66,6 +95,11 @@ extern const char *magic_descriptor_wrapper(magic_t magic, int fd,
 
 extern int magic_version_wrapper(void);
 
+extern void magic_output_after_fork(void);
+
+extern int magic_capture(magic_t magic, capture_t *c,
+			 capture_function_t function, void *data);
+
 #if defined(__cplusplus)
 }
 #endif
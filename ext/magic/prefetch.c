@@ -0,0 +1,909 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "prefetch.h"
+
+#if defined(MAGIC_PREFETCH_URING)
+typedef struct magic_uring {
+	int fd;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+} magic_uring_t;
+
+enum magic_uring_phase {
+	MAGIC_URING_STATX = 0,
+	MAGIC_URING_OPENAT,
+	MAGIC_URING_READ
+};
+#endif /* MAGIC_PREFETCH_URING */
+
+typedef struct magic_prefetch_state {
+	char *arena;
+	size_t arena_size;
+#if defined(MAGIC_PREFETCH_URING)
+	magic_uring_t ring;
+	int ring_state;
+	struct statx statx[MAGIC_PREFETCH_DEPTH];
+#endif /* MAGIC_PREFETCH_URING */
+} magic_prefetch_state_t;
+
+static pthread_key_t magic_prefetch_key;
+
+static magic_prefetch_state_t *magic_prefetch_current(void);
+static size_t magic_prefetch_window(magic_t magic, size_t size);
+static void magic_prefetch_free(void *data);
+static size_t magic_prefetch_bytes_max(const magic_params_t *params);
+static int magic_prefetch_layout(magic_prefetch_state_t *state,
+				 magic_prefetch_entry_t *entries, size_t count,
+				 size_t bytes_max);
+static void magic_prefetch_sync(magic_prefetch_state_t *state,
+				magic_prefetch_entry_t *entries, size_t count,
+				size_t bytes_max, int flags);
+static void magic_prefetch_read(magic_prefetch_entry_t *entry);
+static void magic_prefetch_close(magic_prefetch_entry_t *entries,
+				 size_t count);
+
+#if defined(MAGIC_PREFETCH_URING)
+static int magic_prefetch_uring(magic_prefetch_state_t *state,
+				magic_prefetch_entry_t *entries, size_t count,
+				size_t bytes_max, int flags);
+static int magic_uring_setup(magic_uring_t *ring, unsigned int entries);
+static void magic_uring_destroy(magic_uring_t *ring);
+static int magic_uring_run(magic_prefetch_state_t *state,
+			   magic_prefetch_entry_t *entries, size_t count,
+			   enum magic_uring_phase phase, int flags);
+static void magic_uring_prepare(magic_prefetch_state_t *state,
+				struct io_uring_sqe *sqe,
+				magic_prefetch_entry_t *entry, size_t index,
+				enum magic_uring_phase phase, int flags);
+static int magic_uring_complete(magic_prefetch_state_t *state,
+				magic_prefetch_entry_t *entry, size_t index,
+				enum magic_uring_phase phase, int result);
+#endif /* MAGIC_PREFETCH_URING */
+
+static inline int
+open_flags(void)
+{
+	int flags = O_RDONLY | O_NONBLOCK;
+
+#if defined(O_NOCTTY)
+	flags |= O_NOCTTY;
+#endif
+
+#if defined(HAVE_O_CLOEXEC)
+	flags |= O_CLOEXEC;
+#endif
+
+	return flags;
+}
+
+/*
+ * Only regular files are read ahead. The Magic library identifies other
+ * types of files, as well as files that have any of the special mode bits
+ * set, based on the result of stat(2), which a prefix read into memory
+ * does not carry.
+ */
+static inline int
+prefetch_eligible(mode_t mode, size_t size)
+{
+	return S_ISREG(mode) && !(mode & (S_ISUID | S_ISGID | S_ISVTX)) &&
+	       size > 0;
+}
+
+/*
+ * Some formats are identified from more than the beginning of the file,
+ * which the Magic library can only read given a file descriptor, such as the
+ * sections of ELF executables, or the size of the uncompressed data, which
+ * is kept at the end of gzip compressed files.
+ */
+static inline int
+map_eligible(const void *pointer, size_t length)
+{
+	static const unsigned char elf[] = { 0x7f, 'E', 'L', 'F' };
+	static const unsigned char gzip[] = { 0x1f, 0x8b };
+
+	if (length >= sizeof(elf) && memcmp(pointer, elf, sizeof(elf)) == 0)
+		return 0;
+
+	if (length >= sizeof(gzip) && memcmp(pointer, gzip, sizeof(gzip)) == 0)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Creates the key under which each thread keeps the buffers (and the ring,
+ * when io_uring is available) used to read files ahead. These are freed when
+ * the thread exits.
+ */
+int
+magic_prefetch_init(void)
+{
+	return pthread_key_create(&magic_prefetch_key, magic_prefetch_free);
+}
+
+/*
+ * Reads the prefix of each of the given files that the Magic library would
+ * otherwise read itself, that is at most as many bytes as the "bytes_max"
+ * parameter allows, at once, and keeps the files open until identified, see
+ * magic_prefetch_identify(). On Linux, the files are read using
+ * io_uring, so that all of them are being read concurrently, otherwise, or
+ * when io_uring is not available, one after another by the current thread.
+ *
+ * Files that cannot be read ahead, for any reason, are left for the Magic
+ * library to open and read.
+ */
+void
+magic_prefetch(magic_prefetch_entry_t *entries, size_t count,
+	       const magic_params_t *params, int flags)
+{
+	size_t bytes_max;
+	magic_prefetch_state_t *state;
+
+	assert(entries != NULL &&
+	       "Must be a valid pointer to `magic_prefetch_entry_t' type");
+
+	for (size_t i = 0; i < count; i++) {
+		entries[i].buffer = NULL;
+		entries[i].length = 0;
+		entries[i].size = 0;
+		entries[i].mode = 0;
+		entries[i].fd = -1;
+		entries[i].ready = 0;
+	}
+	/*
+	 * Reading a file changes its access time, which the Magic library
+	 * would restore afterwards, thus leave such files to the library.
+	 */
+	if (flags & MAGIC_PRESERVE_ATIME)
+		return;
+
+	state = magic_prefetch_current();
+	if (!state)
+		return;
+
+	bytes_max = magic_prefetch_bytes_max(params);
+
+#if defined(MAGIC_PREFETCH_URING)
+	if (magic_prefetch_uring(state, entries, count, bytes_max, flags) == 0)
+		return;
+#endif /* MAGIC_PREFETCH_URING */
+
+	magic_prefetch_sync(state, entries, count, bytes_max, flags);
+}
+
+/*
+ * Identifies the file that was read ahead from the buffer it was read into,
+ * the same way as a file mapped into memory is, see magic_prefetch_map().
+ * Files that the Magic library identifies from more than their beginning,
+ * such as ELF executables, see map_eligible(), are identified through the
+ * file descriptor that is still open instead, with the beginning of the
+ * file then read from the page cache. Files that were not read ahead are
+ * identified by their path.
+ */
+const char *
+magic_prefetch_identify(magic_t magic, magic_prefetch_entry_t *entry,
+			int flags)
+{
+	const char *cstring;
+
+	assert(entry != NULL &&
+	       "Must be a valid pointer to `magic_prefetch_entry_t' type");
+
+	if (!entry->ready || entry->fd < 0)
+		return magic_file_wrapper(magic, entry->path, flags);
+
+	if (map_eligible(entry->buffer, entry->size))
+		cstring = magic_buffer_wrapper(magic, entry->buffer,
+					       entry->size, flags);
+	else
+		cstring = magic_descriptor_wrapper(magic, entry->fd, flags);
+
+	close(entry->fd);
+	entry->fd = -1;
+
+	return cstring;
+}
+
+/*
+ * Returns the number of files that each of the given number of threads
+ * should read ahead at once, such that all of the threads together keep at
+ * most a quarter of the file descriptors that the process may open.
+ */
+size_t
+magic_prefetch_depth(size_t threads)
+{
+	size_t depth = MAGIC_PREFETCH_DEPTH;
+#if defined(RLIMIT_NOFILE)
+	struct rlimit limit;
+
+	if (threads > 0 && getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+	    limit.rlim_cur != RLIM_INFINITY &&
+	    limit.rlim_cur / 4 / threads < depth)
+		depth = (size_t)(limit.rlim_cur / 4 / threads);
+#else
+	UNUSED(threads);
+#endif /* RLIMIT_NOFILE */
+
+	return depth > 0 ? depth : 1;
+}
+
+void
+magic_prefetch_release(magic_prefetch_entry_t *entries, size_t count)
+{
+	magic_prefetch_state_t *state;
+
+	magic_prefetch_close(entries, count);
+
+	for (size_t i = 0; i < count; i++) {
+		entries[i].buffer = NULL;
+		entries[i].ready = 0;
+	}
+
+	state = pthread_getspecific(magic_prefetch_key);
+	if (!state || state->arena_size <= MAGIC_PREFETCH_KEEP)
+		return;
+
+	free(state->arena);
+	state->arena = NULL;
+	state->arena_size = 0;
+}
+
+/*
+ * Identifies the file from a private read-only mapping of its beginning, of
+ * at most as many bytes as the "bytes_max" parameter allows, which is faulted
+ * in at once, rather than have the Magic library allocate a buffer and read
+ * the file into it.
+ *
+ * Files that the Magic library identifies based on the result of stat(2), or
+ * from more than their beginning, see map_eligible(), are identified either
+ * by their path, or through the file descriptor, the same way as otherwise.
+ *
+ * A file that is truncated while being mapped causes SIGBUS on access, thus
+ * this is only meant for files that do not change while being identified.
+ */
+const char *
+magic_prefetch_map(magic_t magic, const char *path, int flags)
+{
+	const char *cstring;
+	magic_prefetch_view_t view;
+
+	magic_prefetch_view_open(magic, &view, path, flags);
+	cstring = magic_prefetch_view_identify(magic, &view, flags);
+	magic_prefetch_view_close(&view);
+
+	return cstring;
+}
+
+/*
+ * Maps the beginning of the file into memory once, so that it can then be
+ * identified many times over, for instance, using different flags, see
+ * magic_prefetch_view_identify(). When the file cannot be identified from
+ * its beginning alone, it is left open instead, or not opened at all, see
+ * magic_prefetch_map().
+ */
+void
+magic_prefetch_view_open(magic_t magic, magic_prefetch_view_t *view,
+			 const char *path, int flags)
+{
+#if defined(HAVE_SYS_MMAN_H)
+	int rv;
+	void *pointer;
+	struct stat sb;
+	int mmap_flags = MAP_PRIVATE;
+#endif /* HAVE_SYS_MMAN_H */
+
+	*view = (magic_prefetch_view_t) {
+		.path = path,
+		.fd = -1,
+	};
+
+#if defined(HAVE_SYS_MMAN_H)
+	if (flags & MAGIC_PRESERVE_ATIME)
+		return;
+
+	if (flags & MAGIC_SYMLINK)
+		rv = stat(path, &sb);
+	else
+		rv = lstat(path, &sb);
+
+	if (rv < 0 || !prefetch_eligible(sb.st_mode, (size_t)sb.st_size))
+		return;
+
+	view->fd = open(path, open_flags());
+	if (view->fd < 0)
+		return;
+	/*
+	 * The file could have been replaced in the meantime, thus what was
+	 * opened is what has to be eligible.
+	 */
+	if (fstat(view->fd, &sb) < 0 ||
+	    !prefetch_eligible(sb.st_mode, (size_t)sb.st_size)) {
+		close(view->fd);
+		view->fd = -1;
+		return;
+	}
+
+	view->length = magic_prefetch_window(magic, (size_t)sb.st_size);
+
+# if defined(MAP_POPULATE)
+	mmap_flags |= MAP_POPULATE;
+# endif
+
+	pointer = mmap(NULL, view->length, PROT_READ, mmap_flags, view->fd, 0);
+	if (pointer == MAP_FAILED)
+		return;
+
+	if (!map_eligible(pointer, view->length)) {
+		munmap(pointer, view->length);
+		return;
+	}
+
+	view->pointer = pointer;
+#else
+	UNUSED(magic);
+	UNUSED(flags);
+#endif /* HAVE_SYS_MMAN_H */
+}
+
+const char *
+magic_prefetch_view_identify(magic_t magic, const magic_prefetch_view_t *view,
+			     int flags)
+{
+	if (view->pointer)
+		return magic_buffer_wrapper(magic, view->pointer, view->length,
+					    flags);
+
+	if (view->fd >= 0)
+		return magic_descriptor_wrapper(magic, view->fd, flags);
+
+	return magic_file_wrapper(magic, view->path, flags);
+}
+
+void
+magic_prefetch_view_close(magic_prefetch_view_t *view)
+{
+#if defined(HAVE_SYS_MMAN_H)
+	if (view->pointer)
+		munmap(view->pointer, view->length);
+#endif /* HAVE_SYS_MMAN_H */
+
+	if (view->fd >= 0)
+		close(view->fd);
+
+	view->pointer = NULL;
+	view->fd = -1;
+}
+
+static magic_prefetch_state_t *
+magic_prefetch_current(void)
+{
+	magic_prefetch_state_t *state;
+
+	state = pthread_getspecific(magic_prefetch_key);
+	if (state)
+		return state;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
+
+	if (pthread_setspecific(magic_prefetch_key, state) != 0) {
+		free(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+static void
+magic_prefetch_free(void *data)
+{
+	magic_prefetch_state_t *state = data;
+
+#if defined(MAGIC_PREFETCH_URING)
+	if (state->ring_state > 0)
+		magic_uring_destroy(&state->ring);
+#endif /* MAGIC_PREFETCH_URING */
+
+	free(state->arena);
+	free(state);
+}
+
+/*
+ * Returns how much of a file of the given size the Magic library would read,
+ * as per the "bytes_max" parameter of the given Magic object.
+ */
+static size_t
+magic_prefetch_window(magic_t magic, size_t size)
+{
+	size_t bytes_max = MAGIC_PREFETCH_BYTES_MAX;
+
+#if defined(MAGIC_PARAM_BYTES_MAX)
+	size_t value = 0;
+
+	if (magic_getparam_wrapper(magic, MAGIC_PARAM_BYTES_MAX, &value) == 0 &&
+	    value > 0)
+		bytes_max = value;
+#else
+	UNUSED(magic);
+#endif /* MAGIC_PARAM_BYTES_MAX */
+
+	return size < bytes_max ? size : bytes_max;
+}
+
+static size_t
+magic_prefetch_bytes_max(const magic_params_t *params)
+{
+#if defined(MAGIC_PARAM_BYTES_MAX)
+	if (params && params->count > MAGIC_PARAM_BYTES_MAX &&
+	    params->values[MAGIC_PARAM_BYTES_MAX] > 0)
+		return params->values[MAGIC_PARAM_BYTES_MAX];
+#else
+	UNUSED(params);
+#endif /* MAGIC_PARAM_BYTES_MAX */
+
+	return MAGIC_PREFETCH_BYTES_MAX;
+}
+
+/*
+ * Sets aside a buffer for each file that can be read ahead, all of them
+ * carved out of a single allocation that the thread keeps between calls.
+ * Once the buffers would exceed the budget, the remaining files are left
+ * for the Magic library to read.
+ */
+static int
+magic_prefetch_layout(magic_prefetch_state_t *state,
+		      magic_prefetch_entry_t *entries, size_t count,
+		      size_t bytes_max)
+{
+	char *arena;
+	size_t offset = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!prefetch_eligible(entries[i].mode, entries[i].size))
+			continue;
+
+		entries[i].length = entries[i].size < bytes_max ?
+				    entries[i].size : bytes_max;
+
+		if (offset + entries[i].length > MAGIC_PREFETCH_BUDGET) {
+			entries[i].length = 0;
+			continue;
+		}
+
+		offset += entries[i].length;
+	}
+
+	if (offset == 0)
+		return 0;
+
+	if (offset > state->arena_size) {
+		arena = realloc(state->arena, offset);
+		if (!arena) {
+			for (size_t i = 0; i < count; i++)
+				entries[i].length = 0;
+
+			return 0;
+		}
+
+		state->arena = arena;
+		state->arena_size = offset;
+	}
+
+	offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		entries[i].size = 0;
+		if (entries[i].length == 0)
+			continue;
+
+		entries[i].buffer = state->arena + offset;
+		offset += entries[i].length;
+	}
+
+	return 1;
+}
+
+static void
+magic_prefetch_sync(magic_prefetch_state_t *state,
+		    magic_prefetch_entry_t *entries, size_t count,
+		    size_t bytes_max, int flags)
+{
+	int rv;
+	struct stat sb;
+
+	for (size_t i = 0; i < count; i++) {
+		if (flags & MAGIC_SYMLINK)
+			rv = stat(entries[i].path, &sb);
+		else
+			rv = lstat(entries[i].path, &sb);
+
+		if (rv < 0)
+			continue;
+
+		entries[i].mode = sb.st_mode;
+		entries[i].size = (size_t)sb.st_size;
+	}
+
+	if (!magic_prefetch_layout(state, entries, count, bytes_max))
+		return;
+
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i].length == 0)
+			continue;
+
+		entries[i].fd = open(entries[i].path, open_flags());
+		if (entries[i].fd < 0)
+			continue;
+
+		magic_prefetch_read(&entries[i]);
+	}
+}
+
+static void
+magic_prefetch_read(magic_prefetch_entry_t *entry)
+{
+	ssize_t n;
+
+	while (entry->size < entry->length) {
+		n = pread(entry->fd, entry->buffer + entry->size,
+			  entry->length - entry->size, (off_t)entry->size);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			close(entry->fd);
+			entry->fd = -1;
+			return;
+		}
+
+		if (n == 0)
+			break;
+
+		entry->size += (size_t)n;
+	}
+
+	entry->ready = 1;
+}
+
+static void
+magic_prefetch_close(magic_prefetch_entry_t *entries, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i].fd < 0)
+			continue;
+
+		close(entries[i].fd);
+		entries[i].fd = -1;
+	}
+}
+
+#if defined(MAGIC_PREFETCH_URING)
+/*
+ * Reads the files in three rounds of requests submitted to the ring at once:
+ * statx(2) for every file, then openat(2) and read(2) for the files that can
+ * be read ahead. Returns -1 when the ring cannot be used at all, in which
+ * case nothing was read, and the files should be read some other way.
+ */
+static int
+magic_prefetch_uring(magic_prefetch_state_t *state,
+		     magic_prefetch_entry_t *entries, size_t count,
+		     size_t bytes_max, int flags)
+{
+	if (state->ring_state == 0) {
+		state->ring_state = -1;
+		if (magic_uring_setup(&state->ring, MAGIC_PREFETCH_DEPTH) == 0)
+			state->ring_state = 1;
+	}
+
+	if (state->ring_state < 0)
+		return -1;
+
+	for (size_t i = 0; i < count; i += MAGIC_PREFETCH_DEPTH) {
+		size_t n = count - i;
+
+		if (n > MAGIC_PREFETCH_DEPTH)
+			n = MAGIC_PREFETCH_DEPTH;
+
+		if (magic_uring_run(state, entries + i, n, MAGIC_URING_STATX,
+				    flags) < 0)
+			goto error;
+	}
+
+	if (!magic_prefetch_layout(state, entries, count, bytes_max))
+		return 0;
+
+	for (size_t i = 0; i < count; i += MAGIC_PREFETCH_DEPTH) {
+		size_t n = count - i;
+
+		if (n > MAGIC_PREFETCH_DEPTH)
+			n = MAGIC_PREFETCH_DEPTH;
+
+		if (magic_uring_run(state, entries + i, n, MAGIC_URING_OPENAT,
+				    flags) < 0 ||
+		    magic_uring_run(state, entries + i, n, MAGIC_URING_READ,
+				    flags) < 0)
+			goto error;
+	}
+
+	return 0;
+error:
+	/*
+	 * The kernel does not support some of the requests, thus do not use
+	 * the ring on this thread anymore.
+	 */
+	magic_prefetch_close(entries, count);
+	magic_uring_destroy(&state->ring);
+	state->ring_state = -1;
+
+	for (size_t i = 0; i < count; i++) {
+		entries[i].buffer = NULL;
+		entries[i].length = 0;
+		entries[i].size = 0;
+		entries[i].mode = 0;
+		entries[i].ready = 0;
+	}
+
+	return -1;
+}
+
+static int
+magic_uring_setup(magic_uring_t *ring, unsigned int entries)
+{
+	int local_errno;
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->sq_ring = MAP_FAILED;
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_size = params.sq_off.array +
+			params.sq_entries * sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto error;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto error;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring +
+					 params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+					 params.sq_off.ring_mask);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+					 params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+					     params.cq_off.cqes);
+	/*
+	 * Every request is placed in the slot of the same index as the entry
+	 * in the submission queue, thus the indirection array never changes.
+	 */
+	for (unsigned int i = 0; i < params.sq_entries; i++)
+		((unsigned int *)((char *)ring->sq_ring +
+				  params.sq_off.array))[i] = i;
+
+	return 0;
+error:
+	local_errno = errno;
+	magic_uring_destroy(ring);
+	errno = local_errno;
+	return -1;
+}
+
+static void
+magic_uring_destroy(magic_uring_t *ring)
+{
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_size);
+
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_size);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	ring->sq_ring = MAP_FAILED;
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->fd = -1;
+}
+
+/*
+ * Submits one request for each of the given entries that needs one in the
+ * given phase, and waits until all of them have completed, since the kernel
+ * writes into the buffers and the statx structures until then. Returns -1
+ * when the kernel does not support the requests of the given phase.
+ */
+static int
+magic_uring_run(magic_prefetch_state_t *state,
+		magic_prefetch_entry_t *entries, size_t count,
+		enum magic_uring_phase phase, int flags)
+{
+	int rv;
+	int unsupported = 0;
+	unsigned int head, tail, mask;
+	unsigned int pending = 0, submitted = 0, completed = 0;
+	magic_uring_t *ring = &state->ring;
+
+	tail = *ring->sq_tail;
+	mask = *ring->sq_mask;
+
+	for (size_t i = 0; i < count; i++) {
+		if (phase != MAGIC_URING_STATX && entries[i].length == 0)
+			continue;
+
+		if (phase == MAGIC_URING_READ && entries[i].fd < 0)
+			continue;
+
+		magic_uring_prepare(state, &ring->sqes[(tail + pending) & mask],
+				    &entries[i], i, phase, flags);
+		pending++;
+	}
+
+	if (pending == 0)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, tail + pending, __ATOMIC_RELEASE);
+
+	while (completed < pending) {
+		rv = (int)syscall(__NR_io_uring_enter, ring->fd,
+				  pending - submitted, 1,
+				  IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rv < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY || submitted > completed)
+				continue;
+
+			return -1;
+		}
+
+		submitted += (unsigned int)rv;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe;
+
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			if (magic_uring_complete(state,
+						 &entries[cqe->user_data],
+						 (size_t)cqe->user_data,
+						 phase, cqe->res) < 0)
+				unsupported = 1;
+
+			head++;
+			completed++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return unsupported ? -1 : 0;
+}
+
+static void
+magic_uring_prepare(magic_prefetch_state_t *state, struct io_uring_sqe *sqe,
+		    magic_prefetch_entry_t *entry, size_t index,
+		    enum magic_uring_phase phase, int flags)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (__u64)index;
+
+	switch (phase) {
+	case MAGIC_URING_STATX:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (__u64)(uintptr_t)entry->path;
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE;
+		sqe->off = (__u64)(uintptr_t)&state->statx[index];
+		sqe->statx_flags = (flags & MAGIC_SYMLINK) ?
+				   0 : AT_SYMLINK_NOFOLLOW;
+		break;
+	case MAGIC_URING_OPENAT:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (__u64)(uintptr_t)entry->path;
+		sqe->open_flags = (__u32)open_flags();
+		break;
+	case MAGIC_URING_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = entry->fd;
+		sqe->addr = (__u64)(uintptr_t)entry->buffer;
+		sqe->len = (__u32)entry->length;
+		sqe->off = 0;
+		break;
+	}
+}
+
+static int
+magic_uring_complete(magic_prefetch_state_t *state,
+		     magic_prefetch_entry_t *entry, size_t index,
+		     enum magic_uring_phase phase, int result)
+{
+	/*
+	 * A kernel that does not know a request fails it with EINVAL, which
+	 * none of the requests would fail with otherwise.
+	 */
+	if (result == -EINVAL)
+		return -1;
+
+	if (result < 0) {
+		if (phase == MAGIC_URING_READ) {
+			close(entry->fd);
+			entry->fd = -1;
+		}
+		return 0;
+	}
+
+	switch (phase) {
+	case MAGIC_URING_STATX:
+		entry->mode = state->statx[index].stx_mode;
+		entry->size = (size_t)state->statx[index].stx_size;
+		break;
+	case MAGIC_URING_OPENAT:
+		entry->fd = result;
+		break;
+	case MAGIC_URING_READ:
+		entry->size = (size_t)result;
+		entry->ready = 1;
+		break;
+	}
+
+	return 0;
+}
+#endif /* MAGIC_PREFETCH_URING */
+
+#if defined(__cplusplus)
+}
+#endif
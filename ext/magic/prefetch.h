@@ -0,0 +1,72 @@
+#if !defined(_PREFETCH_H)
+#define _PREFETCH_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+#include "functions.h"
+#include "cache.h"
+
+#include <sys/resource.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && \
+    defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS) && \
+    defined(STATX_TYPE)
+# define MAGIC_PREFETCH_URING 1
+#endif
+
+#define MAGIC_PREFETCH_DEPTH	  64
+#define MAGIC_PREFETCH_BUDGET	  (16 * 1024 * 1024)
+#define MAGIC_PREFETCH_KEEP	  (1024 * 1024)
+#define MAGIC_PREFETCH_BYTES_MAX (1024 * 1024)
+
+typedef struct magic_prefetch_view {
+	const char *path;
+	void *pointer;
+	size_t length;
+	int fd;
+} magic_prefetch_view_t;
+
+typedef struct magic_prefetch_entry {
+	const char *path;
+	char *buffer;
+	size_t length;
+	size_t size;
+	mode_t mode;
+	int fd;
+	int ready;
+} magic_prefetch_entry_t;
+
+extern int magic_prefetch_init(void);
+
+extern void magic_prefetch(magic_prefetch_entry_t *entries, size_t count,
+			   const magic_params_t *params, int flags);
+extern size_t magic_prefetch_depth(size_t threads);
+extern const char *magic_prefetch_identify(magic_t magic,
+					   magic_prefetch_entry_t *entry,
+					   int flags);
+extern void magic_prefetch_release(magic_prefetch_entry_t *entries,
+				   size_t count);
+
+extern const char *magic_prefetch_map(magic_t magic, const char *path,
+				      int flags);
+extern void magic_prefetch_view_open(magic_t magic,
+				     magic_prefetch_view_t *view,
+				     const char *path, int flags);
+extern const char *magic_prefetch_view_identify(magic_t magic,
+						const magic_prefetch_view_t *view,
+						int flags);
+extern void magic_prefetch_view_close(magic_prefetch_view_t *view);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _PREFETCH_H */
@@ -8,10 +8,28 @@ static int rb_mgc_do_not_auto_load;
 static int rb_mgc_do_not_stop_on_error;
 static int rb_mgc_warning;
 
+static unsigned long rb_mgc_generation;
+static magic_database_t *rb_mgc_default_database;
+static pthread_mutex_t rb_mgc_default_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static rb_mgc_intern_t rb_mgc_intern = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static VALUE rb_mgc_intern_holder = Qnil;
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+static rb_ractor_local_key_t rb_mgc_current_key;
+#else
+static VALUE rb_mgc_current_magic = Qnil;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+
 static ID id_at_flags;
 static ID id_at_paths;
 
 static VALUE rb_cMagic;
+static VALUE rb_cMagicPool;
+static VALUE rb_cMagicStream;
+static VALUE rb_cMagicResult;
 
 static VALUE rb_mgc_eError;
 static VALUE rb_mgc_eMagicError;
@@ -19,8 +37,14 @@ static VALUE rb_mgc_eLibraryError;
 static VALUE rb_mgc_eNotImplementedError;
 static VALUE rb_mgc_eParameterError;
 static VALUE rb_mgc_eFlagsError;
+static VALUE rb_mgc_eTimeoutError;
 
 static const rb_data_type_t rb_mgc_type;
+static const rb_data_type_t rb_mgc_pool_type;
+static const rb_data_type_t rb_mgc_stream_type;
+static const rb_data_type_t rb_mgc_batch_type;
+static const rb_data_type_t rb_mgc_intern_type;
+static const rb_data_type_t rb_mgc_report_type;
 
 static VALUE magic_get_parameter_internal(void *data);
 static VALUE magic_set_parameter_internal(void *data);
@@ -39,23 +63,47 @@ static VALUE magic_buffer_internal(void *data);
 static VALUE magic_descriptor_internal(void *data);
 
 static VALUE magic_close_internal(void *data);
+static VALUE magic_batch_internal(void *data);
+static VALUE magic_scan_internal(void *data);
+static VALUE magic_offload_internal(void *data);
+static VALUE magic_copy_internal(void *data);
 
 static void *nogvl_magic_load(void *data);
 static void *nogvl_magic_compile(void *data);
 static void *nogvl_magic_check(void *data);
+static const char *magic_file_identify(magic_t cookie, void *data);
+static const char *magic_buffer_identify(magic_t cookie, void *data);
+static const char *magic_descriptor_identify(magic_t cookie, void *data);
+static const char *magic_identify_call(rb_mgc_arguments_t *mga,
+				       capture_function_t function);
+
 static void *nogvl_magic_file(void *data);
+static void *nogvl_magic_buffer(void *data);
 static void *nogvl_magic_descriptor(void *data);
+static void *nogvl_magic_identify(void *data);
+static void *nogvl_magic_copy(void *data);
+static void *nogvl_magic_preload(void *data);
+static void *nogvl_magic_lock(void *data);
+static void *nogvl_magic_file_type(void *data);
+static void *nogvl_magic_buffer_type(void *data);
+static void *nogvl_magic_descriptor_type(void *data);
+static void *nogvl_magic_batch_wait(void *data);
+static void *nogvl_magic_batch_drain(void *data);
+static void *nogvl_magic_scan_wait(void *data);
+static void *nogvl_magic_scan_drain(void *data);
 
 static void *magic_library_open(void);
 static void magic_library_close(void *data);
 
+static magic_t magic_cookie_acquire(rb_mgc_object_t *mgc, int flags,
+				    int *restore);
+static void magic_cookie_release(rb_mgc_object_t *mgc, int restore);
+static void magic_cookies_close(rb_mgc_object_t *mgc);
+
 static VALUE magic_allocate(VALUE klass);
 static void magic_mark(void *data);
 static void magic_free(void *data);
 static size_t magic_size(const void *data);
-#if defined(HAVE_RUBY_GC_COMPACT)
-static void magic_compact(void *data);
-#endif
 
 static VALUE magic_exception_wrapper(VALUE value);
 static VALUE magic_exception(void *data);
@@ -67,14 +115,163 @@ static VALUE magic_generic_error(VALUE klass, int magic_errno,
 static VALUE magic_lock(VALUE object, VALUE (*function)(ANYARGS),
 			void *data);
 static VALUE magic_unlock(VALUE object);
+static void magic_lock_unblock(void *data);
 
 static VALUE magic_return(void *data);
+static VALUE magic_strip_result(const char *start, const char *end,
+				int intern);
+static VALUE magic_split_result(const char *result, const char *separator,
+				int intern);
+static VALUE magic_result_string(const char *pointer, long length,
+				 int intern);
+static VALUE magic_intern(const char *pointer, long length);
+static VALUE magic_file_into(VALUE object, VALUE value, VALUE options,
+			     VALUE into);
+static VALUE magic_buffer_into(VALUE object, VALUE value, VALUE options,
+			       VALUE into);
+static VALUE magic_descriptor_into(VALUE object, VALUE value, VALUE options,
+				   VALUE into);
+static VALUE magic_descriptor_flags(VALUE object, VALUE value, int flags,
+				    VALUE into, int debug);
+static int magic_debug_p(VALUE value);
+static VALUE magic_debug_return(rb_mgc_arguments_t *mga, VALUE value,
+				VALUE trace);
+static VALUE magic_capture_value(rb_mgc_arguments_t *mga, VALUE *message);
+static VALUE magic_identify_error(VALUE klass, rb_mgc_arguments_t *mga);
+static VALUE magic_result_into(VALUE into, const char *result, int flags);
+static void magic_check_into(VALUE value);
+static void magic_identify_views(VALUE value, rb_mgc_identify_t *identify);
+static int magic_identify_input(VALUE object, VALUE value,
+				rb_mgc_identify_t *identify);
+static VALUE magic_identify_return(VALUE data);
+static VALUE magic_report_return(VALUE data);
+static VALUE magic_report_field(VALUE object, enum magic_report_field field);
+static VALUE magic_report_parse(rb_mgc_report_t *mgr,
+				enum magic_report_field field);
+static VALUE magic_report_string(const char *start, const char *end,
+				 int intern);
+static VALUE magic_report_array(const char *value, const char *separator,
+				int intern);
+static VALUE magic_identify_cleanup(VALUE data);
+static VALUE magic_identify_internal(void *data);
+static VALUE magic_string_lock(VALUE value, int *locked);
+static int magic_bytes_p(VALUE value);
+static void magic_bytes_lock(VALUE value, rb_mgc_bytes_t *bytes);
+static int magic_io_mapped(VALUE value);
+static size_t magic_io_length(VALUE object);
+static VALUE magic_io_peek(VALUE value, size_t length);
+static int magic_io_socket_p(VALUE io, int *pending);
+static VALUE magic_io_recv(VALUE io, size_t length);
+static VALUE magic_io_tell(VALUE value);
+static VALUE magic_io_read(VALUE data);
+static VALUE magic_io_unseekable(VALUE data, VALUE error);
+static VALUE magic_io_read_partial(VALUE data);
+static VALUE magic_io_readpartial(VALUE data);
+static VALUE magic_io_eof(VALUE data, VALUE error);
+static VALUE magic_io_seek(VALUE data);
+static void magic_bytes_range(VALUE offset, VALUE length,
+			      struct buffer *buffer);
+static int magic_bytes_slice(const rb_mgc_bytes_t *bytes,
+			     struct buffer *buffer);
+static void magic_bytes_unlock(rb_mgc_bytes_t *bytes);
+
+static magic_database_t *magic_default_database(void);
+static magic_database_t *magic_shared_database(void);
+
+static VALUE magic_type_return(rb_mgc_arguments_t *mga);
+
+static void magic_after_fork(void);
+static void magic_fork_check(VALUE object, rb_mgc_object_t *mgc);
+
+static VALUE magic_default_paths(void);
 
 static int magic_get_flags(VALUE object);
 static void magic_set_flags(VALUE object, int flags);
+static int magic_call_flags(VALUE object, VALUE value);
 
 static VALUE magic_set_paths(VALUE object, VALUE value);
 
+static VALUE magic_pool_allocate(VALUE klass);
+static void magic_pool_mark(void *data);
+static void magic_pool_free(void *data);
+static size_t magic_pool_size(const void *data);
+#if defined(HAVE_RUBY_GC_COMPACT)
+static void magic_pool_compact(void *data);
+#endif
+
+static VALUE magic_stream_allocate(VALUE klass);
+static void magic_stream_mark(void *data);
+static void magic_stream_free(void *data);
+static size_t magic_stream_size(const void *data);
+#if defined(HAVE_RUBY_GC_COMPACT)
+static void magic_stream_compact(void *data);
+#endif
+
+static VALUE magic_report_allocate(VALUE klass);
+static void magic_report_mark(void *data);
+static void magic_report_free(void *data);
+static size_t magic_report_size(const void *data);
+#if defined(HAVE_RUBY_GC_COMPACT)
+static void magic_report_compact(void *data);
+#endif
+
+static double magic_pool_timeout(rb_mgc_pool_t *pool, VALUE value);
+static long magic_pool_checkout(rb_mgc_pool_t *pool, double timeout);
+static VALUE magic_pool_checkin(VALUE data);
+static VALUE magic_pool_call(VALUE object, ID method, int argc,
+			     const VALUE *argv);
+static VALUE magic_pool_call_internal(VALUE data);
+static void magic_pool_fork_check(rb_mgc_pool_t *pool);
+
+static void *nogvl_magic_pool_wait(void *data);
+static void magic_pool_unblock(void *data);
+
+static size_t magic_batch_threads(VALUE value, size_t count);
+static size_t magic_batch_chunk(size_t count, size_t threads);
+static void magic_batch_yield(rb_mgc_batch_t *batch, size_t index);
+static void magic_batch_slices(rb_mgc_batch_t *batch);
+static void magic_batch_init(rb_mgc_batch_t *batch,
+			     magic_worker_function_t function,
+			     size_t threads);
+static VALUE magic_batch_run(VALUE data);
+static VALUE magic_batch_cleanup(VALUE data);
+static VALUE magic_batch_result(rb_mgc_batch_t *batch, size_t index);
+static void magic_result_check(rb_mgc_result_t *result, int stop_on_errors);
+static VALUE magic_result(rb_mgc_result_t *result, int flags,
+			  int stop_on_errors, int intern);
+static void magic_batch_unblock(void *data);
+static void magic_batch_file(void *data, size_t index);
+static void magic_batch_prefetch(void *data, size_t index);
+static void magic_batch_buffer(void *data, size_t index);
+static void magic_batch_mark(void *data);
+
+static void magic_intern_mark(void *data);
+#if defined(HAVE_RUBY_GC_COMPACT)
+static void magic_intern_compact(void *data);
+#endif
+
+static void magic_scanner_init(rb_mgc_scanner_t *scanner, VALUE root,
+			       VALUE includes, VALUE excludes, size_t threads,
+			       int recursive, int follow_symlinks,
+			       int prefetch);
+static void magic_scanner_patterns(rb_mgc_scanner_t *scanner, VALUE patterns,
+				   int (*add)(magic_scan_t *, const char *));
+static VALUE magic_scanner_run(VALUE data);
+static VALUE magic_scanner_cleanup(VALUE data);
+static void magic_scanner_unblock(void *data);
+static VALUE magic_patterns(VALUE value);
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+static int magic_offload_p(void);
+static VALUE magic_offload(VALUE object, const char *path, int fd, int flags,
+			   int mapped, VALUE into);
+static VALUE magic_offload_run(VALUE data);
+static VALUE magic_offload_cleanup(VALUE data);
+static void magic_offload_function(void *data, size_t index);
+static void magic_offload_release(magic_worker_job_t *job);
+static int magic_pipe(int fds[2]);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
 /*
  * call-seq:
  *    Magic.do_not_auto_load -> boolean
@@ -93,7 +290,7 @@ static VALUE magic_set_paths(VALUE object, VALUE value);
 VALUE
 rb_mgc_get_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object))
 {
-	return CBOOL2RVAL(rb_mgc_do_not_auto_load);
+	return CBOOL2RVAL(MAGIC_ATOMIC_LOAD(rb_mgc_do_not_auto_load));
 }
 
 /*
@@ -126,7 +323,7 @@ rb_mgc_get_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object))
 VALUE
 rb_mgc_set_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 {
-	rb_mgc_do_not_auto_load = RVAL2CBOOL(value);
+	MAGIC_ATOMIC_STORE(rb_mgc_do_not_auto_load, RVAL2CBOOL(value));
 
 	return value;
 }
@@ -149,7 +346,7 @@ rb_mgc_set_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 VALUE
 rb_mgc_get_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object))
 {
-	return CBOOL2RVAL(rb_mgc_do_not_stop_on_error);
+	return CBOOL2RVAL(MAGIC_ATOMIC_LOAD(rb_mgc_do_not_stop_on_error));
 }
 
 /*
@@ -167,7 +364,7 @@ rb_mgc_get_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object))
 VALUE
 rb_mgc_set_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 {
-	rb_mgc_do_not_stop_on_error = RVAL2CBOOL(value);
+	MAGIC_ATOMIC_STORE(rb_mgc_do_not_stop_on_error, RVAL2CBOOL(value));
 
 	return value;
 }
@@ -200,25 +397,22 @@ rb_mgc_initialize(VALUE object, VALUE arguments)
 		MAGIC_WARNING(0, "%s::new() does not take block; use %s::open() instead",
 				 klass, klass);
 
-	if (RTEST(rb_eval_string("ENV['MAGIC_DO_NOT_STOP_ON_ERROR']")))
-		rb_mgc_do_not_stop_on_error = 1;
+	if (getenv("MAGIC_DO_NOT_STOP_ON_ERROR"))
+		MAGIC_ATOMIC_STORE(rb_mgc_do_not_stop_on_error, 1);
 
-	if (RTEST(rb_eval_string("ENV['MAGIC_DO_NOT_AUTOLOAD']")))
-		rb_mgc_do_not_auto_load = 1;
+	if (getenv("MAGIC_DO_NOT_AUTOLOAD"))
+		MAGIC_ATOMIC_STORE(rb_mgc_do_not_auto_load, 1);
 
 	MAGIC_OBJECT(object, mgc);
 
 	mgc->stop_on_errors = 1;
-	if (rb_mgc_do_not_stop_on_error)
+	if (MAGIC_ATOMIC_LOAD(rb_mgc_do_not_stop_on_error))
 		mgc->stop_on_errors = 0;
 
-	mgc->mutex = rb_class_new_instance(0, 0, rb_const_get(rb_cObject,
-					   rb_intern("Mutex")));
-
 	magic_set_flags(object, MAGIC_NONE);
 	magic_set_paths(object, RARRAY_EMPTY);
 
-	if (rb_mgc_do_not_auto_load) {
+	if (MAGIC_ATOMIC_LOAD(rb_mgc_do_not_auto_load)) {
 		if (!RARRAY_EMPTY_P(arguments))
 			MAGIC_WARNING(1, "%s::do_not_auto_load is set; using %s#new() to load "
 					 "Magic database from a file will have no effect",
@@ -231,6 +425,67 @@ rb_mgc_initialize(VALUE object, VALUE arguments)
 	return object;
 }
 
+/*
+ * call-seq:
+ *    magic.dup   -> self
+ *    magic.clone -> self
+ *
+ * Returns a copy of the Magic object with the same flags and parameters, and
+ * with the same _Magic_ database loaded.
+ *
+ * The copy does not read and parse the _Magic_ database files again. Instead,
+ * compiled _Magic_ database files are mapped into memory once, and then the
+ * same memory is shared by the original object and all its copies. When
+ * this is not possible, for instance, when source _Magic_ files were loaded,
+ * then the copy loads them again.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME
+ *    copy = magic.dup
+ *    copy.flags         #=> 1040
+ *    copy.file('/')     #=> "inode/directory; charset=binary"
+ *
+ * See also: Magic::new, Magic#load and Magic#load_buffers
+ */
+VALUE
+rb_mgc_initialize_copy(VALUE object, VALUE original)
+{
+	rb_mgc_object_t *mgc;
+	rb_mgc_object_t *source;
+	rb_mgc_arguments_t mga;
+	VALUE value = Qundef;
+
+	if (object == original)
+		return object;
+
+	rb_obj_init_copy(object, original);
+
+	MAGIC_CHECK_OPEN(original);
+	MAGIC_OBJECT(original, source);
+	MAGIC_OBJECT(object, mgc);
+
+	mgc->stop_on_errors = source->stop_on_errors;
+	mgc->intern_results = source->intern_results;
+
+	mga = (rb_mgc_arguments_t) {
+		.magic_object = source,
+		.copy = mgc,
+		.flags = magic_get_flags(original),
+	};
+
+	magic_lock(original, magic_copy_internal, &mga);
+	if (mga.status < 0)
+		MAGIC_LIBRARY_ERROR(mgc);
+
+	value = rb_ivar_get(original, id_at_paths);
+	if (ARRAY_P(value))
+		magic_set_paths(object, rb_ary_dup(value));
+
+	return object;
+}
+
 /*
  * call-seq:
  *    magic.do_not_stop_on_error -> boolean
@@ -267,6 +522,61 @@ rb_mgc_set_do_not_stop_on_error(VALUE object, VALUE value)
 	return value;
 }
 
+/*
+ * call-seq:
+ *    magic.intern_results -> boolean
+ *
+ * See also: Magic#intern_results=
+ */
+VALUE
+rb_mgc_get_intern_results(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return CBOOL2RVAL(mgc->intern_results);
+}
+
+/*
+ * call-seq:
+ *    magic.intern_results= ( boolean ) -> boolean
+ *
+ * When set, the results are returned as frozen and deduplicated strings,
+ * such that the same result is returned as the very same string every time,
+ * rather than as a new string allocated for each call. A result is also
+ * given its proper encoding, that is, US-ASCII or UTF-8, rather than being
+ * returned as binary.
+ *
+ * Only a bounded number of the most recent distinct results are kept, thus
+ * the wide variety of textual descriptions, which often include details
+ * such as image dimensions, does not make it grow, at the cost of some of
+ * these being allocated again. MIME types and encodings benefit the most.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.intern_results = true
+ *    magic.file("image.png").frozen?                       #=> true
+ *    magic.file("image.png").equal?(magic.file("icon.png")) #=> true
+ *
+ * See also: Magic#intern_results
+ */
+VALUE
+rb_mgc_set_intern_results(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	mgc->intern_results = RVAL2CBOOL(value);
+
+	return value;
+}
+
 /*
  * call-seq:
  *    magic.open? -> true or false
@@ -367,7 +677,6 @@ rb_mgc_close_p(VALUE object)
 VALUE
 rb_mgc_get_paths(VALUE object)
 {
-	const char *cstring = NULL;
 	VALUE value = Qundef;
 
 	MAGIC_CHECK_OPEN(object);
@@ -376,14 +685,7 @@ rb_mgc_get_paths(VALUE object)
 	if (!NIL_P(value) && !RARRAY_EMPTY_P(value))
 		return value;
 
-	value = rb_funcall(rb_cMagic, rb_intern("default_paths"), 0);
-	if (getenv("MAGIC") || NIL_P(value)) {
-		cstring = magic_getpath_wrapper();
-		value = magic_split(CSTR2RVAL(cstring), CSTR2RVAL(":"));
-		RB_GC_GUARD(value);
-	}
-
-	return magic_set_paths(object, value);
+	return magic_set_paths(object, magic_default_paths());
 }
 
 /*
@@ -601,7 +903,7 @@ rb_mgc_load(VALUE object, VALUE arguments)
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_OBJECT(object, mgc);
 
-	if (rb_mgc_do_not_auto_load) {
+	if (MAGIC_ATOMIC_LOAD(rb_mgc_do_not_auto_load)) {
 		klass = "Magic";
 		if (!NIL_P(object))
 			klass = rb_obj_classname(object);
@@ -627,14 +929,32 @@ rb_mgc_load(VALUE object, VALUE arguments)
 		.flags = magic_get_flags(object),
 	};
 
+	/*
+	 * Load from the database preloaded with Magic::preload!, if any, when
+	 * it refers to the same files, so that its memory is shared.
+	 */
+	mga.database = magic_default_database();
+	if (mga.database && strcmp(mga.database->paths, mga.file.path) != 0) {
+		magic_database_unref(mga.database);
+		mga.database = NULL;
+	}
+
 	MAGIC_SYNCHRONIZED(magic_load_internal, &mga);
 	if (mga.status < 0) {
+		magic_database_unref(mga.database);
 		mgc->database_loaded = 0;
 		MAGIC_LIBRARY_ERROR(mgc);
 	}
 
 	mgc->database_loaded = 1;
 
+	magic_database_unref(mgc->database);
+	mgc->database = mga.database ? mga.database :
+				       magic_database_new(mga.file.path);
+	if (!mgc->database)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+
 	value = magic_split(CSTR2RVAL(mga.file.path), CSTR2RVAL(":"));
 	RB_GC_GUARD(value);
 
@@ -657,6 +977,7 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	int local_errno;
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	magic_database_t *database;
 	void **pointers = NULL;
 	size_t *sizes = NULL;
 	VALUE value = Qundef;
@@ -694,14 +1015,29 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 		sizes[i] = (size_t)RSTRING_LEN(value);
 	}
 
+	/*
+	 * The Magic library does not copy the buffers, and uses them for as long
+	 * as the database remains loaded, thus keep a copy of the buffers that
+	 * can be also shared with copies of this object.
+	 */
+	database = magic_database_new_buffers(pointers, sizes, count);
+
+	ruby_xfree(pointers);
+	ruby_xfree(sizes);
+
+	if (!database) {
+		local_errno = ENOMEM;
+		goto error;
+	}
+
 	magic_set_paths(object, RARRAY_EMPTY);
 
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
 		.buffers = {
-			.count    = count,
-			.pointers = pointers,
-			.sizes    = sizes,
+			.count    = database->count,
+			.pointers = database->pointers,
+			.sizes    = database->sizes,
 		},
 		.flags = magic_get_flags(object),
 	};
@@ -709,15 +1045,14 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	MAGIC_SYNCHRONIZED(magic_load_buffers_internal, &mga);
 	if (mga.status < 0) {
 		local_errno = errno;
-		ruby_xfree(pointers);
-		ruby_xfree(sizes);
+		magic_database_unref(database);
 		goto error;
 	}
 
 	mgc->database_loaded = 1;
 
-	ruby_xfree(pointers);
-	ruby_xfree(sizes);
+	magic_database_unref(mgc->database);
+	mgc->database = database;
 
 	return Qnil;
 error:
@@ -829,20 +1164,141 @@ rb_mgc_check(VALUE object, VALUE value)
 
 /*
  * call-seq:
- *    magic.file( object ) -> string or array
- *    magic.file( string ) -> string or array
+ *    magic.file( object )              -> string or array
+ *    magic.file( string )              -> string or array
+ *    magic.file( string, io: symbol )  -> string or array
+ *    magic.file( string, flags: integer )  -> string or array
+ *    magic.file( string, debug: true )  -> array
+ *
+ * The io option chooses how the content of the file is read:
+ *
+ * :read:: The Magic library reads the beginning of the file into a buffer
+ *         of its own (default).
+ * :mmap:: The beginning of the file, as much of it as the Magic::PARAM_BYTES_MAX
+ *         parameter allows, is mapped into memory at once, and identified
+ *         from there, which saves copying it for large files.
+ *
+ * Either way, the results are the same. Directories, devices, symbolic links,
+ * empty files and files with special mode bits, as well as formats for which
+ * the Magic library reads more than the beginning of the file, such as ELF
+ * executables, are identified the same way as with :read.
+ *
+ * A mapped file that is truncated while being identified causes the process
+ * to receive SIGBUS, thus use :mmap only for files that do not change.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.file("/var/lib/images/disk.qcow2", io: :mmap) #=> "QEMU QCOW2 Image (v3), 21474836480 bytes"
+ *
+ * The flags option identifies the file using the given flags instead of
+ * the flags of the object, which are left unchanged. Each combination of
+ * flags is given its own handle of the Magic library, sharing the same
+ * loaded database, thus switching between them costs nothing.
+ *
+ * Example:
+ *
+ *    magic.file("image.png")                          #=> "PNG image data, 16 x 16, 8-bit/color RGBA, non-interlaced"
+ *    magic.file("image.png", flags: Magic::MIME_TYPE) #=> "image/png"
+ *
+ * When the debug option is set, the file is identified with the
+ * Magic::DEBUG flag set, and the result is returned together with the
+ * debugging output of the Magic library, which shows each rule that was
+ * tried, rather than that output being written to the standard error
+ * output. As the Magic library can only write that output to the standard
+ * error output, which is shared by the whole process, the file is then
+ * identified in a short-lived child process of its own, whose standard
+ * error output is captured instead, thus neither the standard error output
+ * of this process nor other threads are affected, but each such call costs
+ * a fork. Where fork is not available, NotImplementedError is raised.
+ *
+ * Example:
+ *
+ *    result, trace = magic.file("slow.bin", debug: true)
+ *    logger.debug(trace)
  *
  * See also: Magic#buffer and Magic#descriptor
  */
 VALUE
-rb_mgc_file(VALUE object, VALUE value)
+rb_mgc_file(int argc, VALUE *argv, VALUE object)
+{
+	VALUE value = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
+
+	return magic_file_into(object, value, options, Qnil);
+}
+
+/*
+ * call-seq:
+ *    magic.file_into( object, string )                   -> string
+ *    magic.file_into( string, string, io: symbol )       -> string
+ *    magic.file_into( string, string, flags: integer )   -> string
+ *
+ * Identifies the file the same way as Magic#file does, but rather than
+ * returning a new string, replaces the content of the given string with
+ * the result, and then returns it. The string is only ever grown, when it
+ * is too small to hold the result, thus identifying many files in a loop
+ * using the same string does not allocate any objects.
+ *
+ * The result is never split into an array, even when either the
+ * Magic::CONTINUE or the Magic::EXTENSION flag is set, and is given as
+ * returned by the Magic library instead.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    result = String.new(capacity: 64)
+ *    Dir.each_child("images") do |name|
+ *      next unless magic.file_into(File.join("images", name), result) == "image/png"
+ *      ...
+ *    end
+ *
+ * See also: Magic#file, Magic#buffer_into and Magic#descriptor_into
+ */
+VALUE
+rb_mgc_file_into(int argc, VALUE *argv, VALUE object)
+{
+	VALUE value = Qundef;
+	VALUE into = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "2:", &value, &into, &options);
+
+	magic_check_into(into);
+
+	return magic_file_into(object, value, options, into);
+}
+
+static VALUE
+magic_file_into(VALUE object, VALUE value, VALUE options, VALUE into)
 {
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
 	const char *empty = "(null)";
+	int mapped;
+	int flags;
+	int debug;
+	VALUE result;
+	VALUE trace = Qnil;
+	VALUE message = Qnil;
+	VALUE values[3] = { Qundef, Qundef, Qundef };
+	ID keywords[3];
 
 	UNUSED(empty);
 
+	keywords[0] = rb_intern("io");
+	keywords[1] = rb_intern("flags");
+	keywords[2] = rb_intern("debug");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 3, values);
+
+	mapped = magic_io_mapped(values[0]);
+	debug = magic_debug_p(values[2]);
+
 	if (NIL_P(value))
 		goto error;
 
@@ -850,22 +1306,41 @@ rb_mgc_file(VALUE object, VALUE value)
 	MAGIC_CHECK_LOADED(object);
 	MAGIC_OBJECT(object, mgc);
 
+	flags = magic_call_flags(object, values[1]);
+
 	if (rb_respond_to(value, rb_intern("to_io")))
-		return rb_mgc_descriptor(object, value);
+		return magic_descriptor_flags(object, INT2NUM(magic_fileno(value)),
+					      flags, into, debug);
 
 	value = magic_path(value);
 	if (NIL_P(value))
 		goto error;
 
+	if (debug)
+		flags |= MAGIC_DEBUG;
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	if (magic_offload_p() && !debug)
+		return magic_offload(object, RVAL2CSTR(value), -1, flags,
+				     mapped, into);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
 		.file = {
 			.path = RVAL2CSTR(value),
 		},
-		.flags = magic_get_flags(object),
+		.flags = flags,
+		.into = into,
+		.mapped = mapped != 0,
+		.intern = mgc->intern_results,
+		.debug = debug != 0,
 	};
 
 	MAGIC_SYNCHRONIZED(magic_file_internal, &mga);
+	if (debug)
+		trace = magic_capture_value(&mga, &message);
+
 	if (mga.status < 0 && !mga.result) {
 		/*
 		 * Handle the case when the "ERROR" flag is set regardless of the
@@ -881,9 +1356,12 @@ rb_mgc_file(VALUE object, VALUE value)
 		 * the desired behavior as per the standards.
 		 */
 		if (mgc->stop_on_errors || (mga.flags & MAGIC_ERROR))
-			MAGIC_LIBRARY_ERROR(mgc);
+			MAGIC_IDENTIFY_ERROR(&mga);
 
-		mga.result = magic_error_wrapper(mgc->cookie);
+		if (mga.debug)
+			mga.result = mga.capture.message;
+		else
+			mga.result = magic_error_wrapper(mga.cookie);
 	}
 	if (!mga.result)
 		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, EINVAL, E_UNKNOWN);
@@ -900,63 +1378,207 @@ rb_mgc_file(VALUE object, VALUE value)
 	assert(strncmp(mga.result, empty, strlen(empty)) != 0 &&
 		       "Empty or invalid result");
 
-	return magic_return(&mga);
+	result = magic_return(&mga);
+	RB_GC_GUARD(message);
+
+	return magic_debug_return(&mga, result, trace);
 error:
 	MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
 }
 
 /*
  * call-seq:
- *    magic.buffer( string ) -> string or array
+ *    magic.buffer( string )                                    -> string or array
+ *    magic.buffer( io_buffer )                                 -> string or array
+ *    magic.buffer( object )                                    -> string or array
+ *    magic.buffer( string, offset: integer, length: integer )  -> string or array
+ *    magic.buffer( string, flags: integer )                    -> string or array
+ *    magic.buffer( string, debug: true )                       -> array
+ *
+ * The content of the string is identified without holding the Global VM
+ * Lock, thus other threads can run in the meantime. The string is neither
+ * copied nor can it be changed until then.
+ *
+ * An IO::Buffer, or any other object that exports a contiguous memory view
+ * (for instance, a Fiddle::Pointer), is identified the same way, directly
+ * from its memory and without being copied first. An IO::Buffer is locked
+ * while being identified, unless it is already locked, in which case its
+ * content is copied instead.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    File.open("image.png") do |file|
+ *      magic.buffer(IO::Buffer.map(file, nil, 0, IO::Buffer::READONLY)) #=> "image/png"
+ *    end
+ *
+ * Only a part of the content can be identified by giving the offset of its
+ * first byte, counting from the end when negative, and optionally its length,
+ * which is then shortened to what is left after the offset. This does not
+ * allocate a new string, unlike String#byteslice would.
+ *
+ * Example:
+ *
+ *    archive = File.binread("attachments.bin")
+ *    magic.buffer(archive, offset: 4096, length: 8192) #=> "application/pdf"
+ *
+ * The flags and debug options work the same way as for Magic#file.
  *
  * See also: Magic#file and Magic#descriptor
  */
 VALUE
-rb_mgc_buffer(VALUE object, VALUE value)
+rb_mgc_buffer(int argc, VALUE *argv, VALUE object)
+{
+	VALUE value = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
+
+	return magic_buffer_into(object, value, options, Qnil);
+}
+
+/*
+ * call-seq:
+ *    magic.buffer_into( string, string )                                    -> string
+ *    magic.buffer_into( io_buffer, string )                                 -> string
+ *    magic.buffer_into( string, string, offset: integer, length: integer )  -> string
+ *    magic.buffer_into( string, string, flags: integer )                    -> string
+ *
+ * Identifies the content the same way as Magic#buffer does, but writes the
+ * result into the given string, the same way as Magic#file_into does.
+ *
+ * See also: Magic#buffer, Magic#file_into and Magic#descriptor_into
+ */
+VALUE
+rb_mgc_buffer_into(int argc, VALUE *argv, VALUE object)
+{
+	VALUE value = Qundef;
+	VALUE into = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "2:", &value, &into, &options);
+
+	magic_check_into(into);
+
+	return magic_buffer_into(object, value, options, into);
+}
+
+static VALUE
+magic_buffer_into(VALUE object, VALUE value, VALUE options, VALUE into)
 {
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	int debug;
+	VALUE result;
+	VALUE trace = Qnil;
+	VALUE message = Qnil;
+	VALUE values[4] = { Qundef, Qundef, Qundef, Qundef };
+	ID keywords[4];
 
-	MAGIC_CHECK_STRING_TYPE(value);
+	keywords[0] = rb_intern("offset");
+	keywords[1] = rb_intern("length");
+	keywords[2] = rb_intern("flags");
+	keywords[3] = rb_intern("debug");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 4, values);
+
+	debug = magic_debug_p(values[3]);
+
+	if (!magic_bytes_p(value))
+		MAGIC_CHECK_STRING_TYPE(value);
 
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_CHECK_LOADED(object);
 	MAGIC_OBJECT(object, mgc);
 
-	StringValue(value);
-
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
-		.buffers = {
-			.pointers = (void **)RSTRING_PTR(value),
-			.sizes    = (size_t *)RSTRING_LEN(value),
-		},
-		.flags = magic_get_flags(object),
+		.flags = magic_call_flags(object, values[2]) |
+			 (debug ? MAGIC_DEBUG : 0),
+		.value = value,
+		.into = into,
+		.intern = mgc->intern_results,
+		.debug = debug != 0,
 	};
 
+	magic_bytes_range(values[0], values[1], &mga.buffer);
+
 	MAGIC_SYNCHRONIZED(magic_buffer_internal, &mga);
+	if (debug)
+		trace = magic_capture_value(&mga, &message);
+
 	if (mga.status < 0)
-		MAGIC_LIBRARY_ERROR(mgc);
+		MAGIC_IDENTIFY_ERROR(&mga);
 
 	assert(mga.result != NULL &&
 	       "Must be a valid pointer to `const char' type");
 
-	return magic_return(&mga);
+	result = magic_return(&mga);
+	RB_GC_GUARD(message);
+
+	return magic_debug_return(&mga, result, trace);
 }
 
 /*
  * call-seq:
- *    magic.descriptor( object )  -> string or array
- *    magic.descriptor( integer ) -> string or array
+ *    magic.descriptor( object )                   -> string or array
+ *    magic.descriptor( integer )                  -> string or array
+ *    magic.descriptor( integer, flags: integer )  -> string or array
+ *    magic.descriptor( integer, debug: true )     -> array
+ *
+ * The flags and debug options work the same way as for Magic#file.
  *
  * See also: Magic#file and Magic#buffer
  */
 VALUE
-rb_mgc_descriptor(VALUE object, VALUE value)
+rb_mgc_descriptor(int argc, VALUE *argv, VALUE object)
 {
-	int local_errno;
-	rb_mgc_object_t *mgc;
-	rb_mgc_arguments_t mga;
+	VALUE value = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
+
+	return magic_descriptor_into(object, value, options, Qnil);
+}
+
+/*
+ * call-seq:
+ *    magic.descriptor_into( object, string )                   -> string
+ *    magic.descriptor_into( integer, string )                  -> string
+ *    magic.descriptor_into( integer, string, flags: integer )  -> string
+ *
+ * Identifies the file the same way as Magic#descriptor does, but writes the
+ * result into the given string, the same way as Magic#file_into does.
+ *
+ * See also: Magic#descriptor, Magic#file_into and Magic#buffer_into
+ */
+VALUE
+rb_mgc_descriptor_into(int argc, VALUE *argv, VALUE object)
+{
+	VALUE value = Qundef;
+	VALUE into = Qundef;
+	VALUE options = Qnil;
+
+	rb_scan_args(argc, argv, "2:", &value, &into, &options);
+
+	magic_check_into(into);
+
+	return magic_descriptor_into(object, value, options, into);
+}
+
+static VALUE
+magic_descriptor_into(VALUE object, VALUE value, VALUE options, VALUE into)
+{
+	VALUE values[2] = { Qundef, Qundef };
+	ID keywords[2];
+
+	keywords[0] = rb_intern("flags");
+	keywords[1] = rb_intern("debug");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 2, values);
 
 	if (rb_respond_to(value, rb_intern("to_io")))
 		value = INT2NUM(magic_fileno(value));
@@ -965,639 +1587,5242 @@ rb_mgc_descriptor(VALUE object, VALUE value)
 
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_CHECK_LOADED(object);
+
+	return magic_descriptor_flags(object, value,
+				      magic_call_flags(object, values[0]), into,
+				      magic_debug_p(values[1]));
+}
+
+static VALUE
+magic_descriptor_flags(VALUE object, VALUE value, int flags, VALUE into,
+		       int debug)
+{
+	int local_errno;
+	rb_mgc_object_t *mgc;
+	rb_mgc_arguments_t mga;
+	VALUE result;
+	VALUE trace = Qnil;
+	VALUE message = Qnil;
+
 	MAGIC_OBJECT(object, mgc);
 
+	if (debug)
+		flags |= MAGIC_DEBUG;
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	if (magic_offload_p() && !debug)
+		return magic_offload(object, NULL, NUM2INT(value), flags, 0,
+				     into);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
 		.file = {
 			.fd = NUM2INT(value),
 		},
-		.flags = magic_get_flags(object),
+		.flags = flags,
+		.into = into,
+		.intern = mgc->intern_results,
+		.debug = debug != 0,
 	};
 
 	MAGIC_SYNCHRONIZED(magic_descriptor_internal, &mga);
 	local_errno = errno;
 
+	if (debug)
+		trace = magic_capture_value(&mga, &message);
+
 	if (mga.status < 0) {
 		if (local_errno == EBADF)
 			rb_raise(rb_eIOError, "Bad file descriptor");
 
-		MAGIC_LIBRARY_ERROR(mgc);
+		MAGIC_IDENTIFY_ERROR(&mga);
 	}
 
 	assert(mga.result != NULL &&
 	       "Must be a valid pointer to `const char' type");
 
-	return magic_return(&mga);
+	result = magic_return(&mga);
+	RB_GC_GUARD(message);
+
+	return magic_debug_return(&mga, result, trace);
 }
 
 /*
  * call-seq:
- *    Magic.version -> integer
+ *    magic.io( object ) -> string or array
  *
- * Example:
+ * Identifies the content that is yet to be read from the IO, or an IO-like
+ * object such as StringIO, without consuming it, thus it can still be read
+ * afterwards, as if it was never identified. Only the beginning of the
+ * content is read, as much of it as the Magic::PARAM_BYTES_MAX parameter
+ * allows, and then identified the same way as Magic#buffer does.
  *
- *    Magic.version #=> 517
+ * How the content is left to be read again depends on the object:
  *
- * See also: Magic::version_to_a and Magic::version_to_s
+ * * A socket is only peeked at, thus only the content that has already
+ *   arrived is identified.
+ * * An object that can tell and change its position, such as File,
+ *   Tempfile or StringIO, is moved back to where it was.
+ * * Otherwise, such as for a pipe, the content is read and then pushed back
+ *   using +ungetbyte+, or +ungetc+. It is read with +readpartial+ when the
+ *   object responds to it, thus only what has already arrived is
+ *   identified, waiting only until some content arrives, rather than until
+ *   the writer sends enough of it or closes its end.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.io(request.body) #=> "image/png"
+ *    request.body.read      # still reads the whole image
+ *
+ * See also: Magic#buffer and Magic#descriptor
  */
 VALUE
-rb_mgc_version(RB_UNUSED_VAR(VALUE object))
+rb_mgc_io(VALUE object, VALUE value)
 {
-	return INT2NUM(magic_version_wrapper());
+	VALUE string;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+
+	string = magic_io_peek(value, magic_io_length(object));
+
+	return rb_mgc_buffer(1, &string, object);
 }
 
-static inline void*
-nogvl_magic_load(void *data)
+/*
+ * call-seq:
+ *    magic.identify( object )               -> hash
+ *    magic.identify( object, want: array )  -> hash
+ *
+ * Identifies the file, or content, in a number of ways at once, and returns
+ * a frozen hash with a result for each of the wanted views:
+ *
+ * :description:: A textual description, as with Magic::NONE.
+ * :mime_type::   The MIME type, as with Magic::MIME_TYPE.
+ * :encoding::    The MIME encoding, as with Magic::MIME_ENCODING.
+ * :mime::        Both of the above, as with Magic::MIME.
+ * :extensions::  The file name extensions, as with Magic::EXTENSION.
+ * :apple::       The Apple creator and type, as with Magic::APPLE.
+ *
+ * By default, the description, MIME type, MIME encoding and extensions are
+ * returned. The other flags of the object, such as Magic::NO_CHECK_COMPRESS,
+ * apply to each of the views, and the flags of the object are not changed.
+ *
+ * The beginning of the file is read only once, see Magic#file for how it is
+ * mapped into memory, and then identified for each view in turn, without
+ * holding the Global VM Lock. Each view uses its own handle of the Magic
+ * library sharing the same loaded database, see the flags option of
+ * Magic#file.
+ *
+ * A string is taken to be the path of a file, the same way as for Magic#file.
+ * The content of an IO, or an IO-like object such as StringIO, is identified
+ * the same way as Magic#io does, that is, without consuming it. An IO::Buffer
+ * is identified the same way as Magic#buffer does.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.identify("image.png")                                 #=> {:mime_type=>"image/png", :encoding=>"binary", :description=>"PNG image data, 16 x 16, 8-bit/color RGBA, non-interlaced", :extensions=>"png"}
+ *    magic.identify(request.body, want: [:mime_type, :encoding]) #=> {:mime_type=>"text/plain", :encoding=>"us-ascii"}
+ *
+ * See also: Magic#file, Magic#io and Magic#buffer
+ */
+VALUE
+rb_mgc_identify(int argc, VALUE *argv, VALUE object)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	rb_mgc_object_t *mgc;
+	rb_mgc_identify_t identify;
+	VALUE value = Qundef;
+	VALUE options = Qnil;
+	VALUE want = Qundef;
+	ID keyword;
 
-	mga->status = magic_load_wrapper(cookie,
-					 mga->file.path,
-					 mga->flags);
+	rb_scan_args(argc, argv, "1:", &value, &options);
 
-	return NULL;
+	keyword = rb_intern("want");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, &keyword, 0, 1, &want);
+
+	if (NIL_P(value))
+		goto error;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+
+	identify = (rb_mgc_identify_t) {
+		.magic_object = mgc,
+		.flags = magic_get_flags(object) & ~MAGIC_VIEWS_MASK,
+		.view = {
+			.fd = -1,
+		},
+		.stop_on_errors = 1,
+		.intern = mgc->intern_results,
+	};
+
+	magic_identify_views(want, &identify);
+
+	if (magic_identify_input(object, value, &identify) < 0)
+		goto error;
+
+	if (identify.flags & MAGIC_CONTINUE)
+		identify.flags |= MAGIC_RAW;
+
+	MAGIC_SYNCHRONIZED(magic_identify_internal, &identify);
+
+	return rb_ensure(magic_identify_return, (VALUE)&identify,
+			 magic_identify_cleanup, (VALUE)&identify);
+error:
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "String, IO-like object or IO::Buffer");
 }
 
-static inline void*
-nogvl_magic_compile(void *data)
+/*
+ * call-seq:
+ *    magic.result( string )      -> Magic::Result
+ *    magic.result( io )          -> Magic::Result
+ *    magic.result( io_buffer )   -> Magic::Result
+ *
+ * Identifies the given object the same way as Magic#identify does, and
+ * returns a Magic::Result that holds the MIME type, the character set, the
+ * description, the extensions and every match found for it at once.
+ *
+ * The Magic library is asked only once for each of the MIME type (together
+ * with the character set), the description, the extensions and the matches,
+ * reading the file only once, and its output is kept as-is. Each field is
+ * then taken from it only when first asked for, thus the fields that are
+ * never used cost nothing.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.result("image.jpg")
+ *    result.mime_type    #=> "image/jpeg"
+ *    result.charset      #=> "binary"
+ *    result.extensions   #=> ["jpeg", "jpg", "jpe", "jfif"]
+ *
+ * See also: Magic#identify and Magic::Result
+ */
+VALUE
+rb_mgc_result(VALUE object, VALUE value)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	rb_mgc_object_t *mgc;
+	rb_mgc_identify_t identify;
 
-	mga->status = magic_compile_wrapper(cookie,
-					    mga->file.path,
-					    mga->flags);
+	if (NIL_P(value))
+		goto error;
 
-	return NULL;
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+
+	identify = (rb_mgc_identify_t) {
+		.magic_object = mgc,
+		.flags = magic_get_flags(object) &
+			 ~(MAGIC_VIEWS_MASK | MAGIC_CONTINUE),
+		.view = {
+			.fd = -1,
+		},
+		.stop_on_errors = 1,
+		.intern = mgc->intern_results,
+	};
+
+	for (size_t i = 0; i < MAGIC_REPORT_VIEWS; i++)
+		identify.views[identify.count++] = &ruby_magic_report_views[i];
+
+	if (magic_identify_input(object, value, &identify) < 0)
+		goto error;
+
+	MAGIC_SYNCHRONIZED(magic_identify_internal, &identify);
+
+	return rb_ensure(magic_report_return, (VALUE)&identify,
+			 magic_identify_cleanup, (VALUE)&identify);
+error:
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "String, IO-like object or IO::Buffer");
 }
 
-static inline void*
-nogvl_magic_check(void *data)
+/*
+ * call-seq:
+ *    magic.files( array )                                   -> array
+ *    magic.files( array, threads: integer )                 -> array
+ *    magic.files( array ) {|path, result| block }           -> self
+ *    magic.files( array, threads: integer ) {|path, result| block } -> self
+ *    magic.files( array, prefetch: boolean )                -> array
+ *
+ * Identifies many files at once, and returns an array of results in the
+ * same order as the given paths, as if Magic#file was called for each path.
+ *
+ * The files are identified by a pool of native threads, each using its own
+ * copy of this Magic object (with the same flags and parameters), without
+ * holding the Global VM Lock. By default, as many threads as there are CPUs
+ * are used, which can be changed using the +threads+ option.
+ *
+ * When the +prefetch+ option is set, then each thread reads the beginning
+ * of a number of files into memory at once, before identifying them, rather
+ * than reading one file after another, which helps when the time it takes
+ * to open and read a file is what matters the most, such as on network file
+ * systems. On Linux, the files are read using io_uring, when available. The
+ * results are the same either way.
+ *
+ * When a block is given, then each path is yielded together with its result
+ * as soon as the file was identified, thus in no particular order.
+ *
+ * Unless Magic#do_not_stop_on_error is set, an error raised while identifying
+ * any of the files stops processing of the remaining files, and the error is
+ * raised as Magic::MagicError.
+ *
+ * When the Magic::COMPRESS flag is set, then the standard error output of the
+ * whole process stays redirected to /dev/null for as long as any file is being
+ * identified, which is usually the entire batch, and anything written to it
+ * by other threads in the meantime, such as warnings, is lost.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.files(['/', '/etc/passwd'])  #=> ["inode/directory", "text/plain"]
+ *
+ *    magic.files(Dir['*.rb'], threads: 4) do |path, result|
+ *      puts "#{path}: #{result}"
+ *    end
+ *
+ *    magic.files(File.readlines('manifest.txt', chomp: true), prefetch: true)
+ *
+ * See also: Magic#file, Magic#do_not_stop_on_error and Magic::COMPRESS
+ */
+VALUE
+rb_mgc_files(int argc, VALUE *argv, VALUE object)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	size_t threads;
+	rb_mgc_object_t *mgc;
+	rb_mgc_batch_t batch;
+	VALUE options = Qnil;
+	VALUE inputs = Qundef;
+	VALUE paths, path;
+	VALUE values[2] = { Qundef, Qundef };
+	ID keywords[2];
 
-	mga->status = magic_check_wrapper(cookie,
-					  mga->file.path,
-					  mga->flags);
+	rb_scan_args(argc, argv, "1:", &inputs, &options);
 
-	return NULL;
+	keywords[0] = rb_intern("threads");
+	keywords[1] = rb_intern("prefetch");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 2, values);
+
+	inputs = rb_ary_dup(rb_Array(inputs));
+	paths = rb_ary_new_capa(RARRAY_LEN(inputs));
+
+	for (long i = 0; i < RARRAY_LEN(inputs); i++) {
+		path = RARRAY_AREF(inputs, i);
+		if (NIL_P(path) || NIL_P(path = magic_path(path)))
+			MAGIC_ARGUMENT_TYPE_ERROR(RARRAY_AREF(inputs, i),
+						  "String");
+
+		StringValueCStr(path);
+		rb_ary_push(paths, rb_str_new_frozen(path));
+	}
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+
+	threads = magic_batch_threads(values[0], (size_t)RARRAY_LEN(paths));
+
+	batch = (rb_mgc_batch_t) {
+		.object = object,
+		.inputs = inputs,
+		.values = paths,
+		.flags  = magic_get_flags(object),
+		.stop_on_errors = mgc->stop_on_errors,
+		.intern = mgc->intern_results,
+	};
+
+	if (batch.stop_on_errors)
+		batch.flags |= MAGIC_ERROR;
+
+	if (batch.flags & MAGIC_ERROR)
+		batch.stop_on_errors = 1;
+
+	if (values[1] != Qundef && RTEST(values[1])) {
+		batch.chunk = magic_batch_chunk((size_t)RARRAY_LEN(paths),
+					       threads);
+		magic_batch_init(&batch, magic_batch_prefetch, threads);
+	} else {
+		magic_batch_init(&batch, magic_batch_file, threads);
+	}
+
+	return rb_ensure(magic_batch_run, (VALUE)&batch,
+			 magic_batch_cleanup, (VALUE)&batch);
 }
 
-static inline void*
-nogvl_magic_file(void *data)
+/*
+ * call-seq:
+ *    magic.buffers( array )                                     -> array
+ *    magic.buffers( array, threads: integer )                   -> array
+ *    magic.buffers( array ) {|string, result| block }           -> self
+ *    magic.buffers( array, threads: integer ) {|string, result| block } -> self
+ *    magic.buffers( string, slices: array )                     -> array
+ *    magic.buffers( string, slices: array ) {|slice, result| block } -> self
+ *
+ * Identifies the content of many strings at once, and returns an array of
+ * results in the same order as the given strings, as if Magic#buffer was
+ * called for each string.
+ *
+ * The strings are identified the same way as files are by Magic#files, and
+ * are frozen copies of the given strings, thus changing any of them while
+ * being identified has no effect on the results.
+ *
+ * An IO::Buffer or an object that exports a memory view can be given in place
+ * of any string, see Magic#buffer for details.
+ *
+ * Given the slices option, an array of offset and length pairs, the parts of
+ * a single string are identified instead, the same way as Magic#buffer does
+ * with the offset and length options, and each slice is yielded as given.
+ * The string is then neither copied nor can it be changed until done.
+ *
+ * Example:
+ *
+ *    magic.buffers(archive, slices: [[0, 512], [4096, 8192]]) #=> ["application/x-tar", "application/pdf"]
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.buffers(["#!/bin/sh\n", "\x89PNG\r\n\x1a\n"]) #=> ["text/x-shellscript", "image/png"]
+ *
+ * See also: Magic#buffer and Magic#files
+ */
+VALUE
+rb_mgc_buffers(int argc, VALUE *argv, VALUE object)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	size_t threads;
+	rb_mgc_object_t *mgc;
+	rb_mgc_batch_t batch;
+	VALUE options = Qnil;
+	VALUE inputs = Qundef;
+	VALUE strings, string;
+	VALUE values[2] = { Qundef, Qundef };
+	ID keywords[2];
 
-	mga->result = magic_file_wrapper(cookie,
-					 mga->file.path,
-					 mga->flags);
+	rb_scan_args(argc, argv, "1:", &inputs, &options);
 
-	mga->status = !mga->result ? -1 : 0;
+	keywords[0] = rb_intern("threads");
+	keywords[1] = rb_intern("slices");
 
-	return NULL;
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 2, values);
+
+	if (values[1] != Qundef && !NIL_P(values[1])) {
+		if (!magic_bytes_p(inputs))
+			MAGIC_CHECK_STRING_TYPE(inputs);
+
+		strings = rb_ary_new_from_values(1, &inputs);
+		inputs = rb_ary_dup(rb_Array(values[1]));
+	}
+	else {
+		inputs = rb_ary_dup(rb_Array(inputs));
+		strings = rb_ary_new_capa(RARRAY_LEN(inputs));
+
+		for (long i = 0; i < RARRAY_LEN(inputs); i++) {
+			string = RARRAY_AREF(inputs, i);
+			if (!magic_bytes_p(string))
+				MAGIC_CHECK_STRING_TYPE(string);
+
+			if (RB_TYPE_P(string, T_STRING))
+				string = rb_str_new_frozen(string);
+
+			rb_ary_push(strings, string);
+		}
+	}
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+
+	threads = magic_batch_threads(values[0], (size_t)RARRAY_LEN(inputs));
+
+	batch = (rb_mgc_batch_t) {
+		.object = object,
+		.inputs = inputs,
+		.values = strings,
+		.flags  = magic_get_flags(object),
+		.stop_on_errors = 1,
+		.intern = mgc->intern_results,
+		.slices = values[1] != Qundef && !NIL_P(values[1]),
+	};
+
+	magic_batch_init(&batch, magic_batch_buffer, threads);
+
+	return rb_ensure(magic_batch_run, (VALUE)&batch,
+			 magic_batch_cleanup, (VALUE)&batch);
 }
 
-static inline void*
-nogvl_magic_descriptor(void *data)
+/*
+ * call-seq:
+ *    magic.scan( path, **options ) {|path, result| block } -> self
+ *    magic.scan( path, **options )                         -> enumerator
+ *
+ * Walks the directory tree at the given path, and identifies every file
+ * found in it, yielding the path of each file together with its result as
+ * soon as the file was identified, thus in no particular order. Without a
+ * block, an Enumerator is returned, which can also be made lazy.
+ *
+ * The directories are read and the files identified by a pool of native
+ * threads, the same way as Magic#files does, without holding the Global VM
+ * Lock. At most a fixed number of results is kept waiting for the block,
+ * thus a slow block slows down the threads rather than using more memory.
+ *
+ * The following options are supported:
+ *
+ * recursive::       Whether to descend into directories (default: +true+).
+ * threads::         The number of threads to use (default: number of CPUs).
+ * follow_symlinks:: Whether to follow symbolic links to directories and
+ *                   files (default: +false+).
+ * include::         A pattern, or an array of patterns, of which one has to
+ *                   match for a file to be identified.
+ * exclude::         A pattern, or an array of patterns, that no file or
+ *                   directory is allowed to match.
+ * prefetch::        Whether to read many files ahead at once, the same way
+ *                   as Magic#files does (default: +false+).
+ *
+ * The patterns are shell wildcard patterns, see fnmatch(3). A pattern that
+ * contains a slash is matched against the path relative to the given path,
+ * and otherwise against the name of the file or directory alone.
+ *
+ * When a directory cannot be read, and Magic#do_not_stop_on_error is not
+ * set, then Magic::MagicError is raised, otherwise the error is yielded as
+ * the result for that directory.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.scan('/usr/share/doc', include: '*.gz', exclude: '.git') do |path, result|
+ *      puts "#{path}: #{result}"
+ *    end
+ *
+ *    magic.scan('/srv').lazy.select { |_, result| result == 'application/pdf' }.first(10)
+ *
+ * See also: Magic#files and Magic#do_not_stop_on_error
+ */
+VALUE
+rb_mgc_scan(int argc, VALUE *argv, VALUE object)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	size_t threads;
+	rb_mgc_scanner_t scanner;
+	VALUE options = Qnil;
+	VALUE root = Qundef;
+	VALUE includes, excludes;
+	VALUE values[6] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+	ID keywords[6];
+
+#if defined(RB_PASS_CALLED_KEYWORDS)
+	RETURN_SIZED_ENUMERATOR_KW(object, argc, argv, 0,
+				   RB_PASS_CALLED_KEYWORDS);
+#else
+	RETURN_ENUMERATOR(object, argc, argv);
+#endif /* RB_PASS_CALLED_KEYWORDS */
+
+	rb_scan_args(argc, argv, "1:", &root, &options);
+
+	keywords[0] = rb_intern("recursive");
+	keywords[1] = rb_intern("threads");
+	keywords[2] = rb_intern("follow_symlinks");
+	keywords[3] = rb_intern("include");
+	keywords[4] = rb_intern("exclude");
+	keywords[5] = rb_intern("prefetch");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 6, values);
+
+	if (NIL_P(root) || NIL_P(root = magic_path(root)))
+		MAGIC_ARGUMENT_TYPE_ERROR(root, "String");
+
+	root = rb_str_new_frozen(root);
+	StringValueCStr(root);
+
+	includes = magic_patterns(values[3]);
+	excludes = magic_patterns(values[4]);
 
-	mga->result = magic_descriptor_wrapper(cookie,
-					       mga->file.fd,
-					       mga->flags);
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
 
-	mga->status = !mga->result ? -1 : 0;
+	threads = magic_batch_threads(values[1], MAGIC_WORKER_MAX);
 
-	return NULL;
+	scanner = (rb_mgc_scanner_t) {
+		.object = object,
+		.flags  = magic_get_flags(object),
+	};
+
+	magic_scanner_init(&scanner, root, includes, excludes, threads,
+			   values[0] == Qundef || RTEST(values[0]),
+			   values[2] != Qundef && RTEST(values[2]),
+			   values[5] != Qundef && RTEST(values[5]));
+
+	return rb_ensure(magic_scanner_run, (VALUE)&scanner,
+			 magic_scanner_cleanup, (VALUE)&scanner);
 }
 
-static inline VALUE
-magic_get_parameter_internal(void *data)
+/*
+ * call-seq:
+ *    Magic.version -> integer
+ *
+ * Example:
+ *
+ *    Magic.version #=> 517
+ *
+ * See also: Magic::version_to_a and Magic::version_to_s
+ */
+VALUE
+rb_mgc_version(RB_UNUSED_VAR(VALUE object))
 {
-	size_t value;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	return INT2NUM(magic_version_wrapper());
+}
 
-	mga->status = magic_getparam_wrapper(cookie,
-					     mga->parameter.tag,
-					     &value);
+/*
+ * call-seq:
+ *    Magic.preload!                -> boolean
+ *    Magic.preload!( string, ... ) -> boolean
+ *    Magic.preload!( array )       -> boolean
+ *
+ * Maps the compiled _Magic_ database files into memory once for the whole
+ * process, so that every new Magic object that loads the same files uses
+ * this memory rather than reading the files again. When no paths are given,
+ * the default paths are used.
+ *
+ * This is intended to be used in the parent process of a pre-forking server,
+ * such as Unicorn or Puma in cluster mode, before the workers are forked. The
+ * memory is never written to, and thus remains shared between the parent and
+ * the workers after fork.
+ *
+ * Magic objects are also fork-safe: after fork, each Magic object and each
+ * Magic::Pool re-creates its locks, and verifies that the _Magic_ database is
+ * still usable, reloading it if needed, when it is first used in the child
+ * process.
+ *
+ * Returns +true+ if the _Magic_ database could be mapped into memory, or
+ * +false+ otherwise, for instance, when only source _Magic_ files are
+ * available, in which case Magic objects load the files as usual.
+ *
+ * Example:
+ *
+ *    Magic.preload!   #=> true
+ *    Magic.preloaded? #=> true
+ *
+ * See also: Magic::preloaded?, Magic::new and Magic#dup
+ */
+VALUE
+rb_mgc_preload(RB_UNUSED_VAR(VALUE object), VALUE arguments)
+{
+	magic_database_t *database;
+	VALUE value = Qundef;
 
-	mga->parameter.value = value;
+	if (ARRAY_P(RARRAY_FIRST(arguments)))
+		arguments = magic_flatten(arguments);
+
+	MAGIC_CHECK_ARRAY_OF_STRINGS(arguments);
+
+	if (RARRAY_EMPTY_P(arguments))
+		arguments = magic_default_paths();
+
+	value = magic_join(arguments, CSTR2RVAL(":"));
+	RB_GC_GUARD(value);
+
+	database = magic_database_new(RVAL2CSTR(value));
+	if (!database)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+
+	NOGVL(nogvl_magic_preload, database);
+
+	pthread_mutex_lock(&rb_mgc_default_lock);
+	magic_database_unref(rb_mgc_default_database);
+	rb_mgc_default_database = magic_database_ref(database);
+	pthread_mutex_unlock(&rb_mgc_default_lock);
+
+	value = CBOOL2RVAL(database->count > 0);
+	magic_database_unref(database);
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    Magic.preloaded? -> boolean
+ *
+ * Returns +true+ if the _Magic_ database was mapped into memory with
+ * Magic::preload!, or +false+ otherwise.
+ *
+ * Example:
+ *
+ *    Magic.preloaded? #=> false
+ *    Magic.preload!   #=> true
+ *    Magic.preloaded? #=> true
+ *
+ * See also: Magic::preload!
+ */
+VALUE
+rb_mgc_preload_p(RB_UNUSED_VAR(VALUE object))
+{
+	VALUE value;
+	magic_database_t *database = magic_default_database();
+
+	value = CBOOL2RVAL(database && database->count > 0);
+	magic_database_unref(database);
+
+	return value;
+}
+
+/*
+ * Returns the number of times the process was forked, as seen from the
+ * current process, which allows native state to be reset lazily after fork.
+ */
+unsigned long
+rb_mgc_fork_generation(void)
+{
+	return MAGIC_ATOMIC_LOAD(rb_mgc_generation);
+}
+
+/*
+ * call-seq:
+ *    Magic.file_type( object )          -> string or array
+ *    Magic.file_type( string )          -> string or array
+ *    Magic.file_type( string, integer ) -> string or array
+ *
+ * Identifies the file, much like Magic::file does, but uses a Magic object
+ * that belongs to the current thread, and that was opened with the given
+ * flags (by default, Magic::MIME), rather than a new Magic object.
+ *
+ * Each thread keeps a few such Magic objects, one for each set of flags
+ * recently used, that are created from the _Magic_ database preloaded with
+ * Magic::preload! (which is preloaded on first use otherwise), and that are
+ * closed when the thread exits. Since such objects are never shared between
+ * threads, no locking is needed.
+ *
+ * Example:
+ *
+ *    Magic.file_type('/')                    #=> "inode/directory; charset=binary"
+ *    Magic.file_type('/', Magic::MIME_TYPE)  #=> "inode/directory"
+ *
+ * See also: Magic::buffer_type, Magic::file and Magic::preload!
+ */
+VALUE
+rb_mgc_file_type(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE object))
+{
+	int descriptor = 0;
+	rb_mgc_arguments_t mga;
+	VALUE value = Qundef;
+	VALUE flags = Qundef;
+
+	rb_scan_args(argc, argv, "11", &value, &flags);
+
+	if (NIL_P(flags))
+		flags = INT2NUM(MAGIC_MIME);
+
+	MAGIC_CHECK_INTEGER_TYPE(flags);
+
+	if (NIL_P(value))
+		goto error;
+
+	if (rb_respond_to(value, rb_intern("to_io"))) {
+		value = INT2NUM(magic_fileno(value));
+		descriptor = 1;
+	} else {
+		value = magic_path(value);
+		if (NIL_P(value))
+			goto error;
+	}
+
+	mga = (rb_mgc_arguments_t) {
+		.flags = NUM2INT(flags),
+	};
+
+	if (descriptor)
+		mga.file.fd = NUM2INT(value);
+	else
+		mga.file.path = RVAL2CSTR(value);
+
+	if (!descriptor && !MAGIC_ATOMIC_LOAD(rb_mgc_do_not_stop_on_error))
+		mga.flags |= MAGIC_ERROR;
+
+	if (mga.flags & MAGIC_CONTINUE)
+		mga.flags |= MAGIC_RAW;
+
+	mga.database = magic_shared_database();
+
+	if (descriptor)
+		NOGVL(nogvl_magic_descriptor_type, &mga);
+	else
+		NOGVL(nogvl_magic_file_type, &mga);
+
+	magic_database_unref(mga.database);
+
+	if (descriptor && mga.status < 0 && errno == EBADF)
+		rb_raise(rb_eIOError, "Bad file descriptor");
+
+	return magic_type_return(&mga);
+error:
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
+}
+
+/*
+ * call-seq:
+ *    Magic.buffer_type( string )          -> string or array
+ *    Magic.buffer_type( string, integer ) -> string or array
+ *
+ * Identifies the content of the buffer, much like Magic::buffer does, but
+ * uses a Magic object that belongs to the current thread, and that was
+ * opened with the given flags (by default, Magic::MIME).
+ *
+ * Example:
+ *
+ *    Magic.buffer_type("#!/bin/sh\n")                    #=> "text/x-shellscript; charset=us-ascii"
+ *    Magic.buffer_type("#!/bin/sh\n", Magic::MIME_TYPE)  #=> "text/x-shellscript"
+ *
+ * See also: Magic::file_type, Magic::buffer and Magic::preload!
+ */
+VALUE
+rb_mgc_buffer_type(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE object))
+{
+	rb_mgc_arguments_t mga;
+	rb_mgc_bytes_t bytes;
+	VALUE value = Qundef;
+	VALUE flags = Qundef;
+
+	rb_scan_args(argc, argv, "11", &value, &flags);
+
+	if (NIL_P(flags))
+		flags = INT2NUM(MAGIC_MIME);
+
+	MAGIC_CHECK_INTEGER_TYPE(flags);
+
+	if (!magic_bytes_p(value))
+		MAGIC_CHECK_STRING_TYPE(value);
+
+	mga = (rb_mgc_arguments_t) {
+		.flags = NUM2INT(flags),
+	};
+
+	if (mga.flags & MAGIC_CONTINUE)
+		mga.flags |= MAGIC_RAW;
+
+	magic_bytes_lock(value, &bytes);
+
+	mga.buffer.pointer = bytes.pointer;
+	mga.buffer.size = bytes.size;
+
+	mga.database = magic_shared_database();
+
+	NOGVL(nogvl_magic_buffer_type, &mga);
+
+	magic_bytes_unlock(&bytes);
+	magic_database_unref(mga.database);
+
+	RB_GC_GUARD(bytes.object);
+	RB_GC_GUARD(value);
+
+	return magic_type_return(&mga);
+}
+
+/*
+ * call-seq:
+ *    Magic.descriptor_type( object )           -> string or array
+ *    Magic.descriptor_type( integer )          -> string or array
+ *    Magic.descriptor_type( integer, integer ) -> string or array
+ *
+ * Identifies the content of the file descriptor, much like
+ * Magic::descriptor does, but uses a Magic object that belongs to the
+ * current thread, and that was opened with the given flags (by default,
+ * Magic::MIME).
+ *
+ * Example:
+ *
+ *    file = File.open('/bin/sh')
+ *    Magic.descriptor_type(file.fileno, Magic::MIME_TYPE)  #=> "application/x-pie-executable"
+ *
+ * See also: Magic::file_type, Magic::descriptor and Magic::preload!
+ */
+VALUE
+rb_mgc_descriptor_type(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE object))
+{
+	rb_mgc_arguments_t mga;
+	VALUE value = Qundef;
+	VALUE flags = Qundef;
+
+	rb_scan_args(argc, argv, "11", &value, &flags);
+
+	if (NIL_P(flags))
+		flags = INT2NUM(MAGIC_MIME);
+
+	MAGIC_CHECK_INTEGER_TYPE(flags);
+
+	if (rb_respond_to(value, rb_intern("to_io")))
+		value = INT2NUM(magic_fileno(value));
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+
+	mga = (rb_mgc_arguments_t) {
+		.flags = NUM2INT(flags),
+		.file.fd = NUM2INT(value),
+	};
+
+	if (mga.flags & MAGIC_CONTINUE)
+		mga.flags |= MAGIC_RAW;
+
+	mga.database = magic_shared_database();
+
+	NOGVL(nogvl_magic_descriptor_type, &mga);
+
+	magic_database_unref(mga.database);
+
+	if (mga.status < 0 && errno == EBADF)
+		rb_raise(rb_eIOError, "Bad file descriptor");
+
+	return magic_type_return(&mga);
+}
+
+/*
+ * call-seq:
+ *    Magic.current -> magic
+ *
+ * Returns a Magic object that belongs to the current Ractor, creating and
+ * loading it when it is first needed, or when it was closed.
+ *
+ * Magic objects cannot be shared between Ractors, thus each Ractor that
+ * needs to identify files gets its own object, which allows for files to be
+ * identified in parallel.
+ *
+ * Example:
+ *
+ *    Magic.current.buffer("#!/bin/sh\n") #=> "POSIX shell script, ASCII text executable"
+ *
+ *    ractor = Ractor.new { Magic.current.file('/') }
+ *    ractor.take                         #=> "directory"
+ *
+ * See also: Magic::new and Magic::preload!
+ */
+VALUE
+rb_mgc_current(RB_UNUSED_VAR(VALUE object))
+{
+	VALUE value = Qnil;
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	if (rb_ractor_local_storage_value_lookup(rb_mgc_current_key, &value) &&
+	    !MAGIC_CLOSED_P(value))
+		return value;
+
+	value = rb_class_new_instance(0, 0, rb_cMagic);
+	rb_ractor_local_storage_value_set(rb_mgc_current_key, value);
+#else
+	if (!NIL_P(rb_mgc_current_magic) && !MAGIC_CLOSED_P(rb_mgc_current_magic))
+		return rb_mgc_current_magic;
+
+	value = rb_class_new_instance(0, 0, rb_cMagic);
+	rb_mgc_current_magic = value;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    Magic::Pool.new                                                -> self
+ *    Magic::Pool.new( size: integer, flags: integer, paths: array ) -> self
+ *
+ * Creates a new pool of +size+ Magic objects, each with its own
+ * underlying _Magic_ database already loaded, and with +flags+ set.
+ * When +size+ is not given, the number of online processors is used.
+ *
+ * The pool hands out its objects to one thread at a time, thus a thread
+ * that has checked out an object does not contend with other threads for
+ * the object's lock. When no object is available, a thread will wait for
+ * one to be returned, for at most +timeout+ seconds, if given.
+ *
+ * Example:
+ *
+ *    pool = Magic::Pool.new(size: 4, flags: Magic::MIME)
+ *    pool.size                             #=> 4
+ *    pool.file('/bin/sh')                  #=> "application/x-sharedlib; charset=binary"
+ *    pool.with {|magic| magic.file('/') }  #=> "inode/directory; charset=binary"
+ *
+ * See also: Magic::Pool#with, Magic::Pool#stats and Magic::new
+ */
+VALUE
+rb_mgc_pool_initialize(int argc, VALUE *argv, VALUE object)
+{
+	long size;
+	rb_mgc_pool_t *mgp;
+	VALUE options = Qnil;
+	VALUE values[4] = { Qundef, Qundef, Qundef, Qundef };
+	VALUE flags, paths, members, magic;
+	ID keywords[4];
+
+	rb_scan_args(argc, argv, "0:", &options);
+
+	keywords[0] = rb_intern("size");
+	keywords[1] = rb_intern("flags");
+	keywords[2] = rb_intern("paths");
+	keywords[3] = rb_intern("timeout");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 4, values);
+
+	size = (long)magic_cpu_count();
+	if (values[0] != Qundef) {
+		MAGIC_CHECK_INTEGER_TYPE(values[0]);
+		size = NUM2LONG(values[0]);
+	}
+
+	if (size <= 0)
+		rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_POOL_INVALID_SIZE));
+
+	flags = values[1] == Qundef ? INT2NUM(MAGIC_NONE) : values[1];
+	MAGIC_CHECK_INTEGER_TYPE(flags);
+
+	paths = values[2] == Qundef ? RARRAY_EMPTY : values[2];
+	if (!ARRAY_P(paths))
+		paths = rb_ary_new_from_args(1, paths);
+
+	MAGIC_POOL(object, mgp);
+
+	mgp->timeout = magic_pool_timeout(mgp, values[3]);
+
+	members = rb_ary_new_capa(size);
+	mgp->members = members;
+
+	magic = rb_class_new_instance(1, &paths, rb_cMagic);
+	rb_mgc_set_flags(magic, flags);
+	rb_ary_push(members, magic);
+	/*
+	 * Copies share the Magic database of the first object, rather than
+	 * each loading the database again.
+	 */
+	for (long i = 1; i < size; i++)
+		rb_ary_push(members, rb_obj_dup(magic));
+
+	mgp->owners = ALLOC_N(VALUE, (size_t)size);
+	mgp->available = ALLOC_N(size_t, (size_t)size);
+	for (long i = 0; i < size; i++) {
+		mgp->owners[i] = Qnil;
+		mgp->available[i] = (size_t)(size - i - 1);
+	}
+
+	mgp->size = (size_t)size;
+	mgp->available_count = mgp->size;
+
+	return object;
+}
+
+/*
+ * call-seq:
+ *    pool.with {|magic| block }                    -> object
+ *    pool.with( timeout: float ) {|magic| block }  -> object
+ *
+ * Checks out a Magic object from the pool, yields it to the block, and then
+ * returns it to the pool, even if the block raises an exception. Returns
+ * the value of the block.
+ *
+ * Waits for at most +timeout+ seconds (or for the default timeout given to
+ * Magic::Pool::new) for an object to become available, and raises
+ * Magic::TimeoutError when none does in time.
+ *
+ * Example:
+ *
+ *    pool = Magic::Pool.new(size: 2)
+ *    pool.with {|magic| magic.buffer("#!/bin/sh\n") } #=> "POSIX shell script, ASCII text executable"
+ *
+ * See also: Magic::Pool#file, Magic::Pool#buffer and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_with(int argc, VALUE *argv, VALUE object)
+{
+	rb_mgc_pool_t *mgp;
+	rb_mgc_pool_checkout_t mpc;
+	VALUE options = Qnil;
+	VALUE value = Qundef;
+	ID keywords[1];
+
+	rb_need_block();
+	rb_scan_args(argc, argv, "0:", &options);
+
+	MAGIC_POOL(object, mgp);
+
+	keywords[0] = rb_intern("timeout");
+	if (!NIL_P(options))
+		rb_get_kwargs(options, keywords, 0, 1, &value);
+
+	mpc = (rb_mgc_pool_checkout_t) {
+		.pool = mgp,
+		.index = magic_pool_checkout(mgp, value == Qundef ?
+						       mgp->timeout :
+						       magic_pool_timeout(mgp, value)),
+	};
+
+	return rb_ensure(rb_yield, RARRAY_AREF(mgp->members, mpc.index),
+			 magic_pool_checkin, (VALUE)&mpc);
+}
+
+/*
+ * call-seq:
+ *    pool.file( object )             -> string or array
+ *    pool.file( string )             -> string or array
+ *    pool.file( string, **options )  -> string or array
+ *
+ * Same as Magic#file, but uses an object checked out from the pool. Any
+ * options are passed on to Magic#file as they are.
+ *
+ * See also: Magic::Pool#with, Magic::Pool#buffer and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_file(int argc, VALUE *argv, VALUE object)
+{
+	return magic_pool_call(object, rb_intern("file"), argc, argv);
+}
+
+/*
+ * call-seq:
+ *    pool.buffer( string )             -> string or array
+ *    pool.buffer( string, **options )  -> string or array
+ *
+ * Same as Magic#buffer, but uses an object checked out from the pool. Any
+ * options are passed on to Magic#buffer as they are.
+ *
+ * See also: Magic::Pool#with, Magic::Pool#file and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_buffer(int argc, VALUE *argv, VALUE object)
+{
+	return magic_pool_call(object, rb_intern("buffer"), argc, argv);
+}
+
+/*
+ * call-seq:
+ *    pool.descriptor( object )              -> string or array
+ *    pool.descriptor( integer )             -> string or array
+ *    pool.descriptor( integer, **options )  -> string or array
+ *
+ * Same as Magic#descriptor, but uses an object checked out from the pool.
+ * Any options are passed on to Magic#descriptor as they are.
+ *
+ * See also: Magic::Pool#with, Magic::Pool#file and Magic::Pool#buffer
+ */
+VALUE
+rb_mgc_pool_descriptor(int argc, VALUE *argv, VALUE object)
+{
+	return magic_pool_call(object, rb_intern("descriptor"), argc, argv);
+}
+
+/*
+ * call-seq:
+ *    pool.io( object )             -> string or array
+ *    pool.io( object, **options )  -> string or array
+ *
+ * Same as Magic#io, but uses an object checked out from the pool. Any
+ * options are passed on to Magic#io as they are.
+ *
+ * See also: Magic::Pool#with, Magic::Pool#buffer and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_io(int argc, VALUE *argv, VALUE object)
+{
+	return magic_pool_call(object, rb_intern("io"), argc, argv);
+}
+
+/*
+ * call-seq:
+ *    pool.size -> integer
+ *
+ * Returns the number of Magic objects in the pool.
+ *
+ * See also: Magic::Pool#available and Magic::Pool#stats
+ */
+VALUE
+rb_mgc_pool_size(VALUE object)
+{
+	rb_mgc_pool_t *mgp;
+
+	MAGIC_POOL(object, mgp);
+
+	return SIZET2NUM(mgp->size);
+}
+
+/*
+ * call-seq:
+ *    pool.available -> integer
+ *
+ * Returns the number of Magic objects that are currently not checked out.
+ *
+ * See also: Magic::Pool#size and Magic::Pool#stats
+ */
+VALUE
+rb_mgc_pool_available(VALUE object)
+{
+	size_t count;
+	rb_mgc_pool_t *mgp;
+
+	MAGIC_POOL(object, mgp);
+
+	magic_pool_fork_check(mgp);
+
+	pthread_mutex_lock(&mgp->lock);
+	count = mgp->available_count;
+	pthread_mutex_unlock(&mgp->lock);
+
+	return SIZET2NUM(count);
+}
+
+/*
+ * call-seq:
+ *    pool.stats -> hash
+ *
+ * Returns a snapshot of the pool counters:
+ *
+ * [+size+]        the number of Magic objects in the pool
+ * [+available+]   the number of objects not checked out
+ * [+waiting+]     the number of threads currently waiting for an object
+ * [+max_waiting+] the largest number of threads that waited at once
+ * [+checkouts+]   the total number of checkouts
+ * [+waits+]       the number of checkouts that had to wait
+ * [+timeouts+]    the number of checkouts that timed out
+ * [+wait_time+]   the total time, in seconds, spent waiting
+ *
+ * Example:
+ *
+ *    pool = Magic::Pool.new(size: 2)
+ *    pool.stats #=> {:size=>2, :available=>2, :waiting=>0, :max_waiting=>0, :checkouts=>0, :waits=>0, :timeouts=>0, :wait_time=>0.0}
+ *
+ * See also: Magic::Pool#size and Magic::Pool#available
+ */
+VALUE
+rb_mgc_pool_stats(VALUE object)
+{
+	size_t size, available;
+	rb_mgc_pool_t *mgp;
+	rb_mgc_pool_stats_t stats;
+	VALUE hash;
+
+	MAGIC_POOL(object, mgp);
+
+	magic_pool_fork_check(mgp);
+
+	pthread_mutex_lock(&mgp->lock);
+	size = mgp->size;
+	available = mgp->available_count;
+	stats = mgp->stats;
+	pthread_mutex_unlock(&mgp->lock);
+
+	hash = rb_hash_new();
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("size")), SIZET2NUM(size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("available")), SIZET2NUM(available));
+	rb_hash_aset(hash, ID2SYM(rb_intern("waiting")), SIZET2NUM(stats.waiting));
+	rb_hash_aset(hash, ID2SYM(rb_intern("max_waiting")), SIZET2NUM(stats.max_waiting));
+	rb_hash_aset(hash, ID2SYM(rb_intern("checkouts")), ULONG2NUM(stats.checkouts));
+	rb_hash_aset(hash, ID2SYM(rb_intern("waits")), ULONG2NUM(stats.waits));
+	rb_hash_aset(hash, ID2SYM(rb_intern("timeouts")), ULONG2NUM(stats.timeouts));
+	rb_hash_aset(hash, ID2SYM(rb_intern("wait_time")),
+		     DBL2NUM((double)stats.wait_time / (double)NSEC_PER_SEC));
+
+	return hash;
+}
+
+/*
+ * call-seq:
+ *    pool.close -> nil
+ *
+ * Closes every Magic object in the pool.
+ *
+ * See also: Magic#close
+ */
+VALUE
+rb_mgc_pool_close(VALUE object)
+{
+	rb_mgc_pool_t *mgp;
+
+	MAGIC_POOL(object, mgp);
+
+	if (NIL_P(mgp->members))
+		return Qnil;
+
+	for (long i = 0; i < RARRAY_LEN(mgp->members); i++)
+		rb_mgc_close(RARRAY_AREF(mgp->members, i));
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    Magic::Stream.new( magic )                -> stream
+ *    Magic::Stream.new( magic, size: integer ) -> stream
+ *
+ * Creates a stream that identifies content which arrives in chunks, such as
+ * an upload, using the given Magic object. Only the beginning of the content
+ * is kept, at most as many bytes as the given size, which by default is the
+ * Magic::PARAM_BYTES_MAX parameter of the Magic object, and the buffer for
+ * it is allocated once, up front.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    stream = Magic::Stream.new(magic, size: 16 * 1024)
+ *
+ * See also: Magic#buffer and Magic#io
+ */
+VALUE
+rb_mgc_stream_initialize(int argc, VALUE *argv, VALUE object)
+{
+	long size;
+	rb_mgc_stream_t *mgs;
+	VALUE magic = Qundef;
+	VALUE options = Qnil;
+	VALUE value = Qundef;
+	ID keyword;
+
+	rb_scan_args(argc, argv, "1:", &magic, &options);
+
+	keyword = rb_intern("size");
+
+	if (!NIL_P(options))
+		rb_get_kwargs(options, &keyword, 0, 1, &value);
+
+	if (!RTEST(rb_obj_is_kind_of(magic, rb_cMagic)))
+		MAGIC_ARGUMENT_TYPE_ERROR(magic, "Magic");
+
+	if (value == Qundef || NIL_P(value)) {
+#if defined(MAGIC_PARAM_BYTES_MAX)
+		value = rb_mgc_get_parameter(magic,
+					     INT2NUM(MAGIC_PARAM_BYTES_MAX));
+#else
+		value = SIZET2NUM(MAGIC_PREFETCH_BYTES_MAX);
+#endif /* MAGIC_PARAM_BYTES_MAX */
+	}
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+
+	size = NUM2LONG(value);
+	if (size <= 0)
+		rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_STREAM_INVALID_SIZE));
+
+	MAGIC_STREAM(object, mgs);
+
+	if (mgs->buffer)
+		ruby_xfree(mgs->buffer);
+
+	mgs->buffer = NULL;
+	mgs->buffer = ALLOC_N(char, (size_t)size);
+	mgs->size = (size_t)size;
+	mgs->length = 0;
+	mgs->magic = magic;
+	mgs->result = Qnil;
+	mgs->finished = 0;
+
+	return object;
+}
+
+/*
+ * call-seq:
+ *    stream << string -> stream
+ *
+ * Appends the chunk to the content of the stream. Once the stream is ready,
+ * chunks are ignored, without being copied, as is any part of a chunk that
+ * does not fit anymore.
+ *
+ * Example:
+ *
+ *    stream << request.read(16 * 1024)
+ *
+ * See also: Magic::Stream#write and Magic::Stream#ready?
+ */
+VALUE
+rb_mgc_stream_append(VALUE object, VALUE value)
+{
+	rb_mgc_stream_write(object, value);
+
+	return object;
+}
+
+/*
+ * call-seq:
+ *    stream.write( string ) -> integer
+ *
+ * Same as Magic::Stream#<<, but returns the size of the chunk, as if all of
+ * it was written, thus the stream can be given to IO::copy_stream.
+ *
+ * See also: Magic::Stream#<<
+ */
+VALUE
+rb_mgc_stream_write(VALUE object, VALUE value)
+{
+	size_t length;
+	rb_mgc_stream_t *mgs;
+
+	StringValue(value);
+
+	MAGIC_STREAM(object, mgs);
+
+	if (!mgs->buffer)
+		rb_raise(rb_eIOError, "uninitialized stream");
+
+	if (mgs->finished || mgs->length == mgs->size)
+		return LONG2NUM(RSTRING_LEN(value));
+
+	length = (size_t)RSTRING_LEN(value);
+	if (length > mgs->size - mgs->length)
+		length = mgs->size - mgs->length;
+
+	memcpy(mgs->buffer + mgs->length, RSTRING_PTR(value), length);
+	mgs->length += length;
+
+	return LONG2NUM(RSTRING_LEN(value));
+}
+
+/*
+ * call-seq:
+ *    stream.ready? -> true or false
+ *
+ * Returns +true+ once the content of the stream can be identified, that is,
+ * either as soon as the stream is full, or once the stream was finished,
+ * otherwise returns +false+.
+ *
+ * Example:
+ *
+ *    stream = Magic::Stream.new(magic, size: 4)
+ *    stream << "\x89PN"
+ *    stream.ready?       #=> false
+ *    stream << "G\r\n"
+ *    stream.ready?       #=> true
+ *
+ * See also: Magic::Stream#result and Magic::Stream#finish
+ */
+VALUE
+rb_mgc_stream_ready_p(VALUE object)
+{
+	rb_mgc_stream_t *mgs;
+
+	MAGIC_STREAM(object, mgs);
+
+	return CBOOL2RVAL(mgs->finished || (mgs->buffer &&
+					    mgs->length == mgs->size));
+}
+
+/*
+ * call-seq:
+ *    stream.result -> string, array or nil
+ *
+ * Returns the result of identifying the content of the stream, the same way
+ * as Magic#buffer does, once the stream is ready, otherwise returns +nil+.
+ * The content is identified only once, and the result is then kept.
+ *
+ * Example:
+ *
+ *    stream << chunk
+ *    halt 415 if stream.ready? && !ALLOWED_TYPES.include?(stream.result)
+ *
+ * See also: Magic::Stream#ready? and Magic::Stream#finish
+ */
+VALUE
+rb_mgc_stream_result(VALUE object)
+{
+	rb_mgc_stream_t *mgs;
+	VALUE string;
+
+	MAGIC_STREAM(object, mgs);
+
+	if (!NIL_P(mgs->result) || !RTEST(rb_mgc_stream_ready_p(object)))
+		return mgs->result;
+	/*
+	 * The string only points at the buffer of the stream, which is never
+	 * moved nor written to anymore, rather than copying the content.
+	 */
+	string = rb_obj_freeze(rb_str_new_static(mgs->buffer ? mgs->buffer : "",
+						 (long)mgs->length));
+
+	mgs->result = rb_mgc_buffer(1, &string, mgs->magic);
+
+	RB_GC_GUARD(object);
+	RB_GC_GUARD(string);
+
+	return mgs->result;
+}
+
+/*
+ * call-seq:
+ *    stream.finish -> string or array
+ *
+ * Marks the end of the content, thus the stream is ready, even when it is
+ * not full, and returns the result of identifying the content.
+ *
+ * Example:
+ *
+ *    IO.copy_stream(request.body, stream)
+ *    stream.finish #=> "image/png"
+ *
+ * See also: Magic::Stream#result
+ */
+VALUE
+rb_mgc_stream_finish(VALUE object)
+{
+	rb_mgc_stream_t *mgs;
+
+	MAGIC_STREAM(object, mgs);
+
+	mgs->finished = 1;
+
+	return rb_mgc_stream_result(object);
+}
+
+/*
+ * call-seq:
+ *    stream.size -> integer
+ *
+ * Returns how many bytes of the content the stream keeps at most.
+ *
+ * See also: Magic::Stream#bytesize
+ */
+VALUE
+rb_mgc_stream_size(VALUE object)
+{
+	rb_mgc_stream_t *mgs;
+
+	MAGIC_STREAM(object, mgs);
+
+	return SIZET2NUM(mgs->size);
+}
+
+/*
+ * call-seq:
+ *    stream.bytesize -> integer
+ *
+ * Returns how many bytes of the content the stream keeps so far.
+ *
+ * See also: Magic::Stream#size
+ */
+VALUE
+rb_mgc_stream_bytesize(VALUE object)
+{
+	rb_mgc_stream_t *mgs;
+
+	MAGIC_STREAM(object, mgs);
+
+	return SIZET2NUM(mgs->length);
+}
+
+/*
+ * call-seq:
+ *    result.mime_type -> string
+ *
+ * Returns the MIME type, such as "text/plain", without the character set.
+ *
+ * See also: Magic::Result#charset and Magic#result
+ */
+VALUE
+rb_mgc_report_mime_type(VALUE object)
+{
+	return magic_report_field(object, MAGIC_REPORT_MIME_TYPE);
+}
+
+/*
+ * call-seq:
+ *    result.charset -> string or nil
+ *
+ * Returns the character set that the MIME type was given with, such as
+ * "utf-8" or "binary", or +nil+ when there is none.
+ *
+ * See also: Magic::Result#mime_type and Magic#result
+ */
+VALUE
+rb_mgc_report_charset(VALUE object)
+{
+	return magic_report_field(object, MAGIC_REPORT_CHARSET);
+}
+
+/*
+ * call-seq:
+ *    result.description -> string
+ *
+ * Returns the description of the first match, the same as Magic#file would
+ * return without any flags set.
+ *
+ * See also: Magic::Result#all_matches and Magic#result
+ */
+VALUE
+rb_mgc_report_description(VALUE object)
+{
+	return magic_report_field(object, MAGIC_REPORT_DESCRIPTION_FIELD);
+}
+
+/*
+ * call-seq:
+ *    result.extensions -> array
+ *
+ * Returns the file extensions that are commonly used for the content, or
+ * an empty array when there are none known.
+ *
+ * See also: Magic#result
+ */
+VALUE
+rb_mgc_report_extensions(VALUE object)
+{
+	return magic_report_field(object, MAGIC_REPORT_EXTENSIONS_FIELD);
+}
+
+/*
+ * call-seq:
+ *    result.all_matches -> array
+ *
+ * Returns the descriptions of every match, the same as Magic#file would
+ * return with the Magic::CONTINUE flag set, but always as an array.
+ *
+ * See also: Magic::Result#description and Magic#result
+ */
+VALUE
+rb_mgc_report_all_matches(VALUE object)
+{
+	return magic_report_field(object, MAGIC_REPORT_ALL_MATCHES);
+}
+
+/*
+ * call-seq:
+ *    result.to_h -> hash
+ *
+ * Returns a frozen hash with every field of the result.
+ *
+ * Example:
+ *
+ *    magic.result("README.md").to_h #=> {:mime_type=>"text/plain", :charset=>"us-ascii", :description=>"ASCII text", :extensions=>[], :all_matches=>["ASCII text"]}
+ *
+ * See also: Magic#result
+ */
+VALUE
+rb_mgc_report_to_h(VALUE object)
+{
+	static const char * const names[MAGIC_REPORT_FIELDS] = {
+		[MAGIC_REPORT_MIME_TYPE]	 = "mime_type",
+		[MAGIC_REPORT_CHARSET]		 = "charset",
+		[MAGIC_REPORT_DESCRIPTION_FIELD] = "description",
+		[MAGIC_REPORT_EXTENSIONS_FIELD]	 = "extensions",
+		[MAGIC_REPORT_ALL_MATCHES]	 = "all_matches",
+	};
+	VALUE hash = rb_hash_new();
+
+	for (int i = 0; i < MAGIC_REPORT_FIELDS; i++)
+		rb_hash_aset(hash, ID2SYM(rb_intern(names[i])),
+			     magic_report_field(object, i));
+
+	return rb_obj_freeze(hash);
+}
+
+static inline void*
+nogvl_magic_load(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	if (mga->database) {
+		mga->status = magic_database_load(mga->database,
+						  cookie,
+						  mga->flags);
+		return NULL;
+	}
+
+	mga->status = magic_load_wrapper(cookie,
+					 mga->file.path,
+					 mga->flags);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_compile(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_compile_wrapper(cookie,
+					    mga->file.path,
+					    mga->flags);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_check(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_check_wrapper(cookie,
+					  mga->file.path,
+					  mga->flags);
+
+	return NULL;
+}
+
+static const char *
+magic_file_identify(magic_t cookie, void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	if (mga->mapped)
+		return magic_prefetch_map(cookie, mga->file.path, mga->flags);
+
+	return magic_file_wrapper(cookie, mga->file.path, mga->flags);
+}
+
+static const char *
+magic_buffer_identify(magic_t cookie, void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	return magic_buffer_wrapper(cookie,
+				    mga->buffer.pointer,
+				    mga->buffer.size,
+				    mga->flags);
+}
+
+static const char *
+magic_descriptor_identify(magic_t cookie, void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	return magic_descriptor_wrapper(cookie, mga->file.fd, mga->flags);
+}
+
+/*
+ * Identifies using the given function, or, when the debugging output is to
+ * be returned too, in a child process that captures it, see magic_capture().
+ */
+static const char *
+magic_identify_call(rb_mgc_arguments_t *mga, capture_function_t function)
+{
+	if (!mga->debug)
+		return function(mga->cookie, mga);
+
+	if (magic_capture(mga->cookie, &mga->capture, function, mga) < 0) {
+		mga->capture.error = errno;
+		return NULL;
+	}
+
+	return mga->capture.status < 0 ? NULL : mga->capture.message;
+}
+
+static inline void*
+nogvl_magic_file(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->result = magic_identify_call(mga, magic_file_identify);
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_buffer(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->result = magic_identify_call(mga, magic_buffer_identify);
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_descriptor(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->result = magic_identify_call(mga, magic_descriptor_identify);
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+/*
+ * Identifies the same file, or content, once for each of the views, each
+ * using a cookie that has the flags of the view set, see magic_cookie_acquire().
+ * A file is only opened and mapped once, see magic_prefetch_view_open().
+ */
+static void*
+nogvl_magic_identify(void *data)
+{
+	int restore;
+	magic_t cookie;
+	const char *cstring;
+	rb_mgc_identify_t *identify = data;
+	rb_mgc_object_t *mgc = identify->magic_object;
+	rb_mgc_result_t *result;
+	int flags;
+
+	if (identify->path)
+		magic_prefetch_view_open(mgc->cookie, &identify->view,
+					 identify->path, identify->flags);
+
+	for (size_t i = 0; i < identify->count; i++) {
+		result = &identify->results[i];
+		flags = identify->flags | identify->views[i]->flags;
+
+		cookie = magic_cookie_acquire(mgc, flags, &restore);
+
+		if (identify->path)
+			cstring = magic_prefetch_view_identify(cookie,
+							       &identify->view,
+							       flags);
+		else
+			cstring = magic_buffer_wrapper(cookie,
+						       identify->buffer.pointer,
+						       identify->buffer.size,
+						       flags);
+		if (!cstring) {
+			result->status = -1;
+			result->magic_errno = magic_errno_wrapper(cookie);
+			cstring = magic_error_wrapper(cookie);
+		}
+
+		if (cstring)
+			result->value = strdup(cstring);
+
+		magic_cookie_release(mgc, restore);
+	}
+
+	if (identify->path)
+		magic_prefetch_view_close(&identify->view);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_copy(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_database_t *database = mga->magic_object->database;
+	magic_t cookie = mga->copy->cookie;
+
+	mga->status = magic_database_load(database, cookie, mga->flags);
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_lock(void *data)
+{
+	rb_mgc_lock_t *mgl = data;
+	rb_mgc_object_t *mgc = mgl->magic_object;
+
+	pthread_mutex_lock(&mgc->lock);
+
+	while (mgc->locked && !mgl->interrupted)
+		pthread_cond_wait(&mgc->cond, &mgc->lock);
+
+	if (!mgc->locked) {
+		mgc->locked = 1;
+		mgc->owner = mgl->owner;
+		mgl->locked = 1;
+	}
+
+	pthread_mutex_unlock(&mgc->lock);
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_file_type(void *data)
+{
+	int local_errno;
+	rb_mgc_arguments_t *mga = data;
+
+	mga->status = -1;
+
+	mga->cookie = magic_cache_get(mga->database, mga->flags, NULL);
+	if (!mga->cookie)
+		return NULL;
+
+	mga->result = magic_file_wrapper(mga->cookie,
+					 mga->file.path,
+					 mga->flags);
+	local_errno = errno;
+
+	mga->status = !mga->result ? -1 : 0;
+	if (magic_errno_wrapper(mga->cookie) || local_errno)
+		mga->status = -1;
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_buffer_type(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->status = -1;
+
+	mga->cookie = magic_cache_get(mga->database, mga->flags, NULL);
+	if (!mga->cookie)
+		return NULL;
+
+	mga->result = magic_buffer_wrapper(mga->cookie,
+					   mga->buffer.pointer,
+					   mga->buffer.size,
+					   mga->flags);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_descriptor_type(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->status = -1;
+
+	mga->cookie = magic_cache_get(mga->database, mga->flags, NULL);
+	if (!mga->cookie)
+		return NULL;
+
+	mga->result = magic_descriptor_wrapper(mga->cookie,
+					       mga->file.fd,
+					       mga->flags);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_batch_wait(void *data)
+{
+	rb_mgc_batch_t *batch = data;
+
+	batch->finished = magic_worker_wait(&batch->job, batch->finished);
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_batch_drain(void *data)
+{
+	rb_mgc_batch_t *batch = data;
+
+	magic_worker_drain(&batch->job);
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_scan_wait(void *data)
+{
+	rb_mgc_scanner_t *scanner = data;
+
+	scanner->count = magic_scan_wait(&scanner->scan, scanner->entries,
+					 MAGIC_SCAN_QUEUE_MAX);
+	scanner->index = 0;
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_scan_drain(void *data)
+{
+	rb_mgc_scanner_t *scanner = data;
+
+	magic_worker_drain(&scanner->job);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_preload(void *data)
+{
+	magic_database_resolve(data);
+
+	return NULL;
+}
+
+static void*
+nogvl_magic_pool_wait(void *data)
+{
+	int rv = 0;
+	rb_mgc_pool_checkout_t *mpc = data;
+	rb_mgc_pool_t *mgp = mpc->pool;
+	unsigned long long started;
+
+	started = magic_clock_monotonic();
+
+	pthread_mutex_lock(&mgp->lock);
+
+	/*
+	 * Count a checkout as having waited only once, no matter how many
+	 * times it has to go back to waiting after an interrupt.
+	 */
+	if (!mpc->waited) {
+		mgp->stats.waits++;
+		mpc->waited = 1;
+	}
+
+	mgp->stats.waiting++;
+	if (mgp->stats.waiting > mgp->stats.max_waiting)
+		mgp->stats.max_waiting = mgp->stats.waiting;
+
+	while (mgp->available_count == 0 && !mpc->interrupted) {
+		if (!mpc->has_deadline) {
+			pthread_cond_wait(&mgp->cond, &mgp->lock);
+			continue;
+		}
+
+		rv = pthread_cond_timedwait(&mgp->cond, &mgp->lock,
+					    &mpc->deadline);
+		if (rv == ETIMEDOUT)
+			break;
+	}
+
+	if (mgp->available_count > 0 && !mpc->interrupted) {
+		mpc->index = (long)mgp->available[--mgp->available_count];
+		mgp->stats.checkouts++;
+	} else if (rv == ETIMEDOUT) {
+		mpc->timed_out = 1;
+		mgp->stats.timeouts++;
+	}
+
+	mgp->stats.waiting--;
+	mgp->stats.wait_time += magic_clock_monotonic() - started;
+
+	pthread_mutex_unlock(&mgp->lock);
+
+	return NULL;
+}
+
+static void
+magic_pool_unblock(void *data)
+{
+	rb_mgc_pool_checkout_t *mpc = data;
+	rb_mgc_pool_t *mgp = mpc->pool;
+
+	pthread_mutex_lock(&mgp->lock);
+	mpc->interrupted = 1;
+	pthread_cond_broadcast(&mgp->cond);
+	pthread_mutex_unlock(&mgp->lock);
+}
+
+static inline VALUE
+magic_get_parameter_internal(void *data)
+{
+	size_t value;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_getparam_wrapper(cookie,
+					     mga->parameter.tag,
+					     &value);
+
+	mga->parameter.value = value;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_set_parameter_internal(void *data)
+{
+	size_t value;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	value = mga->parameter.value;
+
+	mga->status = magic_setparam_wrapper(cookie,
+					     mga->parameter.tag,
+					     &value);
+	if (mga->status < 0)
+		return (VALUE)NULL;
+
+	for (size_t i = 0; i < mga->magic_object->cookies_count; i++) {
+		value = mga->parameter.value;
+		magic_setparam_wrapper(mga->magic_object->cookies[i].cookie,
+				       mga->parameter.tag, &value);
+	}
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_get_flags_internal(void *data)
+{
+	int flags;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = 0;
+
+	flags = magic_getflags_wrapper(cookie);
+	if (flags < 0)
+		mga->status = -1;
+	else
+		mga->flags = flags;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_set_flags_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_setflags_wrapper(cookie, mga->flags);
+	if (mga->status == 0)
+		mga->magic_object->flags = mga->flags;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_close_internal(void *data)
+{
+	magic_library_close(data);
+
+	return Qnil;
+}
+
+static VALUE
+magic_batch_internal(void *data)
+{
+	rb_mgc_batch_t *batch = data;
+	rb_mgc_object_t *mgc;
+
+	MAGIC_OBJECT(batch->object, mgc);
+
+	magic_params_get(mgc->cookie, &batch->params);
+	batch->database = magic_database_ref(mgc->database);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_scan_internal(void *data)
+{
+	rb_mgc_scanner_t *scanner = data;
+	rb_mgc_object_t *mgc;
+
+	MAGIC_OBJECT(scanner->object, mgc);
+
+	magic_params_get(mgc->cookie, &scanner->scan.params);
+	scanner->scan.database = magic_database_ref(mgc->database);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_offload_internal(void *data)
+{
+	rb_mgc_offload_t *offload = data;
+	rb_mgc_object_t *mgc;
+
+	MAGIC_OBJECT(offload->object, mgc);
+
+	magic_params_get(mgc->cookie, &offload->params);
+	offload->database = magic_database_ref(mgc->database);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_copy_internal(void *data)
+{
+	magic_params_t params;
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *source = mga->magic_object;
+	rb_mgc_object_t *mgc = mga->copy;
+
+	mga->status = 0;
+
+	magic_params_get(source->cookie, &params);
+	magic_params_set(mgc->cookie, &params);
+
+	if (source->database_loaded && source->database) {
+		NOGVL(nogvl_magic_copy, mga);
+		if (mga->status < 0)
+			return (VALUE)NULL;
+
+		mgc->database = magic_database_ref(source->database);
+		mgc->database_loaded = 1;
+	}
+
+	mga->status = magic_setflags_wrapper(mgc->cookie, mga->flags);
+	if (mga->status == 0)
+		mgc->flags = mga->flags;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_load_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+	int old_flags = mga->flags;
+
+	NOGVL(nogvl_magic_load, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(cookie, old_flags);
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_load_buffers_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_load_buffers_wrapper(cookie,
+						 mga->buffers.pointers,
+						 mga->buffers.sizes,
+						 mga->buffers.count,
+						 mga->flags);
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_compile_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+	int old_flags = mga->flags;
+
+	NOGVL(nogvl_magic_compile, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(cookie, old_flags);
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_check_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+	int old_flags = mga->flags;
+
+	NOGVL(nogvl_magic_check, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(cookie, old_flags);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_file_internal(void *data)
+{
+	int local_errno;
+	int restore_flags = 0;
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+	magic_t cookie;
+
+	if (mgc->stop_on_errors)
+		mga->flags |= MAGIC_ERROR;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	cookie = magic_cookie_acquire(mgc, mga->flags, &restore_flags);
+	mga->cookie = cookie;
+
+	NOGVL(nogvl_magic_file, mga);
+	local_errno = errno;
+	/*
+	 * The Magic library often does not correctly report errors,
+	 * especially when certain flags (such as e.g., MAGIC_EXTENSION,
+	 * etc.) are set. Attempt to obtain an error code first from the
+	 * Magic library itself, and if that does not work, then from
+	 * the saved errno value.
+	 */
+	if (magic_errno_wrapper(cookie) || local_errno)
+		mga->status = -1;
+
+	magic_cookie_release(mgc, restore_flags);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_buffer_internal(void *data)
+{
+	int restore_flags = 0;
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_bytes_t bytes;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	magic_bytes_lock(mga->value, &bytes);
+
+	if (magic_bytes_slice(&bytes, &mga->buffer) < 0) {
+		magic_bytes_unlock(&bytes);
+		rb_raise(rb_eArgError, MAGIC_ERRORS(E_OFFSET_OUT_OF_RANGE),
+			 mga->buffer.offset);
+	}
+
+	mga->cookie = magic_cookie_acquire(mga->magic_object, mga->flags,
+					   &restore_flags);
+
+	NOGVL(nogvl_magic_buffer, mga);
+
+	magic_bytes_unlock(&bytes);
+
+	RB_GC_GUARD(bytes.object);
+
+	magic_cookie_release(mga->magic_object, restore_flags);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_descriptor_internal(void *data)
+{
+	int restore_flags = 0;
+	rb_mgc_arguments_t *mga = data;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	mga->cookie = magic_cookie_acquire(mga->magic_object, mga->flags,
+					   &restore_flags);
+
+	NOGVL(nogvl_magic_descriptor, mga);
+
+	magic_cookie_release(mga->magic_object, restore_flags);
+
+	return (VALUE)NULL;
+}
+
+/*
+ * Returns the cookie to identify with using the given flags. The cookie of
+ * the object is used as-is when its flags are the same. Otherwise, a cookie
+ * that has the given flags set is taken from the small set kept by the object,
+ * or opened and added to it, loaded from the same database and given the same
+ * parameters. Only when the database is not shared, or the set is full, are
+ * the flags of the cookie of the object changed for the time being, in which
+ * case the restore flag is set, see magic_cookie_release().
+ *
+ * Must be called with the lock of the object held.
+ */
+static magic_t
+magic_cookie_acquire(rb_mgc_object_t *mgc, int flags, int *restore)
+{
+	magic_params_t params;
+	rb_mgc_cookie_t *entry;
+	magic_t cookie;
+
+	*restore = 0;
+
+	if (flags == mgc->flags)
+		return mgc->cookie;
+
+	for (size_t i = 0; i < mgc->cookies_count; i++) {
+		entry = &mgc->cookies[i];
+		/*
+		 * A cookie loaded from a database that the object no longer
+		 * uses, since it was loaded again, is closed and forgotten.
+		 */
+		if (entry->database != mgc->database) {
+			magic_close_wrapper(entry->cookie);
+			magic_database_unref(entry->database);
+			*entry = mgc->cookies[--mgc->cookies_count];
+			i--;
+			continue;
+		}
+
+		if (entry->flags == flags)
+			return entry->cookie;
+	}
+
+	if (!mgc->database || mgc->cookies_count >= MAGIC_COOKIES_MAX)
+		goto fallback;
+
+	cookie = magic_database_open(mgc->database, flags);
+	if (!cookie)
+		goto fallback;
+
+	magic_params_get(mgc->cookie, &params);
+	magic_params_set(cookie, &params);
+
+	mgc->cookies[mgc->cookies_count++] = (rb_mgc_cookie_t) {
+		.cookie = cookie,
+		.database = magic_database_ref(mgc->database),
+		.flags = flags,
+	};
+
+	return cookie;
+fallback:
+	*restore = 1;
+	magic_setflags_wrapper(mgc->cookie, flags);
+
+	return mgc->cookie;
+}
+
+static inline void
+magic_cookie_release(rb_mgc_object_t *mgc, int restore)
+{
+	if (restore)
+		magic_setflags_wrapper(mgc->cookie, mgc->flags);
+}
+
+static void
+magic_cookies_close(rb_mgc_object_t *mgc)
+{
+	rb_mgc_cookie_t *entry;
+
+	for (size_t i = 0; i < mgc->cookies_count; i++) {
+		entry = &mgc->cookies[i];
+
+		magic_close_wrapper(entry->cookie);
+		magic_database_unref(entry->database);
+	}
+
+	mgc->cookies_count = 0;
+}
+
+static VALUE
+magic_identify_internal(void *data)
+{
+	rb_mgc_identify_t *identify = data;
+	rb_mgc_bytes_t bytes;
+
+	if (identify->path) {
+		NOGVL(nogvl_magic_identify, identify);
+		return (VALUE)NULL;
+	}
+
+	magic_bytes_lock(identify->value, &bytes);
+
+	identify->buffer.pointer = bytes.pointer;
+	identify->buffer.size = bytes.size;
+
+	NOGVL(nogvl_magic_identify, identify);
+
+	magic_bytes_unlock(&bytes);
+
+	RB_GC_GUARD(bytes.object);
+
+	return (VALUE)NULL;
+}
+
+static inline void*
+magic_library_open(void)
+{
+	magic_t cookie;
+
+	cookie = magic_open_wrapper(MAGIC_NONE);
+	if (!cookie) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return cookie;
+}
+
+static inline void
+magic_library_close(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	magic_cookies_close(mgc);
+
+	if (mgc->cookie)
+		magic_close_wrapper(mgc->cookie);
+
+	magic_database_unref(mgc->database);
+
+	mgc->cookie = NULL;
+	mgc->database = NULL;
+}
+
+static VALUE
+magic_allocate(VALUE klass)
+{
+	int local_errno;
+	rb_mgc_object_t *mgc;
+
+	mgc = RB_ALLOC(rb_mgc_object_t);
+	local_errno = ENOMEM;
+
+	if (!mgc) {
+		errno = local_errno;
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
+				    local_errno,
+				    E_NOT_ENOUGH_MEMORY);
+	}
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	mgc->cookie = NULL;
+	mgc->database = NULL;
+	mgc->cookies_count = 0;
+	mgc->generation = rb_mgc_fork_generation();
+	mgc->flags = MAGIC_NONE;
+	mgc->database_loaded = 0;
+	mgc->stop_on_errors = 0;
+	mgc->intern_results = 0;
+	mgc->locked = 0;
+	mgc->owner = Qnil;
+
+	mgc->cookie = magic_library_open();
+	local_errno = errno;
+
+	if (!mgc->cookie) {
+		ruby_xfree(mgc);
+		mgc = NULL;
+		errno = local_errno;
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
+				    local_errno,
+				    E_MAGIC_LIBRARY_INITIALIZE);
+	}
+
+	pthread_mutex_init(&mgc->lock, NULL);
+	pthread_cond_init(&mgc->cond, NULL);
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_type, mgc);
+}
+
+static inline void
+magic_free(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	if (mgc->cookie)
+		magic_library_close(data);
+
+	pthread_mutex_destroy(&mgc->lock);
+	pthread_cond_destroy(&mgc->cond);
+
+	mgc->cookie = NULL;
+
+	ruby_xfree(mgc);
+}
+
+static inline void
+magic_mark(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	rb_gc_mark(mgc->owner);
+}
+
+static inline size_t
+magic_size(const void *data)
+{
+	const rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	return sizeof(*mgc);
+}
+
+static inline VALUE
+magic_exception_wrapper(VALUE value)
+{
+	rb_mgc_error_t *mge = (rb_mgc_error_t *)value;
+
+	return rb_exc_new2(mge->klass, mge->magic_error);
+}
+
+static VALUE
+magic_exception(void *data)
+{
+	int exception = 0;
+	rb_mgc_error_t *mge = data;
+	VALUE object = Qundef;
+
+	assert(mge != NULL &&
+	       "Must be a valid pointer to `rb_mgc_error_t' type");
+
+	object = rb_protect(magic_exception_wrapper, (VALUE)mge, &exception);
+
+	if (exception)
+		rb_jump_tag(exception);
+
+	rb_iv_set(object, "@errno", INT2NUM(mge->magic_errno));
+	RB_GC_GUARD(object);
+
+	return object;
+}
+
+static inline VALUE
+magic_generic_error(VALUE klass, int magic_errno, const char *magic_error)
+{
+	rb_mgc_error_t mge;
+
+	mge = (rb_mgc_error_t) {
+		.klass       = klass,
+		.magic_errno = magic_errno,
+		.magic_error = magic_error,
+	};
+
+	return magic_exception(&mge);
+}
+
+static VALUE
+magic_library_error(VALUE klass, void *data)
+{
+	rb_mgc_error_t mge;
+	const char *message = NULL;
+	const char *empty = "(null)";
+	magic_t cookie = data;
+
+	UNUSED(empty);
+
+	assert(cookie != NULL &&
+	       "Must be a valid pointer to `magic_t' type");
+
+	mge = (rb_mgc_error_t) {
+		.klass       = klass,
+		.magic_errno = -1,
+		.magic_error = MAGIC_ERRORS(E_UNKNOWN),
+	};
+
+	message = magic_error_wrapper(cookie);
+	if (message) {
+		mge.magic_errno = magic_errno_wrapper(cookie);
+		mge.magic_error = message;
+	}
+
+	assert(strncmp(mge.magic_error, empty, strlen(empty)) != 0 &&
+		       "Empty or invalid error message");
+
+	return magic_exception(&mge);
+}
+
+/*
+ * Returns the error of the Magic library, which, when the debugging output
+ * was captured, is the one the child process reported, see magic_capture().
+ */
+static VALUE
+magic_identify_error(VALUE klass, rb_mgc_arguments_t *mga)
+{
+	rb_mgc_error_t mge;
+
+	if (!mga->debug)
+		return magic_library_error(klass, mga->cookie);
+
+	mge = (rb_mgc_error_t) {
+		.klass       = klass,
+		.magic_errno = -1,
+		.magic_error = MAGIC_ERRORS(E_UNKNOWN),
+	};
+
+	if (mga->capture.message) {
+		mge.magic_errno = mga->capture.magic_errno;
+		mge.magic_error = mga->capture.message;
+	}
+
+	return magic_exception(&mge);
+}
+
+VALUE
+magic_lock(VALUE object, VALUE(*function)(ANYARGS), void *data)
+{
+	rb_mgc_object_t *mgc;
+	rb_mgc_lock_t mgl;
+
+	MAGIC_OBJECT(object, mgc);
+
+	magic_fork_check(object, mgc);
+
+	mgl = (rb_mgc_lock_t) {
+		.magic_object = mgc,
+		.owner = rb_thread_current(),
+	};
+	/*
+	 * The mutex itself is only ever held for a moment, while the object
+	 * is held for as long as the function runs. A thread can try to take
+	 * the object again while holding it, for instance, from a signal
+	 * handler that runs once the identification is done, and it must not
+	 * wait for itself then.
+	 */
+	pthread_mutex_lock(&mgc->lock);
+
+	if (mgc->locked && mgc->owner == mgl.owner) {
+		pthread_mutex_unlock(&mgc->lock);
+		rb_raise(rb_eThreadError, "deadlock; recursive locking");
+	}
+
+	if (!mgc->locked) {
+		mgc->locked = 1;
+		mgc->owner = mgl.owner;
+		mgl.locked = 1;
+	}
+
+	pthread_mutex_unlock(&mgc->lock);
+	/*
+	 * The object can be held by a thread that waits to re-acquire the
+	 * GVL, thus the GVL has to be released while waiting for the object.
+	 */
+	while (!mgl.locked) {
+		mgl.interrupted = 0;
+
+		NOGVL_WAIT(nogvl_magic_lock, &mgl, magic_lock_unblock, &mgl);
+		if (mgl.locked)
+			break;
+
+		rb_thread_check_ints();
+	}
+
+	return rb_ensure(function, (VALUE)data, magic_unlock, object);
+}
+
+VALUE
+magic_unlock(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_OBJECT(object, mgc);
+
+	pthread_mutex_lock(&mgc->lock);
+	mgc->locked = 0;
+	mgc->owner = Qnil;
+	pthread_cond_signal(&mgc->cond);
+	pthread_mutex_unlock(&mgc->lock);
+
+	return Qnil;
+}
+
+static void
+magic_lock_unblock(void *data)
+{
+	rb_mgc_lock_t *mgl = data;
+	rb_mgc_object_t *mgc = mgl->magic_object;
+
+	pthread_mutex_lock(&mgc->lock);
+	mgl->interrupted = 1;
+	pthread_cond_broadcast(&mgc->cond);
+	pthread_mutex_unlock(&mgc->lock);
+}
+
+/*
+ * Returns the string to read from without holding the GVL, which must not
+ * change until then. A frozen string is used as it is, and other strings
+ * are locked against changes, see rb_str_locktmp(), rather than copied,
+ * thus the caller has to unlock the string when told so. A string that is
+ * locked already, for instance, by another thread identifying the same
+ * string, is frozen into a new string instead, which shares the content of
+ * the string, unless the string is short enough to be embedded.
+ *
+ * The string is kept on the stack of the caller while the GVL is released,
+ * which also keeps the garbage collector from moving the string.
+ */
+static VALUE
+magic_string_lock(VALUE value, int *locked)
+{
+	int state = 0;
+
+	*locked = 0;
+
+	if (OBJ_FROZEN(value))
+		return value;
+
+	rb_protect(rb_str_locktmp, value, &state);
+	if (state) {
+		rb_set_errinfo(Qnil);
+		return rb_str_new_frozen(value);
+	}
+
+	*locked = 1;
+
+	return value;
+}
+
+/*
+ * Returns whether the object holds bytes that can be identified in place,
+ * that is, whether it is a string, an IO::Buffer, or an object that exports
+ * its memory through the memory view protocol.
+ */
+static int
+magic_bytes_p(VALUE value)
+{
+	if (RB_TYPE_P(value, T_STRING))
+		return 1;
+
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING)
+	if (RTEST(rb_obj_is_kind_of(value, rb_cIOBuffer)))
+		return 1;
+#endif /* HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING */
+
+#if defined(HAVE_RB_MEMORY_VIEW_GET)
+	if (rb_memory_view_available_p(value))
+		return 1;
+#endif /* HAVE_RB_MEMORY_VIEW_GET */
+
+	return 0;
+}
+
+/*
+ * Makes the bytes of the object safe to read without holding the GVL, and
+ * without copying them, until magic_bytes_unlock() is called. Strings are
+ * handled by magic_string_lock(), an IO::Buffer is locked, which keeps it
+ * from being resized or freed, and for other objects a memory view is held.
+ * An IO::Buffer that is locked already has its content copied instead.
+ *
+ * The caller has to keep the returned object on its stack, which keeps the
+ * object alive, and the garbage collector from moving it.
+ */
+static void
+magic_bytes_lock(VALUE value, rb_mgc_bytes_t *bytes)
+{
+	int locked;
+	int state = 0;
+
+	*bytes = (rb_mgc_bytes_t) {
+		.object = value,
+		.pointer = "",
+	};
+
+	if (RB_TYPE_P(value, T_STRING)) {
+		bytes->object = magic_string_lock(value, &locked);
+		bytes->pointer = RSTRING_PTR(bytes->object);
+		bytes->size = (size_t)RSTRING_LEN(bytes->object);
+		bytes->lock = locked ? MAGIC_BYTES_STRING : MAGIC_BYTES_UNLOCKED;
+		return;
+	}
+
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING)
+	if (RTEST(rb_obj_is_kind_of(value, rb_cIOBuffer))) {
+		rb_io_buffer_get_bytes_for_reading(value, &bytes->pointer,
+						   &bytes->size);
+
+		rb_protect(rb_io_buffer_lock, value, &state);
+		if (state) {
+			rb_set_errinfo(Qnil);
+			bytes->object = rb_str_new((const char *)bytes->pointer,
+						   (long)bytes->size);
+			bytes->pointer = RSTRING_PTR(bytes->object);
+			return;
+		}
+
+		if (!bytes->pointer)
+			bytes->pointer = "";
+
+		bytes->lock = MAGIC_BYTES_IO_BUFFER;
+		return;
+	}
+#endif /* HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING */
+
+#if defined(HAVE_RB_MEMORY_VIEW_GET)
+	if (rb_memory_view_get(value, &bytes->view, RUBY_MEMORY_VIEW_SIMPLE)) {
+		/*
+		 * A view without strides, such as a view of a byte array, is
+		 * always contiguous.
+		 */
+		if (bytes->view.strides &&
+		    !rb_memory_view_is_contiguous(&bytes->view)) {
+			rb_memory_view_release(&bytes->view);
+			rb_raise(rb_eArgError, "%s",
+				 MAGIC_ERRORS(E_MEMORY_VIEW_NOT_CONTIGUOUS));
+		}
+
+		if (bytes->view.data)
+			bytes->pointer = bytes->view.data;
+
+		bytes->size = (size_t)bytes->view.byte_size;
+		bytes->lock = MAGIC_BYTES_MEMORY_VIEW;
+		return;
+	}
+#endif /* HAVE_RB_MEMORY_VIEW_GET */
+
+	UNUSED(state);
+
+	MAGIC_CHECK_STRING_TYPE(value);
+}
+
+static void
+magic_bytes_unlock(rb_mgc_bytes_t *bytes)
+{
+	switch (bytes->lock) {
+	case MAGIC_BYTES_STRING:
+		rb_str_unlocktmp(bytes->object);
+		break;
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING)
+	case MAGIC_BYTES_IO_BUFFER:
+		rb_io_buffer_unlock(bytes->object);
+		break;
+#endif /* HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING */
+#if defined(HAVE_RB_MEMORY_VIEW_GET)
+	case MAGIC_BYTES_MEMORY_VIEW:
+		rb_memory_view_release(&bytes->view);
+		break;
+#endif /* HAVE_RB_MEMORY_VIEW_GET */
+	default:
+		break;
+	}
+
+	bytes->lock = MAGIC_BYTES_UNLOCKED;
+}
+
+/*
+ * Returns whether the io option asks for the file to be mapped into memory
+ * rather than read, see magic_prefetch_map().
+ */
+static int
+magic_io_mapped(VALUE value)
+{
+	if (value == Qundef || NIL_P(value) || value == ID2SYM(rb_intern("read")))
+		return 0;
+
+	if (value == ID2SYM(rb_intern("mmap")))
+		return 1;
+
+	rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_IO_INVALID_TYPE));
+}
+
+/*
+ * Returns how many bytes of the content of an IO to identify, that is, as
+ * many as the Magic library would read from a file.
+ */
+static size_t
+magic_io_length(VALUE object)
+{
+#if defined(MAGIC_PARAM_BYTES_MAX)
+	VALUE tag = INT2NUM(MAGIC_PARAM_BYTES_MAX);
+
+	return NUM2SIZET(rb_mgc_get_parameter(object, tag));
+#else
+	UNUSED(object);
+
+	return MAGIC_PREFETCH_BYTES_MAX;
+#endif /* MAGIC_PARAM_BYTES_MAX */
+}
+
+/*
+ * Returns the beginning of the content that is yet to be read from the IO,
+ * such that it can still be read afterwards, see rb_mgc_io().
+ */
+static VALUE
+magic_io_peek(VALUE value, size_t length)
+{
+	int pending = 0;
+	VALUE io, string;
+	rb_mgc_io_t mgi = {
+		.object = value,
+		.length = length,
+	};
+
+	io = rb_io_check_io(value);
+	if (!NIL_P(io) && magic_io_socket_p(io, &pending)) {
+		if (!pending)
+			return magic_io_recv(io, length);
+		/*
+		 * What was already read into the buffer of the IO is what has
+		 * arrived, and reading only that does not block.
+		 */
+		string = rb_funcall(io, rb_intern("readpartial"), 1,
+				    SIZET2NUM(length));
+		StringValue(string);
+
+		rb_funcall(io, rb_intern("ungetbyte"), 1, string);
+		return string;
+	}
+
+	if (rb_respond_to(value, rb_intern("pos")) &&
+	    rb_respond_to(value, rb_intern("seek"))) {
+		/*
+		 * Pipes, for instance, respond to both, but cannot tell their
+		 * position, and these have their content pushed back instead.
+		 */
+		mgi.position = rb_rescue2(magic_io_tell, value,
+					  magic_io_unseekable, Qnil,
+					  rb_eIOError,
+					  rb_const_get(rb_mErrno,
+						       rb_intern("ESPIPE")),
+					  (VALUE)0);
+		if (mgi.position != Qundef)
+			return rb_ensure(magic_io_read, (VALUE)&mgi,
+					 magic_io_seek, (VALUE)&mgi);
+	}
+
+	if (rb_respond_to(value, rb_intern("ungetbyte"))) {
+		string = magic_io_read_partial((VALUE)&mgi);
+		rb_funcall(value, rb_intern("ungetbyte"), 1, string);
+		return string;
+	}
+
+	if (rb_respond_to(value, rb_intern("ungetc"))) {
+		string = magic_io_read_partial((VALUE)&mgi);
+		rb_funcall(value, rb_intern("ungetc"), 1, string);
+		return string;
+	}
+
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "IO-like object");
+}
+
+/*
+ * Returns whether the IO is a socket, from which the content can be peeked
+ * at directly, unless some of it was already read into the buffer of the IO,
+ * in which case it is pending.
+ */
+static int
+magic_io_socket_p(VALUE io, int *pending)
+{
+#if defined(HAVE_SYS_SOCKET_H) && defined(MSG_PEEK) && defined(MSG_DONTWAIT)
+	rb_io_t *fptr;
+	struct stat sb;
+
+	GetOpenFile(io, fptr);
+	rb_io_check_readable(fptr);
+
+	*pending = rb_io_read_pending(fptr);
+
+	return fstat(magic_fileno(io), &sb) == 0 && S_ISSOCK(sb.st_mode);
+#else
+	UNUSED(io);
+
+	*pending = 0;
+
+	return 0;
+#endif
+}
+
+static VALUE
+magic_io_recv(VALUE io, size_t length)
+{
+#if defined(HAVE_SYS_SOCKET_H) && defined(MSG_PEEK) && defined(MSG_DONTWAIT)
+	int fd;
+	ssize_t n;
+	VALUE string = rb_str_buf_new((long)length);
+
+	fd = magic_fileno(io);
+
+	for (;;) {
+		n = recv(fd, RSTRING_PTR(string), length,
+			 MSG_PEEK | MSG_DONTWAIT);
+		if (n >= 0)
+			break;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			rb_sys_fail("recv");
+
+# if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+		rb_io_wait(io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+# else
+		rb_thread_wait_fd(fd);
+# endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+	}
+
+	rb_str_set_len(string, (long)n);
+
+	return rb_str_resize(string, (long)n);
+#else
+	UNUSED(io);
+	UNUSED(length);
+
+	return rb_str_new(0, 0);
+#endif
+}
+
+static VALUE
+magic_io_tell(VALUE value)
+{
+	return rb_funcall(value, rb_intern("pos"), 0);
+}
+
+static VALUE
+magic_io_read(VALUE data)
+{
+	VALUE string;
+	rb_mgc_io_t *mgi = (rb_mgc_io_t *)data;
+
+	string = rb_funcall(mgi->object, rb_intern("read"), 1,
+			    SIZET2NUM(mgi->length));
+	if (NIL_P(string))
+		return rb_str_new(0, 0);
+
+	StringValue(string);
+
+	return string;
+}
+
+static VALUE
+magic_io_unseekable(RB_UNUSED_VAR(VALUE data), RB_UNUSED_VAR(VALUE error))
+{
+	return Qundef;
+}
+
+/*
+ * Reads only what has already arrived, or waits until at least some of the
+ * content arrives, rather than until all of the given length does, which,
+ * for a pipe, could be only once the writer closes its end.
+ */
+static VALUE
+magic_io_read_partial(VALUE data)
+{
+	rb_mgc_io_t *mgi = (rb_mgc_io_t *)data;
+
+	if (!rb_respond_to(mgi->object, rb_intern("readpartial")))
+		return magic_io_read(data);
+
+	return rb_rescue2(magic_io_readpartial, data, magic_io_eof, Qnil,
+			  rb_eEOFError, (VALUE)0);
+}
+
+static VALUE
+magic_io_readpartial(VALUE data)
+{
+	VALUE string;
+	rb_mgc_io_t *mgi = (rb_mgc_io_t *)data;
+
+	string = rb_funcall(mgi->object, rb_intern("readpartial"), 1,
+			    SIZET2NUM(mgi->length));
+	StringValue(string);
+
+	return string;
+}
+
+static VALUE
+magic_io_eof(RB_UNUSED_VAR(VALUE data), RB_UNUSED_VAR(VALUE error))
+{
+	return rb_str_new(0, 0);
+}
+
+static VALUE
+magic_io_seek(VALUE data)
+{
+	rb_mgc_io_t *mgi = (rb_mgc_io_t *)data;
+
+	return rb_funcall(mgi->object, rb_intern("seek"), 1, mgi->position);
+}
+
+/*
+ * Converts the offset and the length of a slice of the bytes, where an offset
+ * that was not given is the first byte, and a length that was not given is
+ * marked as negative, meaning everything from the offset onwards.
+ */
+static void
+magic_bytes_range(VALUE offset, VALUE length, struct buffer *buffer)
+{
+	buffer->offset = 0;
+	buffer->length = -1;
+
+	if (offset != Qundef && !NIL_P(offset)) {
+		MAGIC_CHECK_INTEGER_TYPE(offset);
+		buffer->offset = NUM2LONG(offset);
+	}
+
+	if (length != Qundef && !NIL_P(length)) {
+		MAGIC_CHECK_INTEGER_TYPE(length);
+		buffer->length = NUM2LONG(length);
+		if (buffer->length < 0)
+			rb_raise(rb_eArgError, MAGIC_ERRORS(E_LENGTH_NEGATIVE),
+				 buffer->length);
+	}
+}
+
+/*
+ * Points the buffer at the slice of the locked bytes, counting a negative
+ * offset from the end, and shortening the length to what is left after the
+ * offset. Returns -1 when the offset lies outside of the bytes.
+ */
+static int
+magic_bytes_slice(const rb_mgc_bytes_t *bytes, struct buffer *buffer)
+{
+	size_t offset, length;
+
+	if (buffer->offset < 0) {
+		offset = (size_t)0 - (size_t)buffer->offset;
+		if (offset > bytes->size)
+			return -1;
+
+		offset = bytes->size - offset;
+	}
+	else {
+		offset = (size_t)buffer->offset;
+		if (offset > bytes->size)
+			return -1;
+	}
+
+	length = bytes->size - offset;
+	if (buffer->length >= 0 && (size_t)buffer->length < length)
+		length = (size_t)buffer->length;
+
+	buffer->pointer = (const char *)bytes->pointer + offset;
+	buffer->size = length;
+
+	return 0;
+}
+
+static VALUE
+magic_return(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	const char *separator = NULL;
+	const char *unknown = NULL;
+
+	if (RTEST(mga->into))
+		return magic_result_into(mga->into, mga->result, mga->flags);
+
+	/*
+	 * The value below is a field separator that can be used to split results
+	 * when the CONTINUE flag is set causing all valid matches found by the
+	 * Magic library to be returned.
+	 */
+	if (mga->flags & MAGIC_CONTINUE)
+		separator = MAGIC_CONTINUE_SEPARATOR;
+
+	if (mga->flags & MAGIC_EXTENSION) {
+		/*
+		 * A possible I/O-related error has occurred, and there is very
+		 * little sense processing the results, so return string as-is.
+		 */
+		if (mga->status < 0)
+			return CSTR2RVAL(mga->result);
+		/*
+		 * A number of Magic flags that support primarily files e.g.,
+		 * MAGIC_EXTENSION, etc., would not return a meaningful value for
+		 * directories and special files, and such. Thus, it's better to
+		 * return an empty string, to indicate lack of results, rather
+		 * than a confusing string consisting of three questions marks.
+		 */
+		unknown = "???";
+		if (strncmp(mga->result, unknown, strlen(unknown)) == 0)
+			return magic_result_string("", 0, mga->intern);
+
+		separator = MAGIC_EXTENSION_SEPARATOR;
+	}
+
+	if (separator)
+		return magic_split_result(mga->result, separator, mga->intern);
+
+	return magic_strip_result(mga->result,
+				  mga->result + strlen(mga->result),
+				  mga->intern);
+}
+
+static inline int
+magic_space_p(char c)
+{
+	return c == '\0' || c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Returns a new string with the part of the result between the given
+ * pointers, less the leading and trailing whitespace, the same as what
+ * String#strip would return.
+ */
+static VALUE
+magic_strip_result(const char *start, const char *end, int intern)
+{
+	while (start < end && magic_space_p(*start))
+		start++;
+
+	while (end > start && magic_space_p(*(end - 1)))
+		end--;
+
+	return magic_result_string(start, end - start, intern);
+}
+
+/*
+ * Replaces the content of the given string with the result, stripped the
+ * same way as magic_strip_result() does, growing the string only when it
+ * cannot hold the result already, thus without allocating any objects.
+ */
+static VALUE
+magic_result_into(VALUE into, const char *result, int flags)
+{
+	const char *start = result;
+	const char *end = result + strlen(result);
+	long length;
+
+	if ((flags & MAGIC_EXTENSION) && strncmp(result, "???", 3) == 0)
+		end = start;
+
+	while (start < end && magic_space_p(*start))
+		start++;
+
+	while (end > start && magic_space_p(*(end - 1)))
+		end--;
+
+	length = end - start;
+
+	rb_str_modify(into);
+	if ((long)rb_str_capacity(into) < length)
+		rb_str_modify_expand(into, length - RSTRING_LEN(into));
+
+	memcpy(RSTRING_PTR(into), start, (size_t)length);
+	rb_str_set_len(into, length);
+
+	return into;
+}
+
+static void
+magic_check_into(VALUE value)
+{
+	MAGIC_CHECK_STRING_TYPE(value);
+	rb_check_frozen(value);
+}
+
+static int
+magic_debug_p(VALUE value)
+{
+	if (value == Qundef || !RTEST(value))
+		return 0;
+
+#if !defined(HAVE_WORKING_FORK)
+	rb_raise(rb_eNotImpError, "%s", MAGIC_ERRORS(E_DEBUG_NOT_SUPPORTED));
+#endif /* HAVE_WORKING_FORK */
+
+	return 1;
+}
+
+static inline VALUE
+magic_debug_return(rb_mgc_arguments_t *mga, VALUE value, VALUE trace)
+{
+	if (!mga->debug)
+		return value;
+
+	return rb_assoc_new(value, trace);
+}
+
+/*
+ * Returns the debugging output captured while identifying, and moves the
+ * result, or the error message, into a string, so that the memory it was
+ * captured to can be released, see magic_capture().
+ */
+static VALUE
+magic_capture_value(rb_mgc_arguments_t *mga, VALUE *message)
+{
+	VALUE value;
+	capture_t *capture = &mga->capture;
+
+	if (capture->error)
+		rb_syserr_fail(capture->error, MAGIC_ERRORS(E_DEBUG_CAPTURE_FAILED));
+
+	value = rb_str_new(capture->buffer, (long)capture->size);
+
+	free(capture->buffer);
+	capture->buffer = NULL;
+
+	if (capture->message) {
+		*message = rb_str_new_cstr(capture->message);
+
+		free(capture->message);
+		capture->message = RSTRING_PTR(*message);
+
+		if (mga->result)
+			mga->result = capture->message;
+	}
+
+	return value;
+}
+
+static inline VALUE
+magic_result_string(const char *pointer, long length, int intern)
+{
+	if (intern)
+		return magic_intern(pointer, length);
+
+	return rb_str_new(pointer, length);
+}
+
+/*
+ * Returns the encoding that the result is in, that is, US-ASCII when it
+ * only has ASCII characters, or UTF-8 when it is valid as such, as it would
+ * be for descriptions that come from a Magic database written in UTF-8.
+ */
+static rb_encoding *
+magic_result_encoding(const char *pointer, long length)
+{
+	int r, ascii = 1;
+	const char *end = pointer + length;
+	rb_encoding *encoding = rb_utf8_encoding();
+
+	while (pointer < end) {
+		if ((unsigned char)*pointer < 0x80) {
+			pointer++;
+			continue;
+		}
+
+		ascii = 0;
+
+		r = rb_enc_precise_mbclen(pointer, end, encoding);
+		if (!MBCLEN_CHARFOUND_P(r))
+			return rb_ascii8bit_encoding();
+
+		pointer += MBCLEN_CHARFOUND_LEN(r);
+	}
+
+	return ascii ? rb_usascii_encoding() : encoding;
+}
+
+static inline unsigned long
+magic_intern_hash(const char *pointer, long length)
+{
+	unsigned long hash = 2166136261UL;
+
+	for (long i = 0; i < length; i++) {
+		hash ^= (unsigned char)pointer[i];
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/*
+ * Returns a frozen and deduplicated string with the given part of a result,
+ * taken from a table of the results returned recently. The table has a fixed
+ * number of slots, and a result that is not there takes over the slot that
+ * it maps to, thus the table never grows, however many distinct results
+ * there are.
+ *
+ * The string is never created with the lock held, as creating it could
+ * start the garbage collector, which would wait for any other Ractor that
+ * is itself waiting for the lock.
+ */
+static VALUE
+magic_intern(const char *pointer, long length)
+{
+	VALUE string = Qundef;
+	unsigned long hash = magic_intern_hash(pointer, length);
+	rb_mgc_intern_entry_t *entry;
+
+	entry = &rb_mgc_intern.entries[hash & (MAGIC_INTERN_SIZE - 1)];
+
+	pthread_mutex_lock(&rb_mgc_intern.lock);
+	if (entry->hash == hash && !NIL_P(entry->string) &&
+	    RSTRING_LEN(entry->string) == length &&
+	    memcmp(RSTRING_PTR(entry->string), pointer, (size_t)length) == 0)
+		string = entry->string;
+	pthread_mutex_unlock(&rb_mgc_intern.lock);
+
+	if (string != Qundef)
+		return string;
+
+#if defined(HAVE_RB_ENC_INTERNED_STR)
+	string = rb_enc_interned_str(pointer, length,
+				     magic_result_encoding(pointer, length));
+#else
+	string = rb_enc_str_new(pointer, length,
+				magic_result_encoding(pointer, length));
+	rb_obj_freeze(string);
+#endif /* HAVE_RB_ENC_INTERNED_STR */
+
+	pthread_mutex_lock(&rb_mgc_intern.lock);
+	entry->string = string;
+	entry->hash = hash;
+	pthread_mutex_unlock(&rb_mgc_intern.lock);
+
+	return string;
+}
+
+/*
+ * Splits the result on the given separator in a single pass, and returns
+ * either a single string, when there is only one part, or an array of the
+ * parts that are not empty, each with its whitespace stripped. This is the
+ * same as what String#split would return, which drops any trailing empty
+ * parts, followed by stripping each of the parts, only without creating any
+ * intermediate strings and arrays.
+ */
+static VALUE
+magic_split_result(const char *result, const char *separator, int intern)
+{
+	const char *start = result, *end;
+	const char *first = NULL, *first_end = NULL;
+	size_t length = strlen(separator);
+	VALUE array = Qnil;
+
+	for (size_t index = 0; ; index++) {
+		end = strstr(start, separator);
+		if (!end)
+			end = start + strlen(start);
+
+		if (end > start) {
+			if (index == 0) {
+				first = start;
+				first_end = end;
+			}
+			else {
+				if (NIL_P(array)) {
+					array = rb_ary_new();
+					if (first)
+						rb_ary_push(array,
+							    magic_strip_result(first,
+									       first_end,
+									       intern));
+				}
+
+				rb_ary_push(array, magic_strip_result(start, end,
+								      intern));
+			}
+		}
+
+		if (*end == '\0')
+			break;
+
+		start = end + length;
+	}
+
+	if (!NIL_P(array))
+		return array;
+
+	return first ? magic_strip_result(first, first_end, intern) : Qnil;
+}
+
+static magic_database_t *
+magic_default_database(void)
+{
+	magic_database_t *database;
+
+	pthread_mutex_lock(&rb_mgc_default_lock);
+	database = magic_database_ref(rb_mgc_default_database);
+	pthread_mutex_unlock(&rb_mgc_default_lock);
+
+	return database;
+}
+
+/*
+ * Returns the database preloaded with Magic::preload!, preloading the
+ * database from the default paths first when there is none.
+ */
+static magic_database_t *
+magic_shared_database(void)
+{
+	magic_database_t *database;
+	VALUE value = Qundef;
+
+	database = magic_default_database();
+	if (database)
+		return database;
+
+	value = magic_join(magic_default_paths(), CSTR2RVAL(":"));
+	RB_GC_GUARD(value);
+
+	database = magic_database_new(RVAL2CSTR(value));
+	if (!database)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+
+	pthread_mutex_lock(&rb_mgc_default_lock);
+	if (!rb_mgc_default_database)
+		rb_mgc_default_database = magic_database_ref(database);
+	pthread_mutex_unlock(&rb_mgc_default_lock);
+
+	return database;
+}
+
+static VALUE
+magic_type_return(rb_mgc_arguments_t *mga)
+{
+	if (!mga->cookie)
+		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, errno ? errno : EINVAL,
+				    E_MAGIC_LIBRARY_NOT_LOADED);
+
+	if (mga->status < 0 && !mga->result) {
+		if (mga->flags & MAGIC_ERROR)
+			rb_exc_raise(magic_library_error(rb_mgc_eMagicError,
+							 mga->cookie));
+
+		mga->result = magic_error_wrapper(mga->cookie);
+	}
+
+	if (mga->status < 0 && !mga->result)
+		rb_exc_raise(magic_library_error(rb_mgc_eMagicError,
+						 mga->cookie));
+
+	if (!mga->result)
+		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, EINVAL, E_UNKNOWN);
+
+	return magic_return(mga);
+}
+
+static void
+magic_after_fork(void)
+{
+	MAGIC_ATOMIC_INC(rb_mgc_generation);
+
+	magic_worker_after_fork();
+	magic_output_after_fork();
+	magic_database_after_fork();
+
+	pthread_mutex_init(&rb_mgc_default_lock, NULL);
+	pthread_mutex_init(&rb_mgc_intern.lock, NULL);
+}
+
+static void
+magic_fork_check(VALUE object, rb_mgc_object_t *mgc)
+{
+	int flags;
+	unsigned long generation = rb_mgc_fork_generation();
+
+	if (mgc->generation == generation)
+		return;
+	/*
+	 * The process was forked since the object was last used, and the lock
+	 * might have been held by a thread that does not exist in the child
+	 * process, thus it cannot be relied upon.
+	 */
+	pthread_mutex_init(&mgc->lock, NULL);
+	pthread_cond_init(&mgc->cond, NULL);
+	mgc->locked = 0;
+	mgc->owner = Qnil;
+	mgc->generation = generation;
+
+	if (!mgc->cookie || !mgc->database_loaded)
+		return;
+
+	flags = magic_get_flags(object);
+	if (magic_buffer_wrapper(mgc->cookie, "", 0, flags))
+		return;
+
+	if (!mgc->database ||
+	    magic_database_load(mgc->database, mgc->cookie, flags) < 0)
+		mgc->database_loaded = 0;
+}
+
+static VALUE
+magic_default_paths(void)
+{
+	const char *cstring = NULL;
+	VALUE value = Qundef;
+
+	value = rb_funcall(rb_cMagic, rb_intern("default_paths"), 0);
+	if (getenv("MAGIC") || NIL_P(value)) {
+		cstring = magic_getpath_wrapper();
+		value = magic_split(CSTR2RVAL(cstring), CSTR2RVAL(":"));
+		RB_GC_GUARD(value);
+	}
+
+	return value;
+}
+
+static inline int
+magic_get_flags(VALUE object)
+{
+	return NUM2INT(rb_ivar_get(object, id_at_flags));
+}
+
+static inline void
+magic_set_flags(VALUE object, int flags)
+{
+	rb_ivar_set(object, id_at_flags, INT2NUM(flags));
+}
+
+/*
+ * Returns the flags given for a single call, or the flags of the object when
+ * none were given.
+ */
+static int
+magic_call_flags(VALUE object, VALUE value)
+{
+	int flags;
+
+	if (value == Qundef || NIL_P(value))
+		return magic_get_flags(object);
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+
+	flags = NUM2INT(value);
+	if (flags < 0 || flags > 0xfffffff)
+		MAGIC_GENERIC_ERROR(rb_mgc_eFlagsError, EINVAL,
+				    E_FLAG_INVALID_TYPE);
+
+	return flags;
+}
+
+static inline VALUE
+magic_set_paths(VALUE object, VALUE value)
+{
+	return rb_ivar_set(object, id_at_paths, value);
+}
+
+static VALUE
+magic_pool_allocate(VALUE klass)
+{
+	rb_mgc_pool_t *mgp;
+
+	mgp = RB_ALLOC(rb_mgc_pool_t);
+
+	assert(mgp != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_t' type");
+
+	mgp->members = Qnil;
+	mgp->size = 0;
+	mgp->owners = NULL;
+	mgp->available = NULL;
+	mgp->available_count = 0;
+	mgp->generation = rb_mgc_fork_generation();
+	mgp->timeout = -1.0;
+	mgp->stats = (rb_mgc_pool_stats_t) { 0 };
+
+	pthread_mutex_init(&mgp->lock, NULL);
+	pthread_cond_init(&mgp->cond, NULL);
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_pool_type, mgp);
+}
+
+static inline void
+magic_pool_mark(void *data)
+{
+	rb_mgc_pool_t *mgp = data;
+
+	assert(mgp != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_t' type");
+
+	MAGIC_GC_MARK(mgp->members);
+
+	for (size_t i = 0; mgp->owners && i < mgp->size; i++)
+		rb_gc_mark(mgp->owners[i]);
+}
+
+static inline void
+magic_pool_free(void *data)
+{
+	rb_mgc_pool_t *mgp = data;
+
+	assert(mgp != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_t' type");
+
+	pthread_cond_destroy(&mgp->cond);
+	pthread_mutex_destroy(&mgp->lock);
+
+	if (mgp->available)
+		ruby_xfree(mgp->available);
+
+	if (mgp->owners)
+		ruby_xfree(mgp->owners);
+
+	mgp->available = NULL;
+	mgp->owners = NULL;
+	mgp->members = Qnil;
+
+	ruby_xfree(mgp);
+}
+
+static inline size_t
+magic_pool_size(const void *data)
+{
+	const rb_mgc_pool_t *mgp = data;
+
+	assert(mgp != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_t' type");
+
+	return sizeof(*mgp) + mgp->size * (sizeof(size_t) + sizeof(VALUE));
+}
+
+#if defined(HAVE_RUBY_GC_COMPACT)
+static inline void
+magic_pool_compact(void *data)
+{
+	rb_mgc_pool_t *mgp = data;
+
+	assert(mgp != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_t' type");
+
+	mgp->members = rb_gc_location(mgp->members);
+}
+#endif /* HAVE_RUBY_GC_COMPACT */
+
+static VALUE
+magic_stream_allocate(VALUE klass)
+{
+	rb_mgc_stream_t *mgs;
+
+	mgs = RB_ALLOC(rb_mgc_stream_t);
+
+	assert(mgs != NULL &&
+	       "Must be a valid pointer to `rb_mgc_stream_t' type");
+
+	*mgs = (rb_mgc_stream_t) {
+		.magic = Qnil,
+		.result = Qnil,
+	};
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_stream_type, mgs);
+}
+
+static inline void
+magic_stream_mark(void *data)
+{
+	rb_mgc_stream_t *mgs = data;
+
+	assert(mgs != NULL &&
+	       "Must be a valid pointer to `rb_mgc_stream_t' type");
+
+	MAGIC_GC_MARK(mgs->magic);
+	MAGIC_GC_MARK(mgs->result);
+}
+
+static inline void
+magic_stream_free(void *data)
+{
+	rb_mgc_stream_t *mgs = data;
+
+	assert(mgs != NULL &&
+	       "Must be a valid pointer to `rb_mgc_stream_t' type");
+
+	if (mgs->buffer)
+		ruby_xfree(mgs->buffer);
+
+	mgs->buffer = NULL;
+
+	ruby_xfree(mgs);
+}
+
+static inline size_t
+magic_stream_size(const void *data)
+{
+	const rb_mgc_stream_t *mgs = data;
+
+	assert(mgs != NULL &&
+	       "Must be a valid pointer to `rb_mgc_stream_t' type");
+
+	return sizeof(*mgs) + mgs->size;
+}
+
+#if defined(HAVE_RUBY_GC_COMPACT)
+static inline void
+magic_stream_compact(void *data)
+{
+	rb_mgc_stream_t *mgs = data;
+
+	assert(mgs != NULL &&
+	       "Must be a valid pointer to `rb_mgc_stream_t' type");
+
+	mgs->magic = rb_gc_location(mgs->magic);
+	mgs->result = rb_gc_location(mgs->result);
+}
+#endif /* HAVE_RUBY_GC_COMPACT */
+
+static VALUE
+magic_report_allocate(VALUE klass)
+{
+	rb_mgc_report_t *mgr;
+
+	mgr = RB_ZALLOC(rb_mgc_report_t);
+
+	assert(mgr != NULL &&
+	       "Must be a valid pointer to `rb_mgc_report_t' type");
+
+	for (size_t i = 0; i < MAGIC_REPORT_FIELDS; i++)
+		mgr->fields[i] = Qundef;
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_report_type, mgr);
+}
+
+static inline void
+magic_report_mark(void *data)
+{
+	rb_mgc_report_t *mgr = data;
+
+	assert(mgr != NULL &&
+	       "Must be a valid pointer to `rb_mgc_report_t' type");
+
+	for (size_t i = 0; i < MAGIC_REPORT_FIELDS; i++) {
+		if (mgr->fields[i] != Qundef)
+			MAGIC_GC_MARK(mgr->fields[i]);
+	}
+}
+
+static inline void
+magic_report_free(void *data)
+{
+	rb_mgc_report_t *mgr = data;
+
+	assert(mgr != NULL &&
+	       "Must be a valid pointer to `rb_mgc_report_t' type");
+
+	for (size_t i = 0; i < MAGIC_REPORT_VIEWS; i++)
+		free(mgr->values[i]);
+
+	ruby_xfree(mgr);
+}
+
+static inline size_t
+magic_report_size(const void *data)
+{
+	const rb_mgc_report_t *mgr = data;
+	size_t size;
+
+	assert(mgr != NULL &&
+	       "Must be a valid pointer to `rb_mgc_report_t' type");
+
+	size = sizeof(*mgr);
+	for (size_t i = 0; i < MAGIC_REPORT_VIEWS; i++) {
+		if (mgr->values[i])
+			size += strlen(mgr->values[i]) + 1;
+	}
+
+	return size;
+}
+
+#if defined(HAVE_RUBY_GC_COMPACT)
+static inline void
+magic_report_compact(void *data)
+{
+	rb_mgc_report_t *mgr = data;
+
+	assert(mgr != NULL &&
+	       "Must be a valid pointer to `rb_mgc_report_t' type");
+
+	for (size_t i = 0; i < MAGIC_REPORT_FIELDS; i++) {
+		if (mgr->fields[i] != Qundef)
+			mgr->fields[i] = rb_gc_location(mgr->fields[i]);
+	}
+}
+#endif /* HAVE_RUBY_GC_COMPACT */
+
+static inline double
+magic_pool_timeout(rb_mgc_pool_t *mgp, VALUE value)
+{
+	double timeout;
+
+	UNUSED(mgp);
+
+	if (value == Qundef || NIL_P(value))
+		return -1.0;
+
+	timeout = NUM2DBL(value);
+	if (timeout < 0)
+		rb_raise(rb_eArgError, "timeout must not be negative");
+
+	return timeout;
+}
+
+static long
+magic_pool_checkout(rb_mgc_pool_t *mgp, double timeout)
+{
+	long index = -1;
+	rb_mgc_pool_checkout_t mpc;
+
+	if (!mgp->available)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, EFAULT,
+				    E_MAGIC_LIBRARY_CLOSED);
+
+	magic_pool_fork_check(mgp);
+
+	pthread_mutex_lock(&mgp->lock);
+	if (mgp->available_count > 0) {
+		index = (long)mgp->available[--mgp->available_count];
+		mgp->stats.checkouts++;
+	}
+	pthread_mutex_unlock(&mgp->lock);
+
+	if (index >= 0) {
+		mgp->owners[index] = rb_thread_current();
+		return index;
+	}
+
+	mpc = (rb_mgc_pool_checkout_t) {
+		.pool = mgp,
+		.index = -1,
+	};
+
+	if (timeout >= 0) {
+		magic_clock_deadline(&mpc.deadline, timeout);
+		mpc.has_deadline = 1;
+	}
+
+	for (;;) {
+		mpc.interrupted = 0;
+
+		NOGVL_WAIT(nogvl_magic_pool_wait, &mpc, magic_pool_unblock, &mpc);
+		if (mpc.index >= 0) {
+			mgp->owners[mpc.index] = rb_thread_current();
+			return mpc.index;
+		}
+
+		if (mpc.timed_out)
+			MAGIC_GENERIC_ERROR(rb_mgc_eTimeoutError, ETIMEDOUT,
+					    E_POOL_TIMEOUT);
+
+		rb_thread_check_ints();
+	}
+}
+
+static VALUE
+magic_pool_checkin(VALUE data)
+{
+	rb_mgc_pool_checkout_t *mpc = (rb_mgc_pool_checkout_t *)data;
+	rb_mgc_pool_t *mgp = mpc->pool;
+
+	magic_pool_fork_check(mgp);
+
+	mgp->owners[mpc->index] = Qnil;
+
+	pthread_mutex_lock(&mgp->lock);
+	mgp->available[mgp->available_count++] = (size_t)mpc->index;
+	pthread_cond_signal(&mgp->cond);
+	pthread_mutex_unlock(&mgp->lock);
+
+	return Qnil;
+}
+
+static VALUE
+magic_pool_call(VALUE object, ID method, int argc, const VALUE *argv)
+{
+	rb_mgc_pool_t *mgp;
+	rb_mgc_pool_call_t call;
+	rb_mgc_pool_checkout_t mpc;
+
+	MAGIC_POOL(object, mgp);
+
+	mpc = (rb_mgc_pool_checkout_t) {
+		.pool = mgp,
+		.index = magic_pool_checkout(mgp, mgp->timeout),
+	};
+
+	call = (rb_mgc_pool_call_t) {
+		.member = RARRAY_AREF(mgp->members, mpc.index),
+		.method = method,
+		.argc = argc,
+		.argv = argv,
+#if defined(RB_PASS_CALLED_KEYWORDS)
+		.kw_splat = rb_keyword_given_p(),
+#endif /* RB_PASS_CALLED_KEYWORDS */
+	};
+
+	return rb_ensure(magic_pool_call_internal, (VALUE)&call,
+			 magic_pool_checkin, (VALUE)&mpc);
+}
+
+static VALUE
+magic_pool_call_internal(VALUE data)
+{
+	rb_mgc_pool_call_t *call = (rb_mgc_pool_call_t *)data;
+
+#if defined(RB_PASS_CALLED_KEYWORDS)
+	return rb_funcallv_kw(call->member, call->method, call->argc,
+			      call->argv, call->kw_splat);
+#else
+	return rb_funcallv(call->member, call->method, call->argc, call->argv);
+#endif /* RB_PASS_CALLED_KEYWORDS */
+}
+
+static void
+magic_pool_fork_check(rb_mgc_pool_t *mgp)
+{
+	unsigned long generation = rb_mgc_fork_generation();
+
+	if (mgp->generation == generation)
+		return;
+	/*
+	 * Only the thread that called fork exists in the child process, thus
+	 * objects checked out by any other thread will never be checked in,
+	 * and the lock and the condition variable might be in use.
+	 */
+	pthread_mutex_init(&mgp->lock, NULL);
+	pthread_cond_init(&mgp->cond, NULL);
+
+	mgp->available_count = 0;
+	for (size_t i = mgp->size; i > 0; i--) {
+		if (mgp->owners[i - 1] == rb_thread_current())
+			continue;
+
+		mgp->owners[i - 1] = Qnil;
+		mgp->available[mgp->available_count++] = i - 1;
+	}
+
+	mgp->stats.waiting = 0;
+	mgp->generation = generation;
+}
+
+static size_t
+magic_batch_threads(VALUE value, size_t count)
+{
+	long threads;
+
+	threads = (long)magic_cpu_count();
+	if (value != Qundef && !NIL_P(value)) {
+		MAGIC_CHECK_INTEGER_TYPE(value);
+		threads = NUM2LONG(value);
+	}
+
+	if (threads <= 0)
+		rb_raise(rb_eArgError, "%s",
+			 MAGIC_ERRORS(E_WORKER_INVALID_THREADS));
+
+	if ((size_t)threads > count)
+		threads = count > 0 ? (long)count : 1;
+
+	return (size_t)threads;
+}
+
+/*
+ * Splits the files between the threads evenly, while keeping the number of
+ * files that a thread reads ahead at once within the limit.
+ */
+static size_t
+magic_batch_chunk(size_t count, size_t threads)
+{
+	size_t depth = magic_prefetch_depth(threads);
+	size_t chunk = (count + threads - 1) / threads;
+
+	if (chunk > depth)
+		chunk = depth;
+
+	return chunk > 0 ? chunk : 1;
+}
+
+static void
+magic_batch_init(rb_mgc_batch_t *batch, magic_worker_function_t function,
+		 size_t threads)
+{
+	size_t count;
+	int local_errno = ENOMEM;
+
+	batch->count = (size_t)RARRAY_LEN(batch->slices ? batch->inputs
+						      : batch->values);
+	/*
+	 * Each item of the job is a chunk of consecutive inputs, when the
+	 * inputs are chunked, or otherwise a single input.
+	 */
+	count = batch->count;
+	if (batch->chunk > 0)
+		count = (batch->count + batch->chunk - 1) / batch->chunk;
+
+	if (threads > count)
+		threads = count > 0 ? count : 1;
+
+	if (batch->flags & MAGIC_CONTINUE)
+		batch->flags |= MAGIC_RAW;
+
+	magic_lock(batch->object, magic_batch_internal, batch);
+
+	batch->pointers = calloc(batch->count + 1, sizeof(char *));
+	batch->sizes = calloc(batch->count + 1, sizeof(size_t));
+	batch->bytes = calloc(batch->count + 1, sizeof(rb_mgc_bytes_t));
+	batch->results = calloc(batch->count + 1, sizeof(rb_mgc_result_t));
+	if (!batch->pointers || !batch->sizes || !batch->bytes ||
+	    !batch->results)
+		goto error;
+
+	if (magic_worker_job_init(&batch->job, function, batch,
+				  count, threads) < 0)
+		goto error;
+
+	/*
+	 * The worker threads read the strings without holding the GVL, thus the
+	 * strings must stay where they are, even if the garbage collector would
+	 * compact the heap in the meantime, see magic_batch_mark().
+	 */
+	batch->pin = TypedData_Wrap_Struct(0, &rb_mgc_batch_type, batch);
+
+	return;
+error:
+	free(batch->pointers);
+	free(batch->sizes);
+	free(batch->bytes);
+	free(batch->results);
+	magic_database_unref(batch->database);
+	MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, local_errno,
+			    E_NOT_ENOUGH_MEMORY);
+}
+
+static VALUE
+magic_batch_run(VALUE data)
+{
+	size_t yielded = 0;
+	rb_mgc_batch_t *batch = (rb_mgc_batch_t *)data;
+	rb_mgc_bytes_t *bytes;
+	VALUE array;
+	/*
+	 * Anything other than a frozen string, such as an IO::Buffer, is locked
+	 * for as long as the worker threads might read from it, and unlocked by
+	 * magic_batch_cleanup(), see magic_bytes_lock().
+	 */
+	if (batch->slices)
+		magic_batch_slices(batch);
+	else {
+		for (; batch->locked < batch->count; batch->locked++) {
+			bytes = &batch->bytes[batch->locked];
+
+			magic_bytes_lock(RARRAY_AREF(batch->values,
+						     (long)batch->locked),
+					 bytes);
+			rb_ary_store(batch->values, (long)batch->locked,
+				     bytes->object);
+
+			batch->pointers[batch->locked] = bytes->pointer;
+			batch->sizes[batch->locked] = bytes->size;
+		}
+	}
+
+	if (batch->job.count > 0 &&
+	    magic_worker_submit(&batch->job) < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+				    E_WORKER_START);
+
+	while (batch->finished < batch->job.count) {
+		magic_worker_rearm(&batch->job);
+
+		NOGVL_WAIT(nogvl_magic_batch_wait, batch,
+			   magic_batch_unblock, batch);
+
+		for (; rb_block_given_p() && yielded < batch->finished; yielded++)
+			magic_batch_yield(batch, batch->job.completed[yielded]);
+
+		rb_thread_check_ints();
+	}
+
+	if (rb_block_given_p())
+		return batch->object;
+
+	array = rb_ary_new_capa((long)batch->count);
+	for (size_t i = 0; i < batch->count; i++)
+		rb_ary_push(array, magic_batch_result(batch, i));
+
+	return array;
+}
+
+static VALUE
+magic_batch_cleanup(VALUE data)
+{
+	rb_mgc_batch_t *batch = (rb_mgc_batch_t *)data;
+
+	magic_worker_cancel(&batch->job);
+
+	if (!magic_worker_done(&batch->job)) {
+		NOGVL_WAIT(nogvl_magic_batch_drain, batch, NULL, NULL);
+		magic_worker_drain(&batch->job);
+	}
+
+	DATA_PTR(batch->pin) = NULL;
+
+	magic_worker_job_destroy(&batch->job);
+	magic_database_unref(batch->database);
+
+	for (size_t i = 0; i < batch->locked; i++)
+		magic_bytes_unlock(&batch->bytes[i]);
+
+	for (size_t i = 0; i < batch->count; i++)
+		free(batch->results[i].value);
+
+	free(batch->results);
+	free(batch->bytes);
+	free(batch->sizes);
+	free(batch->pointers);
+
+	RB_GC_GUARD(batch->pin);
+	RB_GC_GUARD(batch->inputs);
+	RB_GC_GUARD(batch->values);
+
+	return Qnil;
+}
+
+/*
+ * Locks the single string that the slices are taken from, and points each of
+ * the inputs at its own slice of it, see magic_bytes_slice().
+ */
+static void
+magic_batch_slices(rb_mgc_batch_t *batch)
+{
+	VALUE slice;
+	struct buffer buffer;
+	rb_mgc_bytes_t *bytes = &batch->bytes[0];
+
+	magic_bytes_lock(RARRAY_AREF(batch->values, 0), bytes);
+	rb_ary_store(batch->values, 0, bytes->object);
+	batch->locked = 1;
+
+	for (size_t i = 0; i < batch->count; i++) {
+		slice = rb_check_array_type(RARRAY_AREF(batch->inputs, (long)i));
+		if (NIL_P(slice) || RARRAY_LEN(slice) != 2)
+			MAGIC_ARGUMENT_TYPE_ERROR(RARRAY_AREF(batch->inputs, (long)i),
+						  "Array of offset and length");
+
+		magic_bytes_range(RARRAY_AREF(slice, 0), RARRAY_AREF(slice, 1),
+				  &buffer);
+
+		if (magic_bytes_slice(bytes, &buffer) < 0)
+			rb_raise(rb_eArgError, MAGIC_ERRORS(E_OFFSET_OUT_OF_RANGE),
+				 buffer.offset);
+
+		batch->pointers[i] = buffer.pointer;
+		batch->sizes[i] = buffer.size;
+	}
+}
+
+static void
+magic_batch_yield(rb_mgc_batch_t *batch, size_t index)
+{
+	size_t first = index, last = index + 1;
+
+	if (batch->chunk > 0) {
+		first = index * batch->chunk;
+		last = first + batch->chunk;
+		if (last > batch->count)
+			last = batch->count;
+	}
+
+	for (size_t i = first; i < last; i++)
+		rb_yield_values(2, RARRAY_AREF(batch->inputs, (long)i),
+				magic_batch_result(batch, i));
+}
+
+static VALUE
+magic_batch_result(rb_mgc_batch_t *batch, size_t index)
+{
+	return magic_result(&batch->results[index], batch->flags,
+			    batch->stop_on_errors, batch->intern);
+}
 
-	return (VALUE)NULL;
+static void
+magic_result_check(rb_mgc_result_t *result, int stop_on_errors)
+{
+	if (result->status < 0 && !result->value)
+		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, result->magic_errno,
+				    E_UNKNOWN);
+
+	if (result->status < 0 && stop_on_errors)
+		rb_exc_raise(magic_generic_error(rb_mgc_eMagicError,
+						 result->magic_errno,
+						 result->value));
 }
 
-static inline VALUE
-magic_set_parameter_internal(void *data)
+static VALUE
+magic_result(rb_mgc_result_t *result, int flags, int stop_on_errors,
+	     int intern)
 {
-	size_t value;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	rb_mgc_arguments_t mga;
 
-	value = mga->parameter.value;
+	magic_result_check(result, stop_on_errors);
 
-	mga->status = magic_setparam_wrapper(cookie,
-					     mga->parameter.tag,
-					     &value);
+	mga = (rb_mgc_arguments_t) {
+		.result = result->value,
+		.status = result->status,
+		.flags  = flags,
+		.intern = intern != 0,
+	};
 
-	return (VALUE)NULL;
+	return magic_return(&mga);
 }
 
-static inline VALUE
-magic_get_flags_internal(void *data)
+/*
+ * Picks the views to identify with, in the given order, skipping those that
+ * are given more than once.
+ */
+static void
+magic_identify_views(VALUE value, rb_mgc_identify_t *identify)
 {
-	int flags;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	static const char * const defaults[] = {
+		"mime_type", "encoding", "description", "extensions",
+	};
+	const rb_mgc_view_t *view;
+	const char *name;
+	long count;
+	VALUE entry;
+
+	if (value == Qundef || NIL_P(value)) {
+		value = rb_ary_new_capa(ARRAY_SIZE(defaults));
+		for (size_t i = 0; i < ARRAY_SIZE(defaults); i++)
+			rb_ary_push(value, ID2SYM(rb_intern(defaults[i])));
+	}
 
-	mga->status = 0;
+	value = rb_Array(value);
+	count = RARRAY_LEN(value);
 
-	flags = magic_getflags_wrapper(cookie);
-	if (flags < 0)
-		mga->status = -1;
-	else
-		mga->flags = flags;
+	if (count == 0)
+		rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_VIEW_INVALID_TYPE));
 
-	return (VALUE)NULL;
-}
+	for (long i = 0; i < count; i++) {
+		entry = RARRAY_AREF(value, i);
+		if (!SYMBOL_P(entry))
+			MAGIC_ARGUMENT_TYPE_ERROR(entry, "Symbol");
 
-static inline VALUE
-magic_set_flags_internal(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+		name = rb_id2name(SYM2ID(entry));
+		view = NULL;
 
-	mga->status = magic_setflags_wrapper(cookie, mga->flags);
+		for (size_t j = 0; j < ARRAY_SIZE(ruby_magic_views); j++) {
+			if (strcmp(ruby_magic_views[j].name, name) == 0)
+				view = &ruby_magic_views[j];
+		}
 
-	return (VALUE)NULL;
+		if (!view)
+			rb_raise(rb_eArgError, "%s: %s",
+				 MAGIC_ERRORS(E_VIEW_INVALID_TYPE), name);
+
+		for (size_t j = 0; j < identify->count && view; j++) {
+			if (identify->views[j] == view)
+				view = NULL;
+		}
+
+		if (view)
+			identify->views[identify->count++] = view;
+	}
+
+	RB_GC_GUARD(value);
 }
 
-static inline VALUE
-magic_close_internal(void *data)
+/*
+ * Sets what is identified from the given object, that is, either the file
+ * at the given path, or content in memory, which is where the content of an
+ * IO is read to. Returns -1 when the object is of neither kind.
+ */
+static int
+magic_identify_input(VALUE object, VALUE value, rb_mgc_identify_t *identify)
 {
-	magic_library_close(data);
+	if (!STRING_P(value) && magic_bytes_p(value))
+		identify->value = value;
+	else if (!STRING_P(value) &&
+		 (rb_respond_to(value, rb_intern("to_io")) ||
+		  (!rb_respond_to(value, rb_intern("to_path")) &&
+		   rb_respond_to(value, rb_intern("read")))))
+		identify->value = magic_io_peek(value, magic_io_length(object));
+	else {
+		value = magic_path(value);
+		if (NIL_P(value))
+			return -1;
+
+		identify->value = value;
+		identify->path = RVAL2CSTR(value);
+
+		if (identify->magic_object->stop_on_errors)
+			identify->flags |= MAGIC_ERROR;
+
+		identify->stop_on_errors = (identify->flags & MAGIC_ERROR) != 0;
+	}
 
-	return Qnil;
+	return 0;
 }
 
-static inline VALUE
-magic_load_internal(void *data)
+static VALUE
+magic_identify_return(VALUE data)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	rb_mgc_identify_t *identify = (rb_mgc_identify_t *)data;
+	const rb_mgc_view_t *view;
+	VALUE hash = rb_hash_new();
+	VALUE value;
+	int identified = 0;
 
-	NOGVL(nogvl_magic_load, mga);
+	for (size_t i = 0; i < identify->count; i++)
+		identified |= identify->results[i].status == 0;
 
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	for (size_t i = 0; i < identify->count; i++) {
+		view = identify->views[i];
+		/*
+		 * The Magic library fails to find the extensions for directories
+		 * and other special files, which the other views identify just
+		 * fine, thus there are no extensions to return then.
+		 */
+		if (identified && (view->flags & MAGIC_EXTENSION) &&
+		    identify->results[i].status < 0)
+			value = magic_result_string("", 0, identify->intern);
+		else
+			value = magic_result(&identify->results[i],
+					     identify->flags | view->flags,
+					     identify->stop_on_errors,
+					     identify->intern);
+
+		rb_hash_aset(hash, ID2SYM(rb_intern(view->name)), value);
+	}
 
-	return (VALUE)NULL;
+	RB_GC_GUARD(identify->value);
+
+	return rb_obj_freeze(hash);
 }
 
-static inline VALUE
-magic_load_buffers_internal(void *data)
+/*
+ * Hands the output of the Magic library over to a new Magic::Result, which
+ * then owns it, as nothing is taken from it until a field is asked for.
+ */
+static VALUE
+magic_report_return(VALUE data)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	rb_mgc_identify_t *identify = (rb_mgc_identify_t *)data;
+	rb_mgc_result_t *result;
+	rb_mgc_report_t *mgr;
+	VALUE object;
 
-	mga->status = magic_load_buffers_wrapper(cookie,
-						 mga->buffers.pointers,
-						 mga->buffers.sizes,
-						 mga->buffers.count,
-						 mga->flags);
+	for (size_t i = 0; i < identify->count; i++) {
+		/*
+		 * There are no extensions for directories and other special
+		 * files, see magic_identify_return().
+		 */
+		if (i == MAGIC_REPORT_EXTENSIONS)
+			continue;
 
-	return (VALUE)NULL;
-}
+		magic_result_check(&identify->results[i],
+				   identify->stop_on_errors);
+	}
 
-static inline VALUE
-magic_compile_internal(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	object = magic_report_allocate(rb_cMagicResult);
+	MAGIC_REPORT(object, mgr);
 
-	NOGVL(nogvl_magic_compile, mga);
+	mgr->intern = identify->intern;
 
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	for (size_t i = 0; i < identify->count; i++) {
+		result = &identify->results[i];
+		if (i == MAGIC_REPORT_EXTENSIONS && result->status < 0)
+			continue;
 
-	return (VALUE)NULL;
+		mgr->values[i] = result->value;
+		result->value = NULL;
+	}
+
+	RB_GC_GUARD(identify->value);
+
+	return rb_obj_freeze(object);
 }
 
-static inline VALUE
-magic_check_internal(void *data)
+static VALUE
+magic_report_field(VALUE object, enum magic_report_field field)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	rb_mgc_report_t *mgr;
 
-	NOGVL(nogvl_magic_check, mga);
+	MAGIC_REPORT(object, mgr);
 
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	if (mgr->fields[field] == Qundef)
+		mgr->fields[field] = magic_report_parse(mgr, field);
 
-	return (VALUE)NULL;
+	return mgr->fields[field];
 }
 
 static VALUE
-magic_file_internal(void *data)
+magic_report_parse(rb_mgc_report_t *mgr, enum magic_report_field field)
 {
-	int local_errno;
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	rb_mgc_object_t *mgc = mga->magic_object;
-	magic_t cookie = mgc->cookie;
-	int old_flags = mga->flags;
+	const char *value = NULL;
+	const char *end = NULL;
+	const char *charset = "charset=";
+
+	switch (field) {
+	case MAGIC_REPORT_MIME_TYPE:
+		value = mgr->values[MAGIC_REPORT_MIME];
+		if (value)
+			end = strchr(value, ';');
+		break;
+	case MAGIC_REPORT_CHARSET:
+		value = mgr->values[MAGIC_REPORT_MIME];
+		if (!value || !(value = strstr(value, charset)))
+			return Qnil;
+
+		value += strlen(charset);
+		end = strchr(value, ';');
+		break;
+	case MAGIC_REPORT_DESCRIPTION_FIELD:
+		value = mgr->values[MAGIC_REPORT_DESCRIPTION];
+		break;
+	case MAGIC_REPORT_EXTENSIONS_FIELD:
+		value = mgr->values[MAGIC_REPORT_EXTENSIONS];
+		if (value && strncmp(value, "???", 3) == 0)
+			value = NULL;
+
+		return magic_report_array(value, MAGIC_EXTENSION_SEPARATOR,
+					  mgr->intern);
+	case MAGIC_REPORT_ALL_MATCHES:
+		return magic_report_array(mgr->values[MAGIC_REPORT_MATCHES],
+					  MAGIC_CONTINUE_SEPARATOR,
+					  mgr->intern);
+	default:
+		return Qnil;
+	}
 
-	if (mgc->stop_on_errors)
-		mga->flags |= MAGIC_ERROR;
+	if (!value)
+		return Qnil;
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	if (!end)
+		end = value + strlen(value);
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+	return magic_report_string(value, end, mgr->intern);
+}
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+static inline VALUE
+magic_report_string(const char *start, const char *end, int intern)
+{
+	return rb_obj_freeze(magic_strip_result(start, end, intern));
+}
 
-	NOGVL(nogvl_magic_file, mga);
-	local_errno = errno;
-	/*
-	 * The Magic library often does not correctly report errors,
-	 * especially when certain flags (such as e.g., MAGIC_EXTENSION,
-	 * etc.) are set. Attempt to obtain an error code first from the
-	 * Magic library itself, and if that does not work, then from
-	 * the saved errno value.
-	 */
-	if (magic_errno_wrapper(cookie) || local_errno)
-		mga->status = -1;
+static VALUE
+magic_report_array(const char *value, const char *separator, int intern)
+{
+	VALUE array, result = Qnil;
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+	if (value)
+		result = magic_split_result(value, separator, intern);
 
-	return (VALUE)NULL;
+	if (NIL_P(result))
+		array = rb_ary_new();
+	else if (STRING_P(result))
+		array = rb_ary_new_from_args(1, result);
+	else
+		array = result;
+
+	for (long i = 0; i < RARRAY_LEN(array); i++)
+		rb_obj_freeze(RARRAY_AREF(array, i));
+
+	return rb_obj_freeze(array);
 }
 
 static VALUE
-magic_buffer_internal(void *data)
+magic_identify_cleanup(VALUE data)
 {
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	rb_mgc_identify_t *identify = (rb_mgc_identify_t *)data;
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	for (size_t i = 0; i < identify->count; i++)
+		free(identify->results[i].value);
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+	return Qnil;
+}
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+static void
+magic_batch_unblock(void *data)
+{
+	rb_mgc_batch_t *batch = data;
 
-	mga->result = magic_buffer_wrapper(cookie,
-					   (const void *)mga->buffers.pointers,
-					   (size_t)mga->buffers.sizes,
-					   mga->flags);
+	magic_worker_interrupt(&batch->job);
+}
 
-	mga->status = !mga->result ? -1 : 0;
+/*
+ * Runs on a thread from the pool of native threads, thus must never touch
+ * the Ruby VM. Each thread uses its own Magic cookie, see magic_cache_get().
+ */
+static void
+magic_batch_file(void *data, size_t index)
+{
+	magic_t cookie;
+	const char *cstring;
+	rb_mgc_batch_t *batch = data;
+	rb_mgc_result_t *result = &batch->results[index];
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+	cookie = magic_cache_get(batch->database, batch->flags, &batch->params);
+	if (!cookie) {
+		result->status = -1;
+		result->magic_errno = errno ? errno : ENOMEM;
+		return;
+	}
 
-	return (VALUE)NULL;
+	cstring = magic_file_wrapper(cookie, batch->pointers[index], batch->flags);
+	if (!cstring) {
+		result->status = -1;
+		result->magic_errno = magic_errno_wrapper(cookie);
+		cstring = magic_error_wrapper(cookie);
+	}
+
+	if (cstring)
+		result->value = strdup(cstring);
 }
 
-static VALUE
-magic_descriptor_internal(void *data)
+/*
+ * Identifies a chunk of consecutive files, which are read ahead together
+ * first, see magic_prefetch().
+ */
+static void
+magic_batch_prefetch(void *data, size_t index)
 {
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	magic_t cookie;
+	const char *cstring;
+	rb_mgc_batch_t *batch = data;
+	rb_mgc_result_t *result;
+	magic_prefetch_entry_t entries[MAGIC_PREFETCH_DEPTH];
+	size_t first = index * batch->chunk;
+	size_t count = batch->count - first;
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	if (count > batch->chunk)
+		count = batch->chunk;
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+	cookie = magic_cache_get(batch->database, batch->flags, &batch->params);
+	if (!cookie) {
+		for (size_t i = 0; i < count; i++) {
+			result = &batch->results[first + i];
+			result->status = -1;
+			result->magic_errno = errno ? errno : ENOMEM;
+		}
+		return;
+	}
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+	for (size_t i = 0; i < count; i++)
+		entries[i].path = batch->pointers[first + i];
 
-	NOGVL(nogvl_magic_descriptor, mga);
+	magic_prefetch(entries, count, &batch->params, batch->flags);
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+	for (size_t i = 0; i < count; i++) {
+		result = &batch->results[first + i];
+
+		cstring = magic_prefetch_identify(cookie, &entries[i],
+						  batch->flags);
+		if (!cstring) {
+			result->status = -1;
+			result->magic_errno = magic_errno_wrapper(cookie);
+			cstring = magic_error_wrapper(cookie);
+		}
 
-	return (VALUE)NULL;
+		if (cstring)
+			result->value = strdup(cstring);
+	}
+
+	magic_prefetch_release(entries, count);
 }
 
-static inline void*
-magic_library_open(void)
+static void
+magic_batch_buffer(void *data, size_t index)
 {
 	magic_t cookie;
+	const char *cstring;
+	rb_mgc_batch_t *batch = data;
+	rb_mgc_result_t *result = &batch->results[index];
 
-	cookie = magic_open_wrapper(MAGIC_NONE);
+	cookie = magic_cache_get(batch->database, batch->flags, &batch->params);
 	if (!cookie) {
-		errno = ENOMEM;
-		return NULL;
+		result->status = -1;
+		result->magic_errno = errno ? errno : ENOMEM;
+		return;
 	}
 
-	return cookie;
+	cstring = magic_buffer_wrapper(cookie, batch->pointers[index],
+				       batch->sizes[index], batch->flags);
+	if (!cstring) {
+		result->status = -1;
+		result->magic_errno = magic_errno_wrapper(cookie);
+		cstring = magic_error_wrapper(cookie);
+	}
+
+	if (cstring)
+		result->value = strdup(cstring);
 }
 
-static inline void
-magic_library_close(void *data)
+/*
+ * Marking the strings with rb_gc_mark() rather than rb_gc_mark_movable()
+ * pins them, so that the garbage collector never moves them, which would
+ * otherwise invalidate pointers to the content of embedded strings.
+ */
+static void
+magic_batch_mark(void *data)
 {
-	rb_mgc_object_t *mgc = data;
+	rb_mgc_batch_t *batch = data;
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	if (!batch)
+		return;
 
-	if (mgc->cookie)
-		magic_close_wrapper(mgc->cookie);
+	rb_gc_mark(batch->values);
 
-	mgc->cookie = NULL;
+	for (long i = 0; i < RARRAY_LEN(batch->values); i++)
+		rb_gc_mark(RARRAY_AREF(batch->values, i));
 }
 
-static VALUE
-magic_allocate(VALUE klass)
+static void
+magic_intern_mark(void *data)
+{
+	rb_mgc_intern_t *intern = data;
+
+	for (size_t i = 0; i < MAGIC_INTERN_SIZE; i++)
+		MAGIC_GC_MARK(intern->entries[i].string);
+}
+
+#if defined(HAVE_RUBY_GC_COMPACT)
+static void
+magic_intern_compact(void *data)
+{
+	rb_mgc_intern_t *intern = data;
+
+	for (size_t i = 0; i < MAGIC_INTERN_SIZE; i++)
+		intern->entries[i].string = rb_gc_location(intern->entries[i].string);
+}
+#endif /* HAVE_RUBY_GC_COMPACT */
+
+static const rb_data_type_t rb_mgc_type = {
+	.wrap_struct_name = "magic",
+	.function = {
+		.dmark	  = magic_mark,
+		.dfree	  = magic_free,
+		.dsize	  = magic_size,
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static void
+magic_scanner_init(rb_mgc_scanner_t *scanner, VALUE root, VALUE includes,
+		   VALUE excludes, size_t threads, int recursive,
+		   int follow_symlinks, int prefetch)
 {
 	int local_errno;
 	rb_mgc_object_t *mgc;
+	magic_params_t params;
 
-	mgc = RB_ALLOC(rb_mgc_object_t);
-	local_errno = ENOMEM;
+	MAGIC_OBJECT(scanner->object, mgc);
 
-	if (!mgc) {
-		errno = local_errno;
-		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
-				    local_errno,
-				    E_NOT_ENOUGH_MEMORY);
-	}
+	scanner->stop_on_errors = mgc->stop_on_errors;
+	scanner->intern = mgc->intern_results;
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	if (scanner->stop_on_errors)
+		scanner->flags |= MAGIC_ERROR;
 
-	mgc->cookie = NULL;
-	mgc->mutex = Qundef;
-	mgc->database_loaded = 0;
-	mgc->stop_on_errors = 0;
+	if (scanner->flags & MAGIC_ERROR)
+		scanner->stop_on_errors = 1;
 
-	mgc->cookie = magic_library_open();
-	local_errno = errno;
+	if (scanner->flags & MAGIC_CONTINUE)
+		scanner->flags |= MAGIC_RAW;
 
-	if (!mgc->cookie) {
-		ruby_xfree(mgc);
-		mgc = NULL;
-		errno = local_errno;
-		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
-				    local_errno,
-				    E_MAGIC_LIBRARY_INITIALIZE);
+	if (follow_symlinks)
+		scanner->flags |= MAGIC_SYMLINK;
+
+	magic_lock(scanner->object, magic_scan_internal, scanner);
+
+	params = scanner->scan.params;
+	if (magic_scan_init(&scanner->scan, RSTRING_PTR(root),
+			    scanner->scan.database, &params, scanner->flags,
+			    threads) < 0) {
+		local_errno = errno;
+		magic_database_unref(scanner->scan.database);
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, local_errno,
+				    E_NOT_ENOUGH_MEMORY);
 	}
 
-	return TypedData_Wrap_Struct(klass, &rb_mgc_type, mgc);
+	scanner->scan.recursive = recursive ? 1 : 0;
+	scanner->scan.follow_symlinks = follow_symlinks ? 1 : 0;
+	scanner->scan.prefetch = prefetch ? 1 : 0;
+
+	scanner->entries = calloc(MAGIC_SCAN_QUEUE_MAX,
+				  sizeof(magic_scan_entry_t));
+	if (!scanner->entries ||
+	    magic_worker_job_init(&scanner->job, magic_scan_worker,
+				  &scanner->scan, threads, threads) < 0) {
+		free(scanner->entries);
+		magic_scan_destroy(&scanner->scan);
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+	}
+
+	magic_scanner_patterns(scanner, includes, magic_scan_include);
+	magic_scanner_patterns(scanner, excludes, magic_scan_exclude);
 }
 
-static inline void
-magic_mark(void *data)
+static void
+magic_scanner_patterns(rb_mgc_scanner_t *scanner, VALUE patterns,
+		       int (*add)(magic_scan_t *, const char *))
 {
-	rb_mgc_object_t *mgc = data;
-
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
-
-	MAGIC_GC_MARK(mgc->mutex);
+	for (long i = 0; i < RARRAY_LEN(patterns); i++) {
+		if (add(&scanner->scan,
+			RSTRING_PTR(RARRAY_AREF(patterns, i))) == 0)
+			continue;
+
+		free(scanner->entries);
+		magic_worker_job_destroy(&scanner->job);
+		magic_scan_destroy(&scanner->scan);
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+	}
 }
 
-static inline void
-magic_free(void *data)
+static VALUE
+magic_scanner_run(VALUE data)
 {
-	rb_mgc_object_t *mgc = data;
+	rb_mgc_scanner_t *scanner = (rb_mgc_scanner_t *)data;
+	magic_scan_entry_t *entry;
+	rb_mgc_result_t result;
+	VALUE path, value;
+
+	if (magic_worker_submit(&scanner->job) < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+				    E_WORKER_START);
+
+	for (;;) {
+		while (scanner->index < scanner->count) {
+			entry = &scanner->entries[scanner->index];
+
+			result = (rb_mgc_result_t) {
+				.value = entry->value,
+				.magic_errno = entry->magic_errno,
+				.status = entry->status,
+			};
+
+			path = CSTR2RVAL(entry->path);
+			value = magic_result(&result, scanner->flags,
+					     scanner->stop_on_errors,
+					     scanner->intern);
+
+			free(entry->path);
+			free(entry->value);
+			scanner->index++;
+
+			rb_yield_values(2, path, value);
+		}
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+		if (magic_scan_done(&scanner->scan))
+			break;
 
-	if (mgc->cookie)
-		magic_library_close(data);
+		magic_scan_rearm(&scanner->scan);
 
-	mgc->cookie = NULL;
-	mgc->mutex = Qundef;
+		NOGVL_WAIT(nogvl_magic_scan_wait, scanner,
+			   magic_scanner_unblock, scanner);
 
-	ruby_xfree(mgc);
+		rb_thread_check_ints();
+	}
+
+	return scanner->object;
 }
 
-static inline size_t
-magic_size(const void *data)
+static VALUE
+magic_scanner_cleanup(VALUE data)
 {
-	const rb_mgc_object_t *mgc = data;
+	rb_mgc_scanner_t *scanner = (rb_mgc_scanner_t *)data;
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	magic_scan_stop(&scanner->scan);
+	magic_worker_cancel(&scanner->job);
 
-	return sizeof(*mgc);
-}
+	if (!magic_worker_done(&scanner->job)) {
+		NOGVL_WAIT(nogvl_magic_scan_drain, scanner, NULL, NULL);
+		magic_worker_drain(&scanner->job);
+	}
 
-#if defined(HAVE_RUBY_GC_COMPACT)
-static inline void
-magic_compact(void *data)
-{
-	rb_mgc_object_t *mgc = data;
+	for (size_t i = scanner->index; i < scanner->count; i++) {
+		free(scanner->entries[i].path);
+		free(scanner->entries[i].value);
+	}
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	free(scanner->entries);
 
-	mgc->mutex = rb_gc_location(mgc->mutex);
+	magic_worker_job_destroy(&scanner->job);
+	magic_scan_destroy(&scanner->scan);
+
+	return Qnil;
 }
-#endif /* HAVE_RUBY_GC_COMPACT */
 
-static inline VALUE
-magic_exception_wrapper(VALUE value)
+static void
+magic_scanner_unblock(void *data)
 {
-	rb_mgc_error_t *mge = (rb_mgc_error_t *)value;
+	rb_mgc_scanner_t *scanner = data;
 
-	return rb_exc_new2(mge->klass, mge->magic_error);
+	magic_scan_interrupt(&scanner->scan);
 }
 
 static VALUE
-magic_exception(void *data)
+magic_patterns(VALUE value)
 {
-	int exception = 0;
-	rb_mgc_error_t *mge = data;
-	VALUE object = Qundef;
-
-	assert(mge != NULL &&
-	       "Must be a valid pointer to `rb_mgc_error_t' type");
+	VALUE patterns;
 
-	object = rb_protect(magic_exception_wrapper, (VALUE)mge, &exception);
+	if (value == Qundef || NIL_P(value))
+		return rb_ary_new();
 
-	if (exception)
-		rb_jump_tag(exception);
+	patterns = rb_ary_dup(rb_Array(value));
 
-	rb_iv_set(object, "@errno", INT2NUM(mge->magic_errno));
-	RB_GC_GUARD(object);
+	for (long i = 0; i < RARRAY_LEN(patterns); i++) {
+		VALUE pattern = RARRAY_AREF(patterns, i);
+		MAGIC_CHECK_STRING_TYPE(pattern);
+		StringValueCStr(pattern);
+	}
 
-	return object;
+	return patterns;
 }
 
-static inline VALUE
-magic_generic_error(VALUE klass, int magic_errno, const char *magic_error)
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+/*
+ * Returns true when the current fiber is non-blocking and there is a fiber
+ * scheduler, in which case blocking the thread would also block every other
+ * fiber managed by the scheduler.
+ */
+static int
+magic_offload_p(void)
 {
-	rb_mgc_error_t mge;
-
-	mge = (rb_mgc_error_t) {
-		.klass       = klass,
-		.magic_errno = magic_errno,
-		.magic_error = magic_error,
-	};
-
-	return magic_exception(&mge);
+	return !NIL_P(rb_fiber_scheduler_current());
 }
 
+/*
+ * Identifies a file on a thread from the pool of native threads, using a
+ * copy of the Magic object, as Magic#files does, and lets the scheduler run
+ * other fibers in the meantime. The thread writes to a pipe once done, for
+ * which the current fiber waits the same way it would wait for any other
+ * IO, thus it works with every fiber scheduler.
+ *
+ * The state shared with the thread is not kept on the stack of the fiber,
+ * since a fiber can be abandoned while waiting, and its stack freed, while
+ * the thread is still at work. Instead, it is released by whichever of the
+ * two is done with it last, see magic_worker_detach(). Only the IO object
+ * for the pipe is kept on the stack, so that the garbage collector can see
+ * it while the fiber waits.
+ */
 static VALUE
-magic_library_error(VALUE klass, void *data)
+magic_offload(VALUE object, const char *path, int fd, int flags, int mapped,
+	      VALUE into)
 {
-	rb_mgc_error_t mge;
-	const char *message = NULL;
-	const char *empty = "(null)";
-	magic_t cookie = data;
+	int local_errno;
+	rb_mgc_object_t *mgc;
+	rb_mgc_offload_t *offload;
+	VALUE io = Qnil;
+	VALUE value;
 
-	UNUSED(empty);
+	MAGIC_OBJECT(object, mgc);
 
-	assert(cookie != NULL &&
-	       "Must be a valid pointer to `magic_t' type");
+	offload = calloc(1, sizeof(rb_mgc_offload_t));
+	if (!offload)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
 
-	mge = (rb_mgc_error_t) {
-		.klass       = klass,
-		.magic_errno = -1,
-		.magic_error = MAGIC_ERRORS(E_UNKNOWN),
+	*offload = (rb_mgc_offload_t) {
+		.object = object,
+		.fd = fd,
+		.flags = flags,
+		.io = &io,
+		.into = into,
+		.mapped = mapped != 0,
+		.intern = mgc->intern_results,
+		.notify = { -1, -1 },
 	};
 
-	message = magic_error_wrapper(cookie);
-	if (message) {
-		mge.magic_errno = magic_errno_wrapper(cookie);
-		mge.magic_error = message;
+	if (path) {
+		offload->stop_on_errors = mgc->stop_on_errors;
+
+		if (offload->stop_on_errors)
+			offload->flags |= MAGIC_ERROR;
+
+		if (offload->flags & MAGIC_ERROR)
+			offload->stop_on_errors = 1;
+	}
+	else {
+		offload->stop_on_errors = 1;
 	}
 
-	assert(strncmp(mge.magic_error, empty, strlen(empty)) != 0 &&
-		       "Empty or invalid error message");
+	if (offload->flags & MAGIC_CONTINUE)
+		offload->flags |= MAGIC_RAW;
 
-	return magic_exception(&mge);
-}
+	if (path && !(offload->path = strdup(path)))
+		goto error;
 
-VALUE
-magic_lock(VALUE object, VALUE(*function)(ANYARGS), void *data)
-{
-	rb_mgc_object_t *mgc;
+	if (magic_pipe(offload->notify) < 0)
+		goto error;
 
-	MAGIC_OBJECT(object, mgc);
+	if (magic_worker_job_init(&offload->job, magic_offload_function,
+				  offload, 1, 1) < 0)
+		goto error;
 
-	rb_funcall(mgc->mutex, rb_intern("lock"), 0);
+	value = rb_ensure(magic_offload_run, (VALUE)offload,
+			  magic_offload_cleanup, (VALUE)offload);
 
-	return rb_ensure(function, (VALUE)data, magic_unlock, object);
-}
+	RB_GC_GUARD(io);
 
-VALUE
-magic_unlock(VALUE object)
-{
-	rb_mgc_object_t *mgc;
+	return value;
+error:
+	local_errno = errno;
 
-	MAGIC_OBJECT(object, mgc);
+	if (offload->notify[0] >= 0)
+		close(offload->notify[0]);
+	if (offload->notify[1] >= 0)
+		close(offload->notify[1]);
 
-	rb_funcall(mgc->mutex, rb_intern("unlock"), 0);
+	free(offload->path);
+	free(offload);
 
-	return Qnil;
+	MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, local_errno,
+			    E_NOT_ENOUGH_MEMORY);
 }
 
 static VALUE
-magic_return(void *data)
+magic_offload_run(VALUE data)
 {
-	rb_mgc_arguments_t *mga = data;
-	const char *unknown = NULL;
-	VALUE separator = Qundef;
-	VALUE array, string;
+	rb_mgc_offload_t *offload = (rb_mgc_offload_t *)data;
+	rb_mgc_result_t *result = &offload->result;
 
-	string = CSTR2RVAL(mga->result);
-	RB_GC_GUARD(string);
+	*offload->io = rb_io_fdopen(offload->notify[0], O_RDONLY, NULL);
+	offload->notify[0] = -1;
 
-	/*
-	 * The value below is a field separator that can be used to split results
-	 * when the CONTINUE flag is set causing all valid matches found by the
-	 * Magic library to be returned.
-	 */
-	if (mga->flags & MAGIC_CONTINUE)
-		separator = CSTR2RVAL(MAGIC_CONTINUE_SEPARATOR);
+	magic_lock(offload->object, magic_offload_internal, offload);
 
-	if (mga->flags & MAGIC_EXTENSION) {
-		/*
-		 * A possible I/O-related error has occurred, and there is very
-		 * little sense processing the results, so return string as-is.
-		 */
-		if (mga->status < 0)
-			return string;
-		/*
-		 * A number of Magic flags that support primarily files e.g.,
-		 * MAGIC_EXTENSION, etc., would not return a meaningful value for
-		 * directories and special files, and such. Thus, it's better to
-		 * return an empty string, to indicate lack of results, rather
-		 * than a confusing string consisting of three questions marks.
-		 */
-		unknown = "???";
-		if (strncmp(mga->result, unknown, strlen(unknown)) == 0)
-			return CSTR2RVAL("");
+	if (magic_worker_submit(&offload->job) < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+				    E_WORKER_START);
+
+	while (!MAGIC_ATOMIC_LOAD(offload->finished))
+		rb_io_wait(*offload->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+
+	if (result->status < 0 && !offload->path &&
+	    result->magic_errno == EBADF)
+		rb_raise(rb_eIOError, "Bad file descriptor");
 
-		separator = CSTR2RVAL(MAGIC_EXTENSION_SEPARATOR);
+	if (RTEST(offload->into)) {
+		magic_result_check(result, offload->stop_on_errors);
+		return magic_result_into(offload->into, result->value,
+					 offload->flags);
 	}
 
-	RB_GC_GUARD(separator);
+	return magic_result(result, offload->flags, offload->stop_on_errors,
+			    offload->intern);
+}
 
-	if (mga->flags & (MAGIC_CONTINUE | MAGIC_EXTENSION)) {
-		array = magic_split(string, separator);
-		RB_GC_GUARD(array);
+static VALUE
+magic_offload_cleanup(VALUE data)
+{
+	rb_mgc_offload_t *offload = (rb_mgc_offload_t *)data;
 
-		if (RARRAY_LEN(array) > 1)
-			return magic_strip_array(array);
+	if (!NIL_P(*offload->io))
+		rb_io_close(*offload->io);
 
-		string = magic_shift(array);
-	}
+	offload->io = NULL;
 
-	return magic_strip(string);
+	magic_worker_cancel(&offload->job);
+	magic_worker_detach(&offload->job, magic_offload_release);
+
+	return Qnil;
 }
 
-static inline int
-magic_get_flags(VALUE object)
+static void
+magic_offload_release(magic_worker_job_t *job)
 {
-	return NUM2INT(rb_ivar_get(object, id_at_flags));
+	rb_mgc_offload_t *offload = job->data;
+
+	if (offload->notify[0] >= 0)
+		close(offload->notify[0]);
+	if (offload->notify[1] >= 0)
+		close(offload->notify[1]);
+
+	magic_worker_job_destroy(&offload->job);
+	magic_database_unref(offload->database);
+
+	free(offload->result.value);
+	free(offload->path);
+	free(offload);
 }
 
-static inline void
-magic_set_flags(VALUE object, int flags)
+/*
+ * Runs on a thread from the pool of native threads, thus must never touch
+ * the Ruby VM, see magic_batch_file().
+ */
+static void
+magic_offload_function(void *data, size_t index)
 {
-	rb_ivar_set(object, id_at_flags, INT2NUM(flags));
+	ssize_t rv;
+	magic_t cookie;
+	const char *cstring = NULL;
+	rb_mgc_offload_t *offload = data;
+	rb_mgc_result_t *result = &offload->result;
+
+	UNUSED(index);
+
+	cookie = magic_cache_get(offload->database, offload->flags,
+				 &offload->params);
+	if (!cookie) {
+		result->status = -1;
+		result->magic_errno = errno ? errno : ENOMEM;
+		goto out;
+	}
+
+	errno = 0;
+
+	if (offload->path && offload->mapped)
+		cstring = magic_prefetch_map(cookie, offload->path,
+					     offload->flags);
+	else if (offload->path)
+		cstring = magic_file_wrapper(cookie, offload->path,
+					     offload->flags);
+	else
+		cstring = magic_descriptor_wrapper(cookie, offload->fd,
+						   offload->flags);
+	if (!cstring) {
+		result->status = -1;
+		result->magic_errno = errno;
+		if (magic_errno_wrapper(cookie))
+			result->magic_errno = magic_errno_wrapper(cookie);
+		cstring = magic_error_wrapper(cookie);
+	}
+
+	if (cstring)
+		result->value = strdup(cstring);
+out:
+	MAGIC_ATOMIC_STORE(offload->finished, 1);
+
+	do {
+		rv = write(offload->notify[1], "", 1);
+	} while (rv < 0 && errno == EINTR);
 }
 
-static inline VALUE
-magic_set_paths(VALUE object, VALUE value)
+static int
+magic_pipe(int fds[2])
 {
-	return rb_ivar_set(object, id_at_paths, value);
+#if defined(HAVE_PIPE2) && defined(HAVE_O_CLOEXEC)
+	return pipe2(fds, O_CLOEXEC);
+#else
+	if (pipe(fds) < 0)
+		return -1;
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return 0;
+#endif /* HAVE_PIPE2 && HAVE_O_CLOEXEC */
 }
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
 
-static const rb_data_type_t rb_mgc_type = {
-	.wrap_struct_name = "magic",
+static const rb_data_type_t rb_mgc_batch_type = {
+	.wrap_struct_name = "magic_batch",
 	.function = {
-		.dmark	  = magic_mark,
-		.dfree	  = magic_free,
-		.dsize	  = magic_size,
+		.dmark = magic_batch_mark,
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_stream_type = {
+	.wrap_struct_name = "magic_stream",
+	.function = {
+		.dmark	  = magic_stream_mark,
+		.dfree	  = magic_stream_free,
+		.dsize	  = magic_stream_size,
+#if defined(HAVE_RUBY_GC_COMPACT)
+		.dcompact = magic_stream_compact,
+#endif /* HAVE_RUBY_GC_COMPACT */
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_report_type = {
+	.wrap_struct_name = "magic_result",
+	.function = {
+		.dmark	  = magic_report_mark,
+		.dfree	  = magic_report_free,
+		.dsize	  = magic_report_size,
+#if defined(HAVE_RUBY_GC_COMPACT)
+		.dcompact = magic_report_compact,
+#endif /* HAVE_RUBY_GC_COMPACT */
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_intern_type = {
+	.wrap_struct_name = "magic_intern",
+	.function = {
+		.dmark	  = magic_intern_mark,
+#if defined(HAVE_RUBY_GC_COMPACT)
+		.dcompact = magic_intern_compact,
+#endif /* HAVE_RUBY_GC_COMPACT */
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_pool_type = {
+	.wrap_struct_name = "magic_pool",
+	.function = {
+		.dmark	  = magic_pool_mark,
+		.dfree	  = magic_pool_free,
+		.dsize	  = magic_pool_size,
 #if defined(HAVE_RUBY_GC_COMPACT)
-		.dcompact = magic_compact,
+		.dcompact = magic_pool_compact,
 #endif /* HAVE_RUBY_GC_COMPACT */
 	},
 #if defined(RUBY_TYPED_FREE_IMMEDIATELY)
@@ -1611,6 +6836,31 @@ Init_magic(void)
 	id_at_paths = rb_intern("@paths");
 	id_at_flags = rb_intern("@flags");
 
+	pthread_atfork(NULL, NULL, magic_after_fork);
+
+	if (magic_cache_init() != 0)
+		rb_raise(rb_eLoadError, "failed to initialize Magic cache");
+
+	if (magic_prefetch_init() != 0)
+		rb_raise(rb_eLoadError, "failed to initialize Magic prefetch");
+
+	for (size_t i = 0; i < MAGIC_INTERN_SIZE; i++)
+		rb_mgc_intern.entries[i].string = Qnil;
+
+	rb_mgc_intern_holder = TypedData_Wrap_Struct(0, &rb_mgc_intern_type,
+						     &rb_mgc_intern);
+	rb_global_variable(&rb_mgc_intern_holder);
+
+#if defined(HAVE_RB_EXT_RACTOR_SAFE)
+	rb_ext_ractor_safe(true);
+#endif /* HAVE_RB_EXT_RACTOR_SAFE */
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	rb_mgc_current_key = rb_ractor_local_storage_value_newkey();
+#else
+	rb_global_variable(&rb_mgc_current_magic);
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+
 	rb_cMagic = rb_define_class("Magic", rb_cObject);
 	rb_define_alloc_func(rb_cMagic, magic_allocate);
 	/*
@@ -1641,6 +6891,10 @@ Init_magic(void)
 	 * Raised when
 	 */
 	rb_mgc_eNotImplementedError = rb_define_class_under(rb_cMagic, "NotImplementedError", rb_mgc_eError);
+	/*
+	 * Raised when waiting for a Magic object from Magic::Pool times out.
+	 */
+	rb_mgc_eTimeoutError = rb_define_class_under(rb_cMagic, "TimeoutError", rb_mgc_eError);
 
 	rb_define_singleton_method(rb_cMagic, "do_not_auto_load", RUBY_METHOD_FUNC(rb_mgc_get_do_not_auto_load_global), 0);
 	rb_define_singleton_method(rb_cMagic, "do_not_auto_load=", RUBY_METHOD_FUNC(rb_mgc_set_do_not_auto_load_global), 1);
@@ -1650,10 +6904,22 @@ Init_magic(void)
 
 	rb_define_singleton_method(rb_cMagic, "version", RUBY_METHOD_FUNC(rb_mgc_version), 0);
 
+	rb_define_singleton_method(rb_cMagic, "preload!", RUBY_METHOD_FUNC(rb_mgc_preload), -2);
+	rb_define_singleton_method(rb_cMagic, "preloaded?", RUBY_METHOD_FUNC(rb_mgc_preload_p), 0);
+
+	rb_define_singleton_method(rb_cMagic, "current", RUBY_METHOD_FUNC(rb_mgc_current), 0);
+
+	rb_define_singleton_method(rb_cMagic, "file_type", RUBY_METHOD_FUNC(rb_mgc_file_type), -1);
+	rb_define_singleton_method(rb_cMagic, "buffer_type", RUBY_METHOD_FUNC(rb_mgc_buffer_type), -1);
+	rb_define_singleton_method(rb_cMagic, "descriptor_type", RUBY_METHOD_FUNC(rb_mgc_descriptor_type), -1);
+
 	rb_define_method(rb_cMagic, "initialize", RUBY_METHOD_FUNC(rb_mgc_initialize), -2);
+	rb_define_method(rb_cMagic, "initialize_copy", RUBY_METHOD_FUNC(rb_mgc_initialize_copy), 1);
 
 	rb_define_method(rb_cMagic, "do_not_stop_on_error", RUBY_METHOD_FUNC(rb_mgc_get_do_not_stop_on_error), 0);
 	rb_define_method(rb_cMagic, "do_not_stop_on_error=", RUBY_METHOD_FUNC(rb_mgc_set_do_not_stop_on_error), 1);
+	rb_define_method(rb_cMagic, "intern_results", RUBY_METHOD_FUNC(rb_mgc_get_intern_results), 0);
+	rb_define_method(rb_cMagic, "intern_results=", RUBY_METHOD_FUNC(rb_mgc_set_intern_results), 1);
 
 	rb_define_method(rb_cMagic, "open?", RUBY_METHOD_FUNC(rb_mgc_open_p), 0);
 	rb_define_method(rb_cMagic, "close", RUBY_METHOD_FUNC(rb_mgc_close), 0);
@@ -1667,9 +6933,20 @@ Init_magic(void)
 	rb_define_method(rb_cMagic, "flags", RUBY_METHOD_FUNC(rb_mgc_get_flags), 0);
 	rb_define_method(rb_cMagic, "flags=", RUBY_METHOD_FUNC(rb_mgc_set_flags), 1);
 
-	rb_define_method(rb_cMagic, "file", RUBY_METHOD_FUNC(rb_mgc_file), 1);
-	rb_define_method(rb_cMagic, "buffer", RUBY_METHOD_FUNC(rb_mgc_buffer), 1);
-	rb_define_method(rb_cMagic, "descriptor", RUBY_METHOD_FUNC(rb_mgc_descriptor), 1);
+	rb_define_method(rb_cMagic, "file", RUBY_METHOD_FUNC(rb_mgc_file), -1);
+	rb_define_method(rb_cMagic, "buffer", RUBY_METHOD_FUNC(rb_mgc_buffer), -1);
+	rb_define_method(rb_cMagic, "descriptor", RUBY_METHOD_FUNC(rb_mgc_descriptor), -1);
+	rb_define_method(rb_cMagic, "io", RUBY_METHOD_FUNC(rb_mgc_io), 1);
+	rb_define_method(rb_cMagic, "identify", RUBY_METHOD_FUNC(rb_mgc_identify), -1);
+	rb_define_method(rb_cMagic, "result", RUBY_METHOD_FUNC(rb_mgc_result), 1);
+
+	rb_define_method(rb_cMagic, "file_into", RUBY_METHOD_FUNC(rb_mgc_file_into), -1);
+	rb_define_method(rb_cMagic, "buffer_into", RUBY_METHOD_FUNC(rb_mgc_buffer_into), -1);
+	rb_define_method(rb_cMagic, "descriptor_into", RUBY_METHOD_FUNC(rb_mgc_descriptor_into), -1);
+
+	rb_define_method(rb_cMagic, "files", RUBY_METHOD_FUNC(rb_mgc_files), -1);
+	rb_define_method(rb_cMagic, "buffers", RUBY_METHOD_FUNC(rb_mgc_buffers), -1);
+	rb_define_method(rb_cMagic, "scan", RUBY_METHOD_FUNC(rb_mgc_scan), -1);
 
 	rb_alias(rb_cMagic, rb_intern("fd"), rb_intern("descriptor"));
 
@@ -1684,6 +6961,59 @@ Init_magic(void)
 
 	rb_alias(rb_cMagic, rb_intern("valid?"), rb_intern("check"));
 
+	/*
+	 * A fixed-size pool of Magic objects to share between threads.
+	 */
+	rb_cMagicPool = rb_define_class_under(rb_cMagic, "Pool", rb_cObject);
+	rb_define_alloc_func(rb_cMagicPool, magic_pool_allocate);
+
+	rb_define_method(rb_cMagicPool, "initialize", RUBY_METHOD_FUNC(rb_mgc_pool_initialize), -1);
+
+	rb_define_method(rb_cMagicPool, "with", RUBY_METHOD_FUNC(rb_mgc_pool_with), -1);
+
+	rb_define_method(rb_cMagicPool, "file", RUBY_METHOD_FUNC(rb_mgc_pool_file), -1);
+	rb_define_method(rb_cMagicPool, "buffer", RUBY_METHOD_FUNC(rb_mgc_pool_buffer), -1);
+	rb_define_method(rb_cMagicPool, "descriptor", RUBY_METHOD_FUNC(rb_mgc_pool_descriptor), -1);
+	rb_define_method(rb_cMagicPool, "io", RUBY_METHOD_FUNC(rb_mgc_pool_io), -1);
+
+	rb_alias(rb_cMagicPool, rb_intern("fd"), rb_intern("descriptor"));
+
+	rb_define_method(rb_cMagicPool, "size", RUBY_METHOD_FUNC(rb_mgc_pool_size), 0);
+	rb_define_method(rb_cMagicPool, "available", RUBY_METHOD_FUNC(rb_mgc_pool_available), 0);
+	rb_define_method(rb_cMagicPool, "stats", RUBY_METHOD_FUNC(rb_mgc_pool_stats), 0);
+	rb_define_method(rb_cMagicPool, "close", RUBY_METHOD_FUNC(rb_mgc_pool_close), 0);
+
+	/*
+	 * Identifies content that arrives in chunks, such as an upload, as soon
+	 * as enough of it has arrived.
+	 */
+	rb_cMagicStream = rb_define_class_under(rb_cMagic, "Stream", rb_cObject);
+	rb_define_alloc_func(rb_cMagicStream, magic_stream_allocate);
+
+	rb_define_method(rb_cMagicStream, "initialize", RUBY_METHOD_FUNC(rb_mgc_stream_initialize), -1);
+
+	rb_define_method(rb_cMagicStream, "<<", RUBY_METHOD_FUNC(rb_mgc_stream_append), 1);
+	rb_define_method(rb_cMagicStream, "write", RUBY_METHOD_FUNC(rb_mgc_stream_write), 1);
+	rb_define_method(rb_cMagicStream, "ready?", RUBY_METHOD_FUNC(rb_mgc_stream_ready_p), 0);
+	rb_define_method(rb_cMagicStream, "result", RUBY_METHOD_FUNC(rb_mgc_stream_result), 0);
+	rb_define_method(rb_cMagicStream, "finish", RUBY_METHOD_FUNC(rb_mgc_stream_finish), 0);
+	rb_define_method(rb_cMagicStream, "size", RUBY_METHOD_FUNC(rb_mgc_stream_size), 0);
+	rb_define_method(rb_cMagicStream, "bytesize", RUBY_METHOD_FUNC(rb_mgc_stream_bytesize), 0);
+
+	/*
+	 * The result of identifying a file or content at once in many ways,
+	 * as returned by Magic#result.
+	 */
+	rb_cMagicResult = rb_define_class_under(rb_cMagic, "Result", rb_cObject);
+	rb_undef_alloc_func(rb_cMagicResult);
+
+	rb_define_method(rb_cMagicResult, "mime_type", RUBY_METHOD_FUNC(rb_mgc_report_mime_type), 0);
+	rb_define_method(rb_cMagicResult, "charset", RUBY_METHOD_FUNC(rb_mgc_report_charset), 0);
+	rb_define_method(rb_cMagicResult, "description", RUBY_METHOD_FUNC(rb_mgc_report_description), 0);
+	rb_define_method(rb_cMagicResult, "extensions", RUBY_METHOD_FUNC(rb_mgc_report_extensions), 0);
+	rb_define_method(rb_cMagicResult, "all_matches", RUBY_METHOD_FUNC(rb_mgc_report_all_matches), 0);
+	rb_define_method(rb_cMagicResult, "to_h", RUBY_METHOD_FUNC(rb_mgc_report_to_h), 0);
+
 	/*
 	 * Controls how many levels of recursion will be followed for
 	 * indirect magic entries.
@@ -1727,6 +7057,11 @@ Init_magic(void)
 	MAGIC_DEFINE_FLAG(SYMLINK);
 	/*
 	 * If the file is compressed, unpack it and look at the contents.
+	 *
+	 * Note that while a file is identified with this flag set, the standard
+	 * error output of the whole process is redirected to /dev/null, so that
+	 * the programs used to unpack it cannot write to it. Anything written to
+	 * the standard error output by other threads in the meantime is lost.
 	 */
 	MAGIC_DEFINE_FLAG(COMPRESS);
 	/*
@@ -7,21 +7,35 @@ extern "C" {
 
 #include "common.h"
 #include "functions.h"
+#include "database.h"
+#include "cache.h"
+#include "worker.h"
+#include "scan.h"
+#include "prefetch.h"
 
 #define MAGIC_SYNCHRONIZED(f, d) magic_lock(object, (f), (d))
 
 #define MAGIC_OBJECT(o, t) \
 	TypedData_Get_Struct((o), rb_mgc_object_t, &rb_mgc_type, (t))
 
+#define MAGIC_POOL(o, t) \
+	TypedData_Get_Struct((o), rb_mgc_pool_t, &rb_mgc_pool_type, (t))
+
+#define MAGIC_STREAM(o, t) \
+	TypedData_Get_Struct((o), rb_mgc_stream_t, &rb_mgc_stream_type, (t))
+
+#define MAGIC_REPORT(o, t) \
+	TypedData_Get_Struct((o), rb_mgc_report_t, &rb_mgc_report_type, (t))
+
 #define MAGIC_CLOSED_P(o) RTEST(rb_mgc_close_p((o)))
 #define MAGIC_LOADED_P(o) RTEST(rb_mgc_load_p((o)))
 
-#define MAGIC_WARNING(i, ...)				  \
-	do {						  \
-		if (!(i) || !(rb_mgc_warning & BIT(i))) { \
-			rb_mgc_warning |= BIT(i);	  \
-			rb_warn(__VA_ARGS__);		  \
-		}					  \
+#define MAGIC_WARNING(i, ...)					\
+	do {							\
+		if (!(i) ||					\
+		    !(MAGIC_ATOMIC_OR(rb_mgc_warning, BIT(i)) &	\
+		      BIT(i)))					\
+			rb_warn(__VA_ARGS__);			\
 	} while (0)
 
 #define MAGIC_ERRORS(t) ruby_magic_errors[(t)]
@@ -35,6 +49,9 @@ extern "C" {
 #define MAGIC_LIBRARY_ERROR(c) \
 	rb_exc_raise(magic_library_error(rb_mgc_eMagicError, (c)->cookie))
 
+#define MAGIC_IDENTIFY_ERROR(c) \
+	rb_exc_raise(magic_identify_error(rb_mgc_eMagicError, (c)))
+
 #define MAGIC_CHECK_INTEGER_TYPE(o) magic_check_type((o), T_FIXNUM)
 #define MAGIC_CHECK_STRING_TYPE(o)  magic_check_type((o), T_STRING)
 
@@ -68,6 +85,12 @@ extern "C" {
 					    E_MAGIC_LIBRARY_NOT_LOADED); \
 	} while (0)
 
+#define MAGIC_COOKIES_MAX 4
+#define MAGIC_VIEWS_MAX	  6
+#define MAGIC_INTERN_SIZE 1024
+
+#define MAGIC_VIEWS_MASK (MAGIC_MIME | MAGIC_EXTENSION | MAGIC_APPLE)
+
 #define MAGIC_STRINGIFY(s) #s
 
 #define MAGIC_DEFINE_FLAG(c) \
@@ -90,7 +113,19 @@ enum ruby_magic_error {
 	E_PARAM_INVALID_TYPE,
 	E_PARAM_INVALID_VALUE,
 	E_FLAG_NOT_IMPLEMENTED,
-	E_FLAG_INVALID_TYPE
+	E_FLAG_INVALID_TYPE,
+	E_POOL_INVALID_SIZE,
+	E_POOL_TIMEOUT,
+	E_WORKER_INVALID_THREADS,
+	E_WORKER_START,
+	E_MEMORY_VIEW_NOT_CONTIGUOUS,
+	E_OFFSET_OUT_OF_RANGE,
+	E_LENGTH_NEGATIVE,
+	E_IO_INVALID_TYPE,
+	E_STREAM_INVALID_SIZE,
+	E_VIEW_INVALID_TYPE,
+	E_DEBUG_NOT_SUPPORTED,
+	E_DEBUG_CAPTURE_FAILED
 };
 
 struct parameter {
@@ -109,25 +144,246 @@ struct buffers {
 	void **pointers;
 };
 
+struct buffer {
+	const void *pointer;
+	size_t size;
+	long offset;
+	long length;
+};
+
+typedef struct magic_cookie {
+	magic_t cookie;
+	magic_database_t *database;
+	int flags;
+} rb_mgc_cookie_t;
+
 typedef struct magic_object {
 	magic_t cookie;
-	VALUE mutex;
+	magic_database_t *database;
+	rb_mgc_cookie_t cookies[MAGIC_COOKIES_MAX];
+	size_t cookies_count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	VALUE owner;
+	unsigned long generation;
+	int flags;
+	unsigned int locked:1;
 	unsigned int database_loaded:1;
 	unsigned int stop_on_errors:1;
+	unsigned int intern_results:1;
 } rb_mgc_object_t;
 
+typedef struct magic_intern_entry {
+	VALUE string;
+	unsigned long hash;
+} rb_mgc_intern_entry_t;
+
+typedef struct magic_intern {
+	rb_mgc_intern_entry_t entries[MAGIC_INTERN_SIZE];
+	pthread_mutex_t lock;
+} rb_mgc_intern_t;
+
+typedef struct magic_lock {
+	rb_mgc_object_t *magic_object;
+	VALUE owner;
+	int locked;
+	int interrupted;
+} rb_mgc_lock_t;
+
 typedef struct magic_arguments {
 	rb_mgc_object_t *magic_object;
 	union {
 		struct parameter parameter;
 		union file file;
 		struct buffers buffers;
+		struct buffer buffer;
+		struct magic_object *copy;
 	};
+	magic_database_t *database;
+	magic_t cookie;
 	const char *result;
 	int status;
 	int flags;
+	VALUE value;
+	VALUE into;
+	capture_t capture;
+	unsigned int mapped:1;
+	unsigned int intern:1;
+	unsigned int debug:1;
 } rb_mgc_arguments_t;
 
+typedef struct magic_pool_stats {
+	unsigned long checkouts;
+	unsigned long waits;
+	unsigned long timeouts;
+	size_t waiting;
+	size_t max_waiting;
+	unsigned long long wait_time;
+} rb_mgc_pool_stats_t;
+
+typedef struct magic_pool {
+	VALUE members;
+	size_t size;
+	VALUE *owners;
+	size_t *available;
+	size_t available_count;
+	unsigned long generation;
+	double timeout;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	rb_mgc_pool_stats_t stats;
+} rb_mgc_pool_t;
+
+typedef struct magic_pool_checkout {
+	rb_mgc_pool_t *pool;
+	struct timespec deadline;
+	long index;
+	int has_deadline;
+	int interrupted;
+	int timed_out;
+	int waited;
+} rb_mgc_pool_checkout_t;
+
+typedef struct magic_stream {
+	char *buffer;
+	size_t size;
+	size_t length;
+	VALUE magic;
+	VALUE result;
+	unsigned int finished:1;
+} rb_mgc_stream_t;
+
+typedef struct magic_view {
+	const char *name;
+	int flags;
+} rb_mgc_view_t;
+
+enum magic_report_view {
+	MAGIC_REPORT_MIME = 0,
+	MAGIC_REPORT_DESCRIPTION,
+	MAGIC_REPORT_EXTENSIONS,
+	MAGIC_REPORT_MATCHES,
+	MAGIC_REPORT_VIEWS
+};
+
+enum magic_report_field {
+	MAGIC_REPORT_MIME_TYPE = 0,
+	MAGIC_REPORT_CHARSET,
+	MAGIC_REPORT_DESCRIPTION_FIELD,
+	MAGIC_REPORT_EXTENSIONS_FIELD,
+	MAGIC_REPORT_ALL_MATCHES,
+	MAGIC_REPORT_FIELDS
+};
+
+typedef struct magic_report {
+	char *values[MAGIC_REPORT_VIEWS];
+	VALUE fields[MAGIC_REPORT_FIELDS];
+	unsigned int intern:1;
+} rb_mgc_report_t;
+
+typedef struct magic_io {
+	VALUE object;
+	VALUE position;
+	size_t length;
+} rb_mgc_io_t;
+
+typedef struct magic_pool_call {
+	VALUE member;
+	ID method;
+	int argc;
+	const VALUE *argv;
+	int kw_splat;
+} rb_mgc_pool_call_t;
+
+enum magic_bytes_lock {
+	MAGIC_BYTES_UNLOCKED = 0,
+	MAGIC_BYTES_STRING,
+	MAGIC_BYTES_IO_BUFFER,
+	MAGIC_BYTES_MEMORY_VIEW
+};
+
+typedef struct magic_bytes {
+	VALUE object;
+	const void *pointer;
+	size_t size;
+	enum magic_bytes_lock lock;
+#if defined(HAVE_RB_MEMORY_VIEW_GET)
+	rb_memory_view_t view;
+#endif /* HAVE_RB_MEMORY_VIEW_GET */
+} rb_mgc_bytes_t;
+
+typedef struct magic_result {
+	char *value;
+	int magic_errno;
+	int status;
+} rb_mgc_result_t;
+
+typedef struct magic_identify {
+	rb_mgc_object_t *magic_object;
+	magic_prefetch_view_t view;
+	rb_mgc_result_t results[MAGIC_VIEWS_MAX];
+	const rb_mgc_view_t *views[MAGIC_VIEWS_MAX];
+	const char *path;
+	struct buffer buffer;
+	size_t count;
+	int flags;
+	VALUE value;
+	unsigned int stop_on_errors:1;
+	unsigned int intern:1;
+} rb_mgc_identify_t;
+
+typedef struct magic_batch {
+	magic_worker_job_t job;
+	magic_database_t *database;
+	magic_params_t params;
+	const char **pointers;
+	size_t *sizes;
+	rb_mgc_bytes_t *bytes;
+	rb_mgc_result_t *results;
+	size_t count;
+	size_t locked;
+	size_t chunk;
+	size_t finished;
+	int flags;
+	VALUE object;
+	VALUE inputs;
+	VALUE values;
+	VALUE pin;
+	unsigned int stop_on_errors:1;
+	unsigned int slices:1;
+	unsigned int intern:1;
+} rb_mgc_batch_t;
+
+typedef struct magic_scanner {
+	magic_scan_t scan;
+	magic_worker_job_t job;
+	magic_scan_entry_t *entries;
+	size_t count;
+	size_t index;
+	int flags;
+	VALUE object;
+	unsigned int stop_on_errors:1;
+	unsigned int intern:1;
+} rb_mgc_scanner_t;
+
+typedef struct magic_offload {
+	magic_worker_job_t job;
+	magic_database_t *database;
+	magic_params_t params;
+	rb_mgc_result_t result;
+	char *path;
+	int fd;
+	int flags;
+	int notify[2];
+	int finished;
+	VALUE object;
+	VALUE into;
+	VALUE *io;
+	unsigned int stop_on_errors:1;
+	unsigned int mapped:1;
+	unsigned int intern:1;
+} rb_mgc_offload_t;
+
 typedef struct magic_error {
 	const char *magic_error;
 	VALUE klass;
@@ -149,9 +405,43 @@ static const char * const ruby_magic_errors[] = {
 	[E_PARAM_INVALID_VALUE]		= "invalid parameter value specified",
 	[E_FLAG_NOT_IMPLEMENTED]	= "flag is not implemented",
 	[E_FLAG_INVALID_TYPE]		= "unknown or invalid flag specified",
+	[E_POOL_INVALID_SIZE]		= "pool size must be greater than zero",
+	[E_POOL_TIMEOUT]		= "timed out waiting for an available Magic object",
+	[E_WORKER_INVALID_THREADS]	= "number of threads must be greater than zero",
+	[E_WORKER_START]		= "failed to start worker threads",
+	[E_MEMORY_VIEW_NOT_CONTIGUOUS]	= "memory view is not contiguous",
+	[E_OFFSET_OUT_OF_RANGE]		= "offset %ld out of range",
+	[E_LENGTH_NEGATIVE]		= "negative length %ld",
+	[E_IO_INVALID_TYPE]		= "unknown or invalid io specified (expected :read or :mmap)",
+	[E_STREAM_INVALID_SIZE]		= "stream size must be greater than zero",
+	[E_VIEW_INVALID_TYPE]		= "unknown or invalid view specified",
+	[E_DEBUG_NOT_SUPPORTED]		= "capturing the debugging output is not supported",
+	[E_DEBUG_CAPTURE_FAILED]	= "failed to capture the debugging output",
 	NULL
 };
 
+static const rb_mgc_view_t ruby_magic_views[MAGIC_VIEWS_MAX] = {
+	{ "description",	MAGIC_NONE },
+	{ "mime_type",		MAGIC_MIME_TYPE },
+	{ "encoding",		MAGIC_MIME_ENCODING },
+	{ "mime",		MAGIC_MIME },
+	{ "extensions",		MAGIC_EXTENSION },
+	{ "apple",		MAGIC_APPLE },
+};
+
+/*
+ * The views that Magic::Result is built from, in the order of the
+ * magic_report_view values. The description is asked for on its own, as
+ * the Magic library splits a single match into many when every match is
+ * asked for, for some of the types.
+ */
+static const rb_mgc_view_t ruby_magic_report_views[MAGIC_REPORT_VIEWS] = {
+	[MAGIC_REPORT_MIME]		= { "mime",		MAGIC_MIME },
+	[MAGIC_REPORT_DESCRIPTION]	= { "description",	MAGIC_NONE },
+	[MAGIC_REPORT_EXTENSIONS]	= { "extensions",	MAGIC_EXTENSION },
+	[MAGIC_REPORT_MATCHES]		= { "all_matches",	MAGIC_CONTINUE | MAGIC_RAW },
+};
+
 #if defined(MAGIC_CUSTOM_CHECK_TYPE)
 static const char * const magic_ruby_types[] = {
 	"", /* Not an object */
@@ -241,22 +531,6 @@ error:
 }
 #endif /* MAGIC_CUSTOM_CHECK_TYPE */
 
-static inline VALUE
-magic_strip(VALUE v)
-{
-	return (ARRAY_P(v) || STRING_P(v)) ?
-		rb_funcall(v, rb_intern("strip"), 0) :
-		Qnil;
-}
-
-static inline VALUE
-magic_shift(VALUE v)
-{
-	return ARRAY_P(v) ?
-		rb_funcall(v, rb_intern("shift"), 0) :
-		Qnil;
-}
-
 static inline VALUE
 magic_split(VALUE a, VALUE b)
 {
@@ -281,29 +555,6 @@ magic_flatten(VALUE v)
 		Qnil;
 }
 
-static inline VALUE
-magic_strip_array(VALUE value) {
-	VALUE entry;
-	VALUE array = rb_ary_new();
-
-	for (int i = 0; i < RARRAY_LEN(value); i++) {
-		entry = rb_ary_entry(value, i);
-		if (NIL_P(entry))
-			continue;
-
-		if (STRING_P(entry)) {
-			if (RSTRING_EMPTY_P(entry))
-				continue;
-
-			entry = magic_strip(entry);
-		}
-
-		rb_ary_push(array, entry);
-	}
-
-	return array;
-}
-
 static int
 magic_fileno(VALUE object)
 {
@@ -318,9 +569,15 @@ magic_fileno(VALUE object)
 	if (!FILE_P(object))
 		object = rb_convert_type(object, T_FILE, "IO", "to_io");
 
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+	UNUSED(io);
+
+	fd = rb_io_descriptor(object);
+#else
 	GetOpenFile(object, io);
 
 	fd = FPTR_TO_FD(io);
+#endif /* HAVE_RB_IO_DESCRIPTOR */
 	if (fd < 0)
 		rb_raise(rb_eIOError, "closed stream");
 
@@ -379,10 +636,14 @@ VALUE rb_mgc_get_do_not_stop_on_error_global(VALUE object);
 VALUE rb_mgc_set_do_not_stop_on_error_global(VALUE object, VALUE value);
 
 VALUE rb_mgc_initialize(VALUE object, VALUE arguments);
+VALUE rb_mgc_initialize_copy(VALUE object, VALUE original);
 
 VALUE rb_mgc_get_do_not_stop_on_error(VALUE object);
 VALUE rb_mgc_set_do_not_stop_on_error(VALUE object, VALUE value);
 
+VALUE rb_mgc_get_intern_results(VALUE object);
+VALUE rb_mgc_set_intern_results(VALUE object, VALUE value);
+
 VALUE rb_mgc_open_p(VALUE object);
 VALUE rb_mgc_close(VALUE object);
 VALUE rb_mgc_close_p(VALUE object);
@@ -402,12 +663,60 @@ VALUE rb_mgc_load_p(VALUE object);
 VALUE rb_mgc_compile(VALUE object, VALUE arguments);
 VALUE rb_mgc_check(VALUE object, VALUE arguments);
 
-VALUE rb_mgc_file(VALUE object, VALUE value);
-VALUE rb_mgc_buffer(VALUE object, VALUE value);
-VALUE rb_mgc_descriptor(VALUE object, VALUE value);
+VALUE rb_mgc_file(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_buffer(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_descriptor(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_file_into(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_buffer_into(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_descriptor_into(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_io(VALUE object, VALUE value);
+VALUE rb_mgc_identify(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_result(VALUE object, VALUE value);
+
+VALUE rb_mgc_files(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_buffers(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_scan(int argc, VALUE *argv, VALUE object);
 
 VALUE rb_mgc_version(VALUE object);
 
+VALUE rb_mgc_preload(VALUE object, VALUE arguments);
+VALUE rb_mgc_preload_p(VALUE object);
+
+VALUE rb_mgc_current(VALUE object);
+
+VALUE rb_mgc_file_type(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_buffer_type(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_descriptor_type(int argc, VALUE *argv, VALUE object);
+
+unsigned long rb_mgc_fork_generation(void);
+
+VALUE rb_mgc_pool_initialize(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_with(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_file(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_buffer(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_descriptor(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_io(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_pool_size(VALUE object);
+VALUE rb_mgc_pool_available(VALUE object);
+VALUE rb_mgc_pool_stats(VALUE object);
+VALUE rb_mgc_pool_close(VALUE object);
+
+VALUE rb_mgc_stream_initialize(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_stream_append(VALUE object, VALUE value);
+VALUE rb_mgc_stream_write(VALUE object, VALUE value);
+VALUE rb_mgc_stream_ready_p(VALUE object);
+VALUE rb_mgc_stream_result(VALUE object);
+VALUE rb_mgc_stream_finish(VALUE object);
+VALUE rb_mgc_stream_size(VALUE object);
+VALUE rb_mgc_stream_bytesize(VALUE object);
+
+VALUE rb_mgc_report_mime_type(VALUE object);
+VALUE rb_mgc_report_charset(VALUE object);
+VALUE rb_mgc_report_description(VALUE object);
+VALUE rb_mgc_report_extensions(VALUE object);
+VALUE rb_mgc_report_all_matches(VALUE object);
+VALUE rb_mgc_report_to_h(VALUE object);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,715 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "scan.h"
+
+/*
+ * A scan walks a directory tree and identifies the files found in it using
+ * a number of threads from the pool of native threads, see worker.c, that
+ * share the directories and files that are yet to be looked at. The results
+ * are handed over to the Ruby thread that started the scan through a bounded
+ * queue, thus the threads wait when the results are not consumed fast enough.
+ */
+
+static void magic_scan_directory(magic_scan_t *scan, char *path);
+static void magic_scan_files(magic_scan_t *scan, char **paths, size_t count);
+static void magic_scan_file(magic_scan_t *scan, char *path,
+			    magic_prefetch_entry_t *prefetch);
+static void magic_scan_error(magic_scan_t *scan, char *path, int error);
+static void magic_scan_emit(magic_scan_t *scan, magic_scan_entry_t *entry);
+
+static DIR *magic_scan_opendir(const char *path);
+static int magic_scan_is_directory(magic_scan_t *scan, DIR *dir,
+				   struct dirent *entry, const char *path);
+static int magic_scan_visit(magic_scan_t *scan, DIR *dir);
+static int magic_scan_match(magic_scan_list_t *patterns, const char *path,
+			    const char *name);
+static char *magic_scan_join(const char *path, const char *name);
+
+static int magic_scan_list_push(magic_scan_list_t *list, char *item);
+static char *magic_scan_list_pop(magic_scan_list_t *list);
+static void magic_scan_list_free(magic_scan_list_t *list);
+
+static inline int
+open_flags(void)
+{
+	int flags = O_RDONLY;
+
+#if defined(O_DIRECTORY)
+	flags |= O_DIRECTORY;
+#endif
+#if defined(HAVE_O_CLOEXEC)
+	flags |= O_CLOEXEC;
+#endif
+
+	return flags;
+}
+
+int
+magic_scan_init(magic_scan_t *scan, const char *root,
+		magic_database_t *database, const magic_params_t *params,
+		int flags, size_t workers)
+{
+	char *path;
+
+	assert(scan != NULL &&
+	       "Must be a valid pointer to `magic_scan_t' type");
+
+	*scan = (magic_scan_t) {
+		.database = database,
+		.params = *params,
+		.flags = flags,
+		.workers = workers,
+		.depth = magic_prefetch_depth(workers),
+		.recursive = 1,
+	};
+
+	scan->root = strdup(root);
+	path = strdup(root);
+	scan->entries = calloc(MAGIC_SCAN_QUEUE_MAX, sizeof(magic_scan_entry_t));
+
+	if (!scan->root || !path || !scan->entries ||
+	    magic_scan_list_push(&scan->directories, path) < 0) {
+		free(path);
+		free(scan->root);
+		free(scan->entries);
+		magic_scan_list_free(&scan->directories);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	scan->root_length = strlen(root);
+
+	pthread_mutex_init(&scan->lock, NULL);
+	pthread_cond_init(&scan->work, NULL);
+	pthread_cond_init(&scan->space, NULL);
+	pthread_cond_init(&scan->ready, NULL);
+
+	return 0;
+}
+
+/*
+ * Releases everything that the scan still holds on to, including the
+ * reference to the database. None of the threads may work on the scan
+ * any longer.
+ */
+void
+magic_scan_destroy(magic_scan_t *scan)
+{
+	magic_scan_entry_t *entry;
+
+	for (size_t i = 0; i < scan->length; i++) {
+		entry = &scan->entries[(scan->head + i) % MAGIC_SCAN_QUEUE_MAX];
+		free(entry->path);
+		free(entry->value);
+	}
+
+	magic_scan_list_free(&scan->includes);
+	magic_scan_list_free(&scan->excludes);
+	magic_scan_list_free(&scan->directories);
+	magic_scan_list_free(&scan->files);
+
+	free(scan->visited.devices);
+	free(scan->visited.inodes);
+	free(scan->entries);
+	free(scan->root);
+
+	magic_database_unref(scan->database);
+
+	pthread_cond_destroy(&scan->ready);
+	pthread_cond_destroy(&scan->space);
+	pthread_cond_destroy(&scan->work);
+	pthread_mutex_destroy(&scan->lock);
+}
+
+int
+magic_scan_include(magic_scan_t *scan, const char *pattern)
+{
+	char *item = strdup(pattern);
+
+	if (!item || magic_scan_list_push(&scan->includes, item) < 0) {
+		free(item);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+magic_scan_exclude(magic_scan_t *scan, const char *pattern)
+{
+	char *item = strdup(pattern);
+
+	if (!item || magic_scan_list_push(&scan->excludes, item) < 0) {
+		free(item);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs on each of the threads that work on the scan. The files waiting to
+ * be identified are preferred over the directories waiting to be read, so
+ * that the number of paths held in memory stays low. A thread stops once
+ * there is nothing left to do, and no other thread is reading a directory
+ * that could yield more work.
+ */
+void
+magic_scan_worker(void *data, size_t index)
+{
+	char *path;
+	size_t count;
+	char *paths[MAGIC_PREFETCH_DEPTH];
+	magic_scan_t *scan = data;
+
+	UNUSED(index);
+
+	pthread_mutex_lock(&scan->lock);
+
+	while (!scan->stopped) {
+		if (scan->prefetch && scan->files.count > 0) {
+			count = scan->files.count / scan->workers;
+			if (count > scan->depth)
+				count = scan->depth;
+
+			if (count == 0)
+				count = 1;
+
+			for (size_t i = 0; i < count; i++)
+				paths[i] = magic_scan_list_pop(&scan->files);
+
+			pthread_mutex_unlock(&scan->lock);
+			magic_scan_files(scan, paths, count);
+			pthread_mutex_lock(&scan->lock);
+			continue;
+		}
+
+		path = magic_scan_list_pop(&scan->files);
+		if (path) {
+			pthread_mutex_unlock(&scan->lock);
+			magic_scan_file(scan, path, NULL);
+			pthread_mutex_lock(&scan->lock);
+			continue;
+		}
+
+		path = magic_scan_list_pop(&scan->directories);
+		if (path) {
+			scan->active++;
+			pthread_mutex_unlock(&scan->lock);
+			magic_scan_directory(scan, path);
+			pthread_mutex_lock(&scan->lock);
+			scan->active--;
+			pthread_cond_broadcast(&scan->work);
+			continue;
+		}
+
+		if (scan->active == 0)
+			break;
+
+		pthread_cond_wait(&scan->work, &scan->lock);
+	}
+
+	if (++scan->exited == scan->workers) {
+		scan->done = 1;
+		pthread_cond_broadcast(&scan->ready);
+	}
+
+	pthread_cond_broadcast(&scan->work);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * Waits until there are results available, until the scan is done, or until
+ * the wait is interrupted, and then moves at most the given number of the
+ * results into the given entries, which the caller is now responsible for.
+ */
+size_t
+magic_scan_wait(magic_scan_t *scan, magic_scan_entry_t *entries, size_t count)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&scan->lock);
+
+	while (scan->length == 0 && !scan->done && !scan->interrupted)
+		pthread_cond_wait(&scan->ready, &scan->lock);
+
+	while (n < count && scan->length > 0) {
+		entries[n++] = scan->entries[scan->head];
+		scan->head = (scan->head + 1) % MAGIC_SCAN_QUEUE_MAX;
+		scan->length--;
+	}
+
+	if (n > 0)
+		pthread_cond_broadcast(&scan->space);
+
+	pthread_mutex_unlock(&scan->lock);
+
+	return n;
+}
+
+int
+magic_scan_done(magic_scan_t *scan)
+{
+	int done;
+
+	pthread_mutex_lock(&scan->lock);
+	done = scan->done && scan->length == 0;
+	pthread_mutex_unlock(&scan->lock);
+
+	return done;
+}
+
+/*
+ * Clears an earlier interrupt under the lock before waiting again, see
+ * magic_worker_rearm().
+ */
+void
+magic_scan_rearm(magic_scan_t *scan)
+{
+	pthread_mutex_lock(&scan->lock);
+	scan->interrupted = 0;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+void
+magic_scan_interrupt(magic_scan_t *scan)
+{
+	pthread_mutex_lock(&scan->lock);
+	scan->interrupted = 1;
+	pthread_cond_broadcast(&scan->ready);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+void
+magic_scan_stop(magic_scan_t *scan)
+{
+	pthread_mutex_lock(&scan->lock);
+	MAGIC_ATOMIC_STORE(scan->stopped, 1);
+	pthread_cond_broadcast(&scan->work);
+	pthread_cond_broadcast(&scan->space);
+	pthread_cond_broadcast(&scan->ready);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static void
+magic_scan_directory(magic_scan_t *scan, char *path)
+{
+	int rv;
+	DIR *dir;
+	char *child;
+	const char *relative;
+	struct dirent *entry;
+	size_t offset = scan->root_length;
+
+	dir = magic_scan_opendir(path);
+	if (!dir) {
+		if (errno == ENOTDIR)
+			magic_scan_file(scan, path, NULL);
+		else
+			magic_scan_error(scan, path, errno);
+		return;
+	}
+
+	if (scan->follow_symlinks && !magic_scan_visit(scan, dir))
+		goto out;
+
+	if (offset > 0 && scan->root[offset - 1] != '/')
+		offset++;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (MAGIC_ATOMIC_LOAD(scan->stopped))
+			break;
+
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		child = magic_scan_join(path, entry->d_name);
+		if (!child) {
+			magic_scan_error(scan, strdup(path), ENOMEM);
+			break;
+		}
+
+		relative = child + offset;
+
+		rv = magic_scan_is_directory(scan, dir, entry, child);
+		if (rv > 0) {
+			if (!scan->recursive ||
+			    magic_scan_match(&scan->excludes, relative,
+					     entry->d_name)) {
+				free(child);
+				continue;
+			}
+
+			pthread_mutex_lock(&scan->lock);
+			rv = magic_scan_list_push(&scan->directories, child);
+			pthread_cond_signal(&scan->work);
+			pthread_mutex_unlock(&scan->lock);
+
+			if (rv < 0)
+				magic_scan_error(scan, child, ENOMEM);
+
+			continue;
+		}
+
+		if (magic_scan_match(&scan->excludes, relative, entry->d_name) ||
+		    (scan->includes.count > 0 &&
+		     !magic_scan_match(&scan->includes, relative,
+				       entry->d_name))) {
+			free(child);
+			continue;
+		}
+
+		pthread_mutex_lock(&scan->lock);
+		rv = -1;
+		if (scan->files.count < MAGIC_SCAN_PENDING_MAX)
+			rv = magic_scan_list_push(&scan->files, child);
+		if (rv == 0)
+			pthread_cond_signal(&scan->work);
+		pthread_mutex_unlock(&scan->lock);
+		/*
+		 * When there are already many files waiting to be identified,
+		 * then identify the file right away, which also slows down
+		 * reading of large directories to the pace of the other threads.
+		 */
+		if (rv < 0)
+			magic_scan_file(scan, child, NULL);
+	}
+out:
+	closedir(dir);
+	free(path);
+}
+
+/*
+ * Identifies a number of files at once, reading the files ahead together,
+ * see magic_prefetch().
+ */
+static void
+magic_scan_files(magic_scan_t *scan, char **paths, size_t count)
+{
+	magic_prefetch_entry_t entries[MAGIC_PREFETCH_DEPTH];
+
+	for (size_t i = 0; i < count; i++)
+		entries[i].path = paths[i];
+
+	magic_prefetch(entries, count, &scan->params, scan->flags);
+
+	for (size_t i = 0; i < count; i++)
+		magic_scan_file(scan, paths[i], &entries[i]);
+
+	magic_prefetch_release(entries, count);
+}
+
+static void
+magic_scan_file(magic_scan_t *scan, char *path,
+		magic_prefetch_entry_t *prefetch)
+{
+	magic_t cookie;
+	const char *cstring;
+	magic_scan_entry_t entry = {
+		.path = path,
+	};
+
+	cookie = magic_cache_get(scan->database, scan->flags, &scan->params);
+	if (!cookie) {
+		magic_scan_error(scan, path, errno ? errno : ENOMEM);
+		return;
+	}
+
+	if (prefetch)
+		cstring = magic_prefetch_identify(cookie, prefetch, scan->flags);
+	else
+		cstring = magic_file_wrapper(cookie, path, scan->flags);
+
+	if (!cstring) {
+		entry.status = -1;
+		entry.magic_errno = magic_errno_wrapper(cookie);
+		cstring = magic_error_wrapper(cookie);
+	}
+
+	if (cstring)
+		entry.value = strdup(cstring);
+
+	magic_scan_emit(scan, &entry);
+}
+
+/*
+ * Reports an error that is not reported by the Magic library, such as when a
+ * directory cannot be read, in the same format as the Magic library would.
+ */
+static void
+magic_scan_error(magic_scan_t *scan, char *path, int error)
+{
+	int length;
+	magic_scan_entry_t entry = {
+		.path = path,
+		.magic_errno = error,
+		.status = -1,
+	};
+
+	if (!path)
+		return;
+
+	length = snprintf(NULL, 0, "cannot open `%s' (%s)", path,
+			  strerror(error));
+	if (length > 0) {
+		entry.value = malloc((size_t)length + 1);
+		if (entry.value)
+			snprintf(entry.value, (size_t)length + 1,
+				 "cannot open `%s' (%s)", path, strerror(error));
+	}
+
+	magic_scan_emit(scan, &entry);
+}
+
+static void
+magic_scan_emit(magic_scan_t *scan, magic_scan_entry_t *entry)
+{
+	size_t index;
+
+	pthread_mutex_lock(&scan->lock);
+
+	while (scan->length == MAGIC_SCAN_QUEUE_MAX && !scan->stopped)
+		pthread_cond_wait(&scan->space, &scan->lock);
+
+	if (scan->stopped) {
+		pthread_mutex_unlock(&scan->lock);
+		free(entry->path);
+		free(entry->value);
+		return;
+	}
+
+	index = (scan->head + scan->length) % MAGIC_SCAN_QUEUE_MAX;
+	scan->entries[index] = *entry;
+	scan->length++;
+
+	pthread_cond_signal(&scan->ready);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static DIR *
+magic_scan_opendir(const char *path)
+{
+#if defined(HAVE_FDOPENDIR)
+	int fd;
+	int local_errno;
+	DIR *dir;
+
+	fd = open(path, open_flags());
+	if (fd < 0)
+		return NULL;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		local_errno = errno;
+		close(fd);
+		errno = local_errno;
+	}
+
+	return dir;
+#else
+	return opendir(path);
+#endif /* HAVE_FDOPENDIR */
+}
+
+/*
+ * Returns 1 when the entry refers to a directory, and 0 otherwise. The type
+ * reported by readdir() is used when available, and only when the entry is
+ * a symbolic link that is to be followed, or when the type is unknown, then
+ * the entry is looked at, relative to the directory when possible.
+ */
+static int
+magic_scan_is_directory(magic_scan_t *scan, DIR *dir, struct dirent *entry,
+			const char *path)
+{
+	int rv;
+	struct stat sb;
+
+#if defined(HAVE_STRUCT_DIRENT_D_TYPE)
+	if (entry->d_type != DT_UNKNOWN &&
+	    !(entry->d_type == DT_LNK && scan->follow_symlinks))
+		return entry->d_type == DT_DIR;
+#endif /* HAVE_STRUCT_DIRENT_D_TYPE */
+
+#if defined(HAVE_FSTATAT)
+	rv = fstatat(dirfd(dir), entry->d_name, &sb,
+		     scan->follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	UNUSED(dir);
+	UNUSED(entry);
+	rv = scan->follow_symlinks ? stat(path, &sb) : lstat(path, &sb);
+#endif /* HAVE_FSTATAT */
+
+	UNUSED(path);
+
+	return rv == 0 && S_ISDIR(sb.st_mode);
+}
+
+/*
+ * Records the directory as visited, and returns 0 when it was visited
+ * already, which happens only when symbolic links are followed, and two of
+ * them, or a symbolic link and the directory itself, lead to the same place.
+ */
+static int
+magic_scan_visit(magic_scan_t *scan, DIR *dir)
+{
+	int rv = 1;
+	size_t i, mask;
+	struct stat sb;
+	magic_scan_visited_t *visited = &scan->visited;
+	magic_scan_visited_t grown;
+
+	if (fstat(dirfd(dir), &sb) < 0)
+		return 1;
+
+	pthread_mutex_lock(&scan->lock);
+
+	if ((visited->count + 1) * 2 > visited->capacity) {
+		grown = (magic_scan_visited_t) {
+			.capacity = visited->capacity ? visited->capacity * 2 : 64,
+		};
+
+		grown.devices = calloc(grown.capacity, sizeof(dev_t));
+		grown.inodes = calloc(grown.capacity, sizeof(ino_t));
+		if (!grown.devices || !grown.inodes) {
+			free(grown.devices);
+			free(grown.inodes);
+			goto out;
+		}
+
+		mask = grown.capacity - 1;
+		for (size_t j = 0; j < visited->capacity; j++) {
+			if (visited->inodes[j] == 0 && visited->devices[j] == 0)
+				continue;
+
+			i = (size_t)(visited->inodes[j] ^ visited->devices[j]) & mask;
+			while (grown.inodes[i] != 0 || grown.devices[i] != 0)
+				i = (i + 1) & mask;
+
+			grown.devices[i] = visited->devices[j];
+			grown.inodes[i] = visited->inodes[j];
+		}
+
+		grown.count = visited->count;
+
+		free(visited->devices);
+		free(visited->inodes);
+		*visited = grown;
+	}
+
+	mask = visited->capacity - 1;
+	i = (size_t)(sb.st_ino ^ sb.st_dev) & mask;
+
+	while (visited->inodes[i] != 0 || visited->devices[i] != 0) {
+		if (visited->inodes[i] == sb.st_ino &&
+		    visited->devices[i] == sb.st_dev) {
+			rv = 0;
+			goto out;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	visited->devices[i] = sb.st_dev;
+	visited->inodes[i] = sb.st_ino;
+	visited->count++;
+out:
+	pthread_mutex_unlock(&scan->lock);
+
+	return rv;
+}
+
+/*
+ * Patterns that contain a slash are matched against the path relative to
+ * the root of the scan, and the other patterns against the name alone.
+ */
+static int
+magic_scan_match(magic_scan_list_t *patterns, const char *path,
+		 const char *name)
+{
+	const char *pattern;
+
+	for (size_t i = 0; i < patterns->count; i++) {
+		pattern = patterns->items[i];
+#if defined(HAVE_FNMATCH_H)
+		if (fnmatch(pattern, strchr(pattern, '/') ? path : name, 0) == 0)
+			return 1;
+#else
+		if (strcmp(pattern, strchr(pattern, '/') ? path : name) == 0)
+			return 1;
+#endif /* HAVE_FNMATCH_H */
+	}
+
+	return 0;
+}
+
+static char *
+magic_scan_join(const char *path, const char *name)
+{
+	char *joined;
+	size_t length = strlen(path);
+	size_t name_length = strlen(name);
+	int separator = length > 0 && path[length - 1] != '/';
+
+	joined = malloc(length + (size_t)separator + name_length + 1);
+	if (!joined)
+		return NULL;
+
+	memcpy(joined, path, length);
+	if (separator)
+		joined[length++] = '/';
+
+	memcpy(joined + length, name, name_length + 1);
+
+	return joined;
+}
+
+static int
+magic_scan_list_push(magic_scan_list_t *list, char *item)
+{
+	char **items;
+	size_t capacity;
+
+	if (list->count == list->capacity) {
+		capacity = list->capacity ? list->capacity * 2 : 16;
+
+		items = realloc(list->items, capacity * sizeof(char *));
+		if (!items)
+			return -1;
+
+		list->items = items;
+		list->capacity = capacity;
+	}
+
+	list->items[list->count++] = item;
+
+	return 0;
+}
+
+static char *
+magic_scan_list_pop(magic_scan_list_t *list)
+{
+	if (list->count == 0)
+		return NULL;
+
+	return list->items[--list->count];
+}
+
+static void
+magic_scan_list_free(magic_scan_list_t *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+		free(list->items[i]);
+
+	free(list->items);
+
+	*list = (magic_scan_list_t) { 0 };
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,97 @@
+#if !defined(_SCAN_H)
+#define _SCAN_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+#include "functions.h"
+#include "database.h"
+#include "cache.h"
+#include "prefetch.h"
+
+#if defined(HAVE_DIRENT_H)
+# include <dirent.h>
+#endif /* HAVE_DIRENT_H */
+
+#if defined(HAVE_FNMATCH_H)
+# include <fnmatch.h>
+#endif /* HAVE_FNMATCH_H */
+
+#define MAGIC_SCAN_QUEUE_MAX   1024
+#define MAGIC_SCAN_PENDING_MAX 4096
+
+typedef struct magic_scan_entry {
+	char *path;
+	char *value;
+	int magic_errno;
+	int status;
+} magic_scan_entry_t;
+
+typedef struct magic_scan_list {
+	char **items;
+	size_t count;
+	size_t capacity;
+} magic_scan_list_t;
+
+typedef struct magic_scan_visited {
+	dev_t *devices;
+	ino_t *inodes;
+	size_t count;
+	size_t capacity;
+} magic_scan_visited_t;
+
+typedef struct magic_scan {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;
+	pthread_cond_t ready;
+	char *root;
+	size_t root_length;
+	magic_database_t *database;
+	magic_params_t params;
+	int flags;
+	magic_scan_list_t includes;
+	magic_scan_list_t excludes;
+	magic_scan_list_t directories;
+	magic_scan_list_t files;
+	magic_scan_visited_t visited;
+	magic_scan_entry_t *entries;
+	size_t head;
+	size_t length;
+	size_t active;
+	size_t workers;
+	size_t exited;
+	size_t depth;
+	int done;
+	int stopped;
+	int interrupted;
+	unsigned int recursive:1;
+	unsigned int follow_symlinks:1;
+	unsigned int prefetch:1;
+} magic_scan_t;
+
+extern int magic_scan_init(magic_scan_t *scan, const char *root,
+			   magic_database_t *database,
+			   const magic_params_t *params, int flags,
+			   size_t workers);
+extern void magic_scan_destroy(magic_scan_t *scan);
+
+extern int magic_scan_include(magic_scan_t *scan, const char *pattern);
+extern int magic_scan_exclude(magic_scan_t *scan, const char *pattern);
+
+extern void magic_scan_worker(void *data, size_t index);
+
+extern size_t magic_scan_wait(magic_scan_t *scan, magic_scan_entry_t *entries,
+			      size_t count);
+extern int magic_scan_done(magic_scan_t *scan);
+extern void magic_scan_rearm(magic_scan_t *scan);
+extern void magic_scan_interrupt(magic_scan_t *scan);
+extern void magic_scan_stop(magic_scan_t *scan);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _SCAN_H */
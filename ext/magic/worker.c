@@ -0,0 +1,365 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "worker.h"
+
+#include <signal.h>
+
+/*
+ * A process-wide pool of native threads that run jobs on behalf of Ruby
+ * threads, without ever touching the Ruby VM. Each job consists of a number
+ * of items, identified by their index, that are handed out to at most the
+ * given number of threads at once. The threads are started when first
+ * needed, and are never stopped, other than implicitly, by fork.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	magic_worker_job_t *head;
+	magic_worker_job_t *tail;
+	size_t threads;
+	size_t busy;
+} magic_workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *magic_worker_main(void *data);
+static int magic_worker_start(size_t threads);
+static magic_worker_job_t *magic_worker_next(void);
+static void magic_worker_dequeue(magic_worker_job_t *job);
+
+int
+magic_worker_job_init(magic_worker_job_t *job, magic_worker_function_t function,
+		      void *data, size_t count, size_t threads)
+{
+	assert(job != NULL &&
+	       "Must be a valid pointer to `magic_worker_job_t' type");
+
+	*job = (magic_worker_job_t) {
+		.function = function,
+		.data = data,
+		.count = count,
+		.threads = threads,
+	};
+
+	if (threads > MAGIC_WORKER_MAX)
+		job->threads = MAGIC_WORKER_MAX;
+
+	if (count > 0) {
+		job->completed = malloc(count * sizeof(size_t));
+		if (!job->completed) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	pthread_cond_init(&job->cond, NULL);
+
+	return 0;
+}
+
+void
+magic_worker_job_destroy(magic_worker_job_t *job)
+{
+	pthread_cond_destroy(&job->cond);
+
+	free(job->completed);
+	job->completed = NULL;
+}
+
+/*
+ * Queues the job, starting as many additional threads as the job can use.
+ * The threads that are busy with other jobs are not counted, since a job
+ * can run for a long time, or even wait for another job to finish, such
+ * as when Magic#files is called from within a block given to Magic#scan.
+ * Fails only when there are no threads to run the job at all.
+ */
+int
+magic_worker_submit(magic_worker_job_t *job)
+{
+	int rv = 0;
+	size_t threads;
+
+	pthread_mutex_lock(&magic_workers.lock);
+
+	threads = magic_workers.busy + job->threads;
+	if (threads > MAGIC_WORKER_MAX)
+		threads = MAGIC_WORKER_MAX;
+
+	if (magic_workers.threads < threads)
+		rv = magic_worker_start(threads);
+
+	if (rv < 0 && magic_workers.threads == 0) {
+		pthread_mutex_unlock(&magic_workers.lock);
+		return -1;
+	}
+
+	job->queued = 1;
+	if (magic_workers.tail)
+		magic_workers.tail->queue = job;
+	else
+		magic_workers.head = job;
+
+	magic_workers.tail = job;
+
+	pthread_cond_broadcast(&magic_workers.cond);
+	pthread_mutex_unlock(&magic_workers.lock);
+
+	return 0;
+}
+
+/*
+ * Waits until more than the given number of items were finished, until the
+ * job is done, or until the wait is interrupted, and returns the number of
+ * items finished so far. The indices of the items, in the order in which
+ * they were finished, are available in the completed array.
+ */
+size_t
+magic_worker_wait(magic_worker_job_t *job, size_t finished)
+{
+	pthread_mutex_lock(&magic_workers.lock);
+
+	while (job->finished <= finished && !job->interrupted &&
+	       (job->queued || job->running > 0))
+		pthread_cond_wait(&job->cond, &magic_workers.lock);
+
+	finished = job->finished;
+
+	pthread_mutex_unlock(&magic_workers.lock);
+
+	return finished;
+}
+
+/*
+ * Clears an earlier interrupt before waiting again. This is done under the
+ * lock, as with every other access, and before the unblock function is set,
+ * thus an interrupt that arrives once it is set is never lost.
+ */
+void
+magic_worker_rearm(magic_worker_job_t *job)
+{
+	pthread_mutex_lock(&magic_workers.lock);
+	job->interrupted = 0;
+	pthread_mutex_unlock(&magic_workers.lock);
+}
+
+void
+magic_worker_interrupt(magic_worker_job_t *job)
+{
+	pthread_mutex_lock(&magic_workers.lock);
+	job->interrupted = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&magic_workers.lock);
+}
+
+/*
+ * Stops handing out the items of the job that were not started yet. The
+ * items that are in progress will still finish, see magic_worker_drain().
+ */
+void
+magic_worker_cancel(magic_worker_job_t *job)
+{
+	pthread_mutex_lock(&magic_workers.lock);
+
+	MAGIC_ATOMIC_STORE(job->next, job->count);
+	magic_worker_dequeue(job);
+
+	pthread_mutex_unlock(&magic_workers.lock);
+}
+
+int
+magic_worker_done(magic_worker_job_t *job)
+{
+	int done;
+
+	pthread_mutex_lock(&magic_workers.lock);
+	done = !job->queued && job->running == 0;
+	pthread_mutex_unlock(&magic_workers.lock);
+
+	return done;
+}
+
+/*
+ * Waits until no thread works on the job any longer, after which the job
+ * can be safely destroyed.
+ */
+void
+magic_worker_drain(magic_worker_job_t *job)
+{
+	pthread_mutex_lock(&magic_workers.lock);
+
+	while (job->queued || job->running > 0)
+		pthread_cond_wait(&job->cond, &magic_workers.lock);
+
+	pthread_mutex_unlock(&magic_workers.lock);
+}
+
+/*
+ * Hands the job over to the threads that still work on it, the last of which
+ * releases the job using the given function once done with it, or releases
+ * the job right away when no thread works on it any longer. This way, the
+ * caller does not have to wait for the threads, see magic_worker_drain().
+ * The job should be cancelled first, see magic_worker_cancel().
+ */
+void
+magic_worker_detach(magic_worker_job_t *job, magic_worker_release_t release)
+{
+	int done;
+
+	pthread_mutex_lock(&magic_workers.lock);
+
+	done = !job->queued && job->running == 0;
+	if (!done)
+		job->release = release;
+
+	pthread_mutex_unlock(&magic_workers.lock);
+
+	if (done)
+		release(job);
+}
+
+/*
+ * Only the thread that called fork exists in the child process, thus there
+ * are no threads in the pool any longer, and the jobs that were queued
+ * belong to threads that do not exist either.
+ */
+void
+magic_worker_after_fork(void)
+{
+	pthread_mutex_init(&magic_workers.lock, NULL);
+	pthread_cond_init(&magic_workers.cond, NULL);
+
+	magic_workers.head = NULL;
+	magic_workers.tail = NULL;
+	magic_workers.threads = 0;
+	magic_workers.busy = 0;
+}
+
+static void *
+magic_worker_main(void *data)
+{
+	size_t index;
+	magic_worker_job_t *job;
+
+	UNUSED(data);
+
+	pthread_mutex_lock(&magic_workers.lock);
+
+	for (;;) {
+		job = magic_worker_next();
+		if (!job) {
+			pthread_cond_wait(&magic_workers.cond, &magic_workers.lock);
+			continue;
+		}
+
+		job->running++;
+		magic_workers.busy++;
+		pthread_mutex_unlock(&magic_workers.lock);
+
+		while ((index = MAGIC_ATOMIC_FETCH_ADD(job->next, 1)) < job->count) {
+			job->function(job->data, index);
+
+			pthread_mutex_lock(&magic_workers.lock);
+			job->completed[job->finished++] = index;
+			pthread_cond_broadcast(&job->cond);
+			pthread_mutex_unlock(&magic_workers.lock);
+		}
+
+		pthread_mutex_lock(&magic_workers.lock);
+
+		job->running--;
+		magic_workers.busy--;
+		magic_worker_dequeue(job);
+
+		pthread_cond_broadcast(&job->cond);
+
+		if (job->release && job->running == 0) {
+			pthread_mutex_unlock(&magic_workers.lock);
+			job->release(job);
+			pthread_mutex_lock(&magic_workers.lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+magic_worker_start(size_t threads)
+{
+	int rv = 0;
+	pthread_t thread;
+	pthread_attr_t attributes;
+	sigset_t signals, saved;
+
+	/*
+	 * The signals are handled by the Ruby VM in its own threads, thus the
+	 * threads in the pool must not receive any.
+	 */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_SETMASK, &signals, &saved);
+
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	while (magic_workers.threads < threads) {
+		rv = pthread_create(&thread, &attributes, magic_worker_main, NULL);
+		if (rv != 0)
+			break;
+
+		magic_workers.threads++;
+	}
+
+	pthread_attr_destroy(&attributes);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (rv != 0) {
+		errno = rv;
+		return -1;
+	}
+
+	return 0;
+}
+
+static magic_worker_job_t *
+magic_worker_next(void)
+{
+	magic_worker_job_t *job;
+
+	for (job = magic_workers.head; job; job = job->queue) {
+		if (job->running < job->threads &&
+		    MAGIC_ATOMIC_LOAD(job->next) < job->count)
+			return job;
+	}
+
+	return NULL;
+}
+
+static void
+magic_worker_dequeue(magic_worker_job_t *job)
+{
+	magic_worker_job_t **link;
+
+	if (!job->queued)
+		return;
+
+	for (link = &magic_workers.head; *link; link = &(*link)->queue) {
+		if (*link != job)
+			continue;
+
+		*link = job->queue;
+		break;
+	}
+
+	magic_workers.tail = NULL;
+	for (link = &magic_workers.head; *link; link = &(*link)->queue)
+		magic_workers.tail = *link;
+
+	job->queue = NULL;
+	job->queued = 0;
+}
+
+#if defined(__cplusplus)
+}
+#endif
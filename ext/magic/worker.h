@@ -0,0 +1,54 @@
+#if !defined(_WORKER_H)
+#define _WORKER_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#define MAGIC_WORKER_MAX 256
+
+struct magic_worker_job;
+
+typedef void (*magic_worker_function_t)(void *data, size_t index);
+typedef void (*magic_worker_release_t)(struct magic_worker_job *job);
+
+typedef struct magic_worker_job {
+	magic_worker_function_t function;
+	magic_worker_release_t release;
+	void *data;
+	size_t count;
+	size_t threads;
+	size_t next;
+	size_t finished;
+	size_t *completed;
+	size_t running;
+	pthread_cond_t cond;
+	struct magic_worker_job *queue;
+	int queued;
+	int interrupted;
+} magic_worker_job_t;
+
+extern int magic_worker_job_init(magic_worker_job_t *job,
+				 magic_worker_function_t function,
+				 void *data, size_t count, size_t threads);
+extern void magic_worker_job_destroy(magic_worker_job_t *job);
+
+extern int magic_worker_submit(magic_worker_job_t *job);
+extern size_t magic_worker_wait(magic_worker_job_t *job, size_t finished);
+extern void magic_worker_rearm(magic_worker_job_t *job);
+extern void magic_worker_interrupt(magic_worker_job_t *job);
+extern void magic_worker_cancel(magic_worker_job_t *job);
+extern int magic_worker_done(magic_worker_job_t *job);
+extern void magic_worker_drain(magic_worker_job_t *job);
+extern void magic_worker_detach(magic_worker_job_t *job,
+				magic_worker_release_t release);
+
+extern void magic_worker_after_fork(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _WORKER_H */
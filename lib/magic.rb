@@ -48,12 +48,12 @@ def flags_list(names = false)
     n, i = 0, @flags
     flags = []
 
-    @@flags_map ||= flags_as_map if names
+    flags_map = flags_as_map if names
 
     while i > 0
       n = 2 ** (Math.log(i) / Math.log(2)).to_i
       i = i - n
-      flags.insert(0, names ? @@flags_map[n] : n)
+      flags.insert(0, names ? flags_map[n] : n)
     end
 
     flags
@@ -156,10 +156,20 @@ def check(*paths)
     #    Magic.file( string )          -> string or array
     #    Magic.file( string, integer ) -> string or array
     #
-    # See also:
+    # Identifies the file using a Magic object that belongs to the current
+    # thread and was opened with the given flags, rather than loading the
+    # _Magic_ database again for each call.
+    #
+    # A new Magic object is opened for the call instead when automatic
+    # loading of the _Magic_ database is turned off, see
+    # Magic::do_not_auto_load, or when called on a subclass of Magic.
+    #
+    # See also: Magic::file_type, Magic::buffer and Magic::descriptor
     #
     def file(path, flags = Magic::MIME)
-      open(flags).file(path)
+      return open(flags) {|magic| magic.file(path) } unless shared?
+
+      file_type(path, flags)
     end
 
     #
@@ -167,10 +177,15 @@ def file(path, flags = Magic::MIME)
     #    Magic.buffer( string )          -> string or array
     #    Magic.buffer( string, integer ) -> string or array
     #
-    # See also:
+    # Identifies the content of the buffer using a Magic object that belongs
+    # to the current thread, see Magic::file.
+    #
+    # See also: Magic::buffer_type, Magic::file and Magic::descriptor
     #
     def buffer(buffer, flags = Magic::MIME)
-      open(flags).buffer(buffer)
+      return open(flags) {|magic| magic.buffer(buffer) } unless shared?
+
+      buffer_type(buffer, flags)
     end
 
     #
@@ -179,16 +194,27 @@ def buffer(buffer, flags = Magic::MIME)
     #    Magic.descriptor( integer )          -> string or array
     #    Magic.descriptor( integer, integer ) -> string or array
     #
-    # See also:
+    # Identifies the content of the file descriptor using a Magic object that
+    # belongs to the current thread, see Magic::file.
+    #
+    # See also: Magic::descriptor_type, Magic::file and Magic::buffer
     #
     def descriptor(fd, flags = Magic::MIME)
-      open(flags).descriptor(fd)
+      return open(flags) {|magic| magic.descriptor(fd) } unless shared?
+
+      descriptor_type(fd, flags)
     end
 
     alias_method :fd, :descriptor
 
     private
 
+    def shared?
+      return false if do_not_auto_load
+
+      equal?(Magic)
+    end
+
     def default_paths
       paths = Dir.glob(File.expand_path(File.join(File.dirname(__FILE__), "../ext/magic/share/*.mgc")))
       paths.empty? ? nil : paths
@@ -10,7 +10,7 @@ class << self
     # See also: File::mime and File::type
     #
     def magic(path, flags = Magic::NONE)
-      Magic.open(flags) {|mgc| mgc.file(path) }
+      Magic.file(path, flags)
     end
 
     #
@@ -8,7 +8,7 @@ class String
   # See also: String#mime and String#type
   #
   def magic(flags = Magic::NONE)
-    Magic.open(flags) {|mgc| mgc.buffer(self) }
+    Magic.buffer(self, flags)
   end
 
   #
@@ -0,0 +1,102 @@
+# frozen_string_literal: true
+
+# A minimal fiber scheduler, enough to run the tests without depending on
+# any of the gems that provide a complete one.
+class MagicTestScheduler
+  attr_reader :waits
+
+  def initialize
+    @readable = {}
+    @writable = {}
+    @waiting = {}
+    @ready = []
+    @blocked = 0
+    @waits = 0
+    @lock = Thread::Mutex.new
+    @urgent = IO.pipe
+  end
+
+  def run
+    while @readable.any? || @writable.any? || @waiting.any? || @blocked.positive? || @ready.any?
+      readable, writable = IO.select(
+        @readable.keys + [@urgent.first], @writable.keys, [], timeout
+      )
+
+      readable&.each do |io|
+        next io.read_nonblock(1024, exception: false) if io == @urgent.first
+
+        @readable.delete(io)&.resume
+      end
+
+      writable&.each do |io|
+        @writable.delete(io)&.resume
+      end
+
+      now = current_time
+      @waiting.select { |_, time| time <= now }.each_key do |fiber|
+        @waiting.delete(fiber)
+        fiber.resume if fiber.alive?
+      end
+
+      ready = @lock.synchronize { @ready.slice!(0..) }
+      ready.each { |fiber| fiber.resume if fiber.alive? }
+    end
+  end
+
+  def close
+    run
+  ensure
+    @urgent.each(&:close)
+  end
+
+  def fiber(&block)
+    Fiber.new(blocking: false, &block).tap(&:resume)
+  end
+
+  def io_wait(io, events, timeout)
+    @waits += 1
+    @readable[io] = Fiber.current if events & IO::READABLE != 0
+    @writable[io] = Fiber.current if events & IO::WRITABLE != 0
+    @waiting[Fiber.current] = current_time + timeout if timeout
+
+    Fiber.yield
+    events
+  ensure
+    @readable.delete(io)
+    @writable.delete(io)
+    @waiting.delete(Fiber.current)
+  end
+
+  def kernel_sleep(duration = nil)
+    @waiting[Fiber.current] = current_time + (duration || 0)
+    Fiber.yield
+    true
+  end
+
+  def block(_blocker, timeout = nil)
+    @blocked += 1
+    @waiting[Fiber.current] = current_time + timeout if timeout
+    Fiber.yield
+  ensure
+    @blocked -= 1
+    @waiting.delete(Fiber.current)
+  end
+
+  def unblock(_blocker, fiber)
+    @lock.synchronize { @ready << fiber }
+    @urgent.last.write_nonblock('.', exception: false)
+  end
+
+  private
+
+  def timeout
+    return 0 if @ready.any?
+    return nil if @waiting.empty?
+
+    [@waiting.values.min - current_time, 0].max
+  end
+
+  def current_time
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+end
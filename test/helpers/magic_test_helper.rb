@@ -45,6 +45,25 @@ def with_fixtures(fixtures: 'fixtures', &block)
     end
   end
 
+  def allocations(&block)
+    count = lambda do |&counted|
+      before = GC.stat(:total_allocated_objects)
+      counted.call
+      GC.stat(:total_allocated_objects) - before
+    end
+
+    # The first calls fill in the inline caches, which are objects as well.
+    2.times do
+      count.call(&block)
+      count.call {}
+    end
+
+    GC.disable
+    count.call(&block) - count.call {}
+  ensure
+    GC.enable
+  end
+
   def with_env(env, &blk)
     before = ENV.to_h.dup
     env.each { |k, v| ENV[k] = v }
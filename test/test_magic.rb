@@ -30,7 +30,13 @@ def test_magic_singleton_methods
       :version_array,
       :version_string,
       :version_to_a,
-      :version_to_s
+      :version_to_s,
+      :preload!,
+      :preloaded?,
+      :current,
+      :file_type,
+      :buffer_type,
+      :descriptor_type
     ].each do |i|
       assert_respond_to(Magic, i)
     end
@@ -85,6 +91,8 @@ def test_magic_instance_methods
     [
       :do_not_stop_on_error,
       :do_not_stop_on_error=,
+      :intern_results,
+      :intern_results=,
       :open?,
       :close,
       :closed?,
@@ -100,6 +108,15 @@ def test_magic_instance_methods
       :buffer,
       :descriptor,
       :fd,
+      :io,
+      :identify,
+      :result,
+      :file_into,
+      :buffer_into,
+      :descriptor_into,
+      :files,
+      :buffers,
+      :scan,
       :load,
       :load_files,
       :load_buffers,
@@ -753,27 +770,46 @@ def test_magic_singleton_do_not_auto_load_global
     assert_false(Magic.do_not_auto_load)
     assert_false(klass.do_not_auto_load)
 
-    fork do
-      Magic.do_not_auto_load = true
+    pid = fork do
+      begin
+        Magic.do_not_auto_load = true
 
-      magic = Magic.new
+        magic = Magic.new
 
-      error_1 = assert_raise Magic::MagicError do
-        magic.buffer ''
-      end
+        error_1 = assert_raise Magic::MagicError do
+          magic.buffer ''
+        end
 
-      error_2 = assert_raise Magic::MagicError do
-        klass.buffer ''
-      end
+        error_2 = assert_raise Magic::MagicError do
+          klass.buffer ''
+        end
+
+        error_3 = assert_raise Magic::MagicError do
+          Magic.buffer ''
+        end
+
+        error_4 = assert_raise Magic::MagicError do
+          ''.mime
+        end
 
-      assert_equal('Magic library not loaded', error_1.message)
-      assert_equal('Magic library not loaded', error_2.message)
+        assert_equal('Magic library not loaded', error_1.message)
+        assert_equal('Magic library not loaded', error_2.message)
+        assert_equal('Magic library not loaded', error_3.message)
+        assert_equal('Magic library not loaded', error_4.message)
 
-      assert_true(Magic.do_not_auto_load)
-      assert_true(klass.do_not_auto_load)
+        assert_true(Magic.do_not_auto_load)
+        assert_true(klass.do_not_auto_load)
+      rescue Exception => error
+        warn(error.full_message)
+        exit!(1)
+      end
+
+      exit!(0)
     end
 
-    Process.waitpid rescue Errno::ECHILD
+    _, status = Process.waitpid2(pid)
+
+    assert_true(status.success?)
 
     assert_false(Magic.do_not_auto_load)
     assert_false(klass.do_not_auto_load)
@@ -866,12 +902,38 @@ def test_magic_singleton_check
   end
 
   def test_magic_singleton_file
+    assert_equal('inode/directory; charset=binary', Magic.file('/'))
+    assert_equal('inode/directory', Magic.file('/', Magic::MIME_TYPE))
+
+    assert_operator(allocations { Magic.file('/', Magic::MIME_TYPE) }, :<=, 2)
+
+    opened = []
+    klass = Class.new(Magic)
+    klass.define_singleton_method(:open) do |flags, &block|
+      opened << flags
+      super(flags, &block)
+    end
+
+    assert_equal('inode/directory', klass.file('/', Magic::MIME_TYPE))
+    assert_equal([Magic::MIME_TYPE], opened)
   end
 
   def test_magic_singleton_buffer
+    assert_equal('text/x-shellscript; charset=us-ascii', Magic.buffer("#!/bin/sh\n"))
+    assert_equal('text/x-shellscript', Magic.buffer("#!/bin/sh\n", Magic::MIME_TYPE))
   end
 
   def test_magic_singleton_descriptor
+    with_fixtures do
+      File.open('ruby.png') do |file|
+        assert_equal('image/png', Magic.descriptor(file.fileno, Magic::MIME_TYPE))
+        assert_equal('image/png', Magic.fd(file, Magic::MIME_TYPE))
+      end
+    end
+
+    assert_raise IOError do
+      Magic.descriptor_type(-1)
+    end
   end
 
   def test_magic_magic_error
@@ -912,21 +974,1067 @@ def test_file_integration_singleton_magic_with_custom_flag
   end
 
   def test_file_integration_singleton_mime
+    assert_equal('inode/directory; charset=binary', File.mime('/'))
   end
 
   def test_file_integration_singleton_type
+    assert_equal('inode/directory', File.type('/'))
   end
 
   def test_string_integration_magic
+    assert_equal('POSIX shell script, ASCII text executable', "#!/bin/sh\n".magic)
   end
 
   def test_string_integration_magic_with_custom_flag
+    assert_equal('text/x-shellscript', "#!/bin/sh\n".magic(Magic::MIME_TYPE))
   end
 
   def test_string_integration_mime
+    assert_equal('text/x-shellscript; charset=us-ascii', "#!/bin/sh\n".mime)
   end
 
   def test_string_integration_type
+    assert_equal('text/x-shellscript', "#!/bin/sh\n".type)
+  end
+
+  def test_magic_dup
+    @magic.flags = Magic::MIME_TYPE
+    @magic.set_parameter(Magic::PARAM_BYTES_MAX, 4096)
+
+    copy = @magic.dup
+
+    refute_same(@magic, copy)
+    assert_true(copy.loaded?)
+    assert_equal(Magic::MIME_TYPE, copy.flags)
+    assert_equal(4096, copy.get_parameter(Magic::PARAM_BYTES_MAX))
+    assert_equal(@magic.paths, copy.paths)
+    assert_equal(@magic.buffer("#!/bin/sh\n"), copy.buffer("#!/bin/sh\n"))
+  end
+
+  def test_magic_dup_is_independent
+    copy = @magic.dup
+    copy.flags = Magic::MIME_TYPE
+    copy.close
+
+    assert_true(copy.closed?)
+    assert_false(@magic.closed?)
+    assert_not_equal(Magic::MIME_TYPE, @magic.flags)
+    assert_equal('POSIX shell script, ASCII text executable', @magic.buffer("#!/bin/sh\n"))
+  end
+
+  def test_magic_dup_with_closed_object
+    @magic.close
+
+    assert_raise Magic::LibraryError do
+      @magic.dup
+    end
+  end
+
+  def test_magic_preload
+    assert_boolean(Magic.preload!)
+    assert_equal(Magic.preload!, Magic.preloaded?)
+
+    magic = Magic.new
+
+    assert_true(magic.loaded?)
+    assert_equal(@magic.paths, magic.paths)
+    assert_equal(@magic.buffer("#!/bin/sh\n"), magic.buffer("#!/bin/sh\n"))
+  end
+
+  def test_magic_preload_with_fork
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    Magic.preload!
+
+    pool = Magic::Pool.new(size: 2, flags: Magic::MIME_TYPE)
+    thread = Thread.new { pool.with { sleep 0.2 } }
+
+    sleep 0.05 until pool.available == 1
+
+    pid = fork do
+      exit!(1) unless pool.available == 2
+      exit!(1) unless pool.buffer("#!/bin/sh\n") == 'text/x-shellscript'
+      exit!(1) unless @magic.buffer("#!/bin/sh\n") == 'POSIX shell script, ASCII text executable'
+      exit!(0)
+    end
+
+    _, status = Process.waitpid2(pid)
+    thread.join
+
+    assert_true(status.success?)
+    assert_equal(2, pool.available)
+  end
+
+  def test_magic_compressed_with_fork
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    require 'rbconfig'
+
+    # The standard error output is redirected while a compressed file is
+    # identified, and a child forked meanwhile has to have it restored.
+    script = <<~'RUBY'
+      require 'magic'
+      require 'zlib'
+      require 'tempfile'
+
+      file = Tempfile.new(['fork', '.gz'])
+      file.binmode
+      file.write(Zlib.gzip("#!/bin/sh\n" + 'echo' * 100_000))
+      file.close
+
+      flags = Magic::MIME_TYPE | Magic::COMPRESS
+      done = false
+      thread = Thread.new { Magic.file_type(file.path, flags) until done }
+
+      10.times do
+        pid = fork do
+          $stderr.print '.'
+          $stderr.print '.' if Magic.file_type(file.path, flags) == 'text/x-shellscript'
+          exit!(0)
+        end
+
+        Process.wait(pid)
+      end
+
+      done = true
+      thread.join
+    RUBY
+
+    arguments = $LOAD_PATH.map { |path| "-I#{path}" }
+    output = IO.popen([RbConfig.ruby, *arguments, '-e', script], err: [:child, :out], &:read)
+
+    assert_equal('.' * 20, output)
+  end
+
+  def test_magic_current
+    magic = Magic.current
+
+    assert_kind_of(Magic, magic)
+    assert_same(magic, Magic.current)
+    assert_true(magic.loaded?)
+
+    magic.close
+
+    assert_not_same(magic, Magic.current)
+    assert_false(Magic.current.closed?)
+  end
+
+  def test_magic_current_with_ractors
+    omit_unless(defined?(Ractor), "Platform does not support Ractor")
+
+    experimental, Warning[:experimental] = Warning[:experimental], false
+
+    ractors = 2.times.map do
+      Ractor.new do
+        magic = Magic.current
+        [magic.equal?(Magic.current), magic.buffer("#!/bin/sh\n"), magic.flags_names]
+      end
+    end
+
+    ractors.map(&:take).each do |same, result, names|
+      assert_true(same)
+      assert_equal('POSIX shell script, ASCII text executable', result)
+      assert_equal(['NONE'], names)
+    end
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+  end
+
+  def test_magic_file_type
+    require 'pathname'
+
+    assert_equal('inode/directory; charset=binary', Magic.file_type('/'))
+    assert_equal('inode/directory', Magic.file_type('/', Magic::MIME_TYPE))
+    assert_equal('directory', Magic.file_type(Pathname.new('/'), Magic::NONE))
+
+    with_fixtures do
+      File.open('ruby.png') do |file|
+        assert_equal('image/png', Magic.file_type(file, Magic::MIME_TYPE))
+      end
+    end
+
+    error = assert_raise Magic::MagicError do
+      Magic.file_type('/does/not/exist')
+    end
+
+    assert_match(%r{cannot (stat|open) `/does/not/exist'}, error.message)
+  end
+
+  def test_magic_buffer_type
+    assert_equal('text/x-shellscript; charset=us-ascii', Magic.buffer_type("#!/bin/sh\n"))
+    assert_equal('text/x-shellscript', Magic.buffer_type("#!/bin/sh\n", Magic::MIME_TYPE))
+
+    assert_raise TypeError do
+      Magic.buffer_type(nil)
+    end
+  end
+
+  def test_magic_buffer_type_with_threads
+    results = 4.times.map do
+      Thread.new do
+        [Magic::MIME_TYPE, Magic::NONE].flat_map do |flags|
+          5.times.map { Magic.buffer_type("#!/bin/sh\n", flags) }
+        end.uniq
+      end
+    end.map(&:value)
+
+    assert_equal([['text/x-shellscript', 'POSIX shell script, ASCII text executable']], results.uniq)
+  end
+
+  def test_magic_recursive_locking
+    omit_unless(Signal.list.key?('USR1'), 'Platform does not support SIGUSR1')
+
+    string = "#!/bin/sh\n#{'echo' * 100_000}\n"
+    errors = []
+    waiter = nil
+
+    # A signal handler can run as soon as the identification is done, while
+    # the object is still held, which makes for a recursive use of it.
+    previous = Signal.trap('USR1') do
+      next unless errors.empty?
+
+      begin
+        @magic.buffer("#!/bin/sh\n")
+      rescue ThreadError => error
+        errors << error
+
+        waiter = Thread.new { @magic.buffer("#!/bin/sh\n") }
+        Thread.pass until waiter.status == 'sleep'
+
+        waiter.kill
+        waiter.join(5)
+      end
+    end
+
+    sender = Thread.new do
+      while errors.empty?
+        Process.kill('USR1', Process.pid)
+        sleep 0.001
+      end
+    end
+
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 10
+    @magic.buffer(string) while errors.empty? && Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+
+    errors << nil if errors.empty?
+    sender.join
+
+    assert_equal('deadlock; recursive locking', errors.first&.message)
+    assert_false(waiter.alive?)
+    assert_equal('POSIX shell script, ASCII text executable', @magic.buffer("#!/bin/sh\n"))
+  ensure
+    Signal.trap('USR1', previous) if previous
+  end
+
+  def test_magic_buffer_with_threads
+    @magic.flags = Magic::MIME_TYPE
+
+    string = +"#!/bin/sh\n#{'echo' * 4096}\n"
+
+    results = 4.times.map do |i|
+      Thread.new do
+        magic = i.even? ? Magic.new.tap { |m| m.flags = Magic::MIME_TYPE } : nil
+        10.times.map { magic ? magic.buffer(string) : Magic.buffer_type(string, Magic::MIME_TYPE) }.uniq
+      end
+    end.map(&:value)
+
+    assert_equal([['text/x-shellscript']], results.uniq)
+    assert_false(string.frozen?)
+    assert_nothing_raised { string << "exit 0\n" }
+    assert_equal('text/x-shellscript', @magic.buffer(string.freeze))
+  end
+
+  def test_magic_buffer_allocations
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+    png = File.binread(path)
+    jpeg = "\xff\xd8\xff\xe0\x00\x10JFIF\x00".b
+
+    @magic.flags = Magic::MIME_TYPE
+    assert_equal(1, allocations { @magic.buffer(png) })
+    assert_equal(1, allocations { @magic.file(path) })
+
+    @magic.flags = Magic::EXTENSION
+    assert_equal(%w[jpeg jpg jpe jfif], @magic.buffer(jpeg))
+    assert_equal(5, allocations { @magic.buffer(jpeg) })
+
+    @magic.flags = Magic::CONTINUE
+    assert_equal(2, @magic.buffer(png).size)
+    assert_equal(3, allocations { @magic.buffer(png) })
+  end
+
+  def test_magic_file_with_debug
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+
+    @magic.flags = Magic::MIME_TYPE
+
+    result, trace = @magic.file(path, debug: true)
+    assert_equal('image/png', result)
+    assert_kind_of(String, trace)
+    assert_match(/^\[try /, trace)
+    assert_equal(Magic::MIME_TYPE, @magic.flags)
+
+    result, trace = @magic.buffer(File.binread(path), debug: true)
+    assert_equal('image/png', result)
+    assert_false(trace.empty?)
+
+    File.open(path) do |file|
+      assert_equal('image/png', @magic.descriptor(file, debug: true).first)
+    end
+
+    assert_equal('image/png', @magic.file(path, debug: false))
+
+    traces = Array.new(4) do
+      Thread.new { Magic.new.buffer(File.binread(path), debug: true).last }
+    end.map(&:value)
+    assert_equal(1, traces.map { |trace| trace.gsub(/0x\h+/, '') }.uniq.size)
+  end
+
+  def test_magic_file_with_debug_and_fork
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    require 'rbconfig'
+
+    # A child forked while another thread captures the debugging output has
+    # to be able to capture its own.
+    script = <<~'RUBY'
+      require 'magic'
+      require 'timeout'
+
+      png = File.binread(ARGV[0])
+      magic = Magic.new
+      done = false
+      thread = Thread.new { Magic.new.buffer(png, debug: true) until done }
+
+      5.times do
+        pid = fork do
+          _, trace = magic.buffer(png, debug: true)
+          $stderr.print '.' if trace.include?('[try ')
+          exit!(0)
+        end
+
+        begin
+          Timeout.timeout(2) { Process.wait(pid) }
+        rescue Timeout::Error
+          Process.kill(:KILL, pid)
+          Process.wait(pid)
+        end
+      end
+
+      done = true
+      thread.join
+    RUBY
+
+    arguments = $LOAD_PATH.map { |path| "-I#{path}" }
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+    output = IO.popen([RbConfig.ruby, *arguments, '-e', script, path], err: [:child, :out], &:read)
+
+    assert_equal('.' * 5, output)
+  end
+
+  def test_magic_file_with_debug_and_threads
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+
+    @magic.flags = Magic::MIME_TYPE
+
+    # Loading the Magic database in another thread briefly redirects the
+    # standard error output, which has to be restored afterwards.
+    output = capture_stderr(children: true) do
+      done = false
+      thread = Thread.new { Magic.new.close until done }
+      50.times { assert_equal('image/png', @magic.file(path, debug: true).first) }
+      done = true
+      thread.join
+      $stderr.syswrite("marker\n")
+    end
+    assert_equal("marker\n", output)
+
+    # What other threads write to the standard error output meanwhile is
+    # neither lost nor captured.
+    traces = []
+    output = capture_stderr(children: true) do
+      thread = Thread.new do
+        20.times { traces << @magic.buffer(File.binread(path), debug: true).last }
+      end
+      20.times { $stderr.syswrite("marker\n") }
+      thread.join
+    end
+    assert_equal("marker\n" * 20, output)
+    assert_true(traces.none? { |trace| trace.include?('marker') })
+  end
+
+  def test_magic_file_with_debug_and_error
+    path = File.join(__dir__, 'fixtures', 'does-not-exist')
+
+    expected = assert_raise(Magic::MagicError) { @magic.file(path) }
+    error = assert_raise(Magic::MagicError) do
+      @magic.file(path, debug: true)
+    end
+    assert_equal(expected.message, error.message)
+    assert_equal(expected.errno, error.errno)
+
+    @magic.do_not_stop_on_error = true
+    result, trace = @magic.file(path, debug: true)
+    assert_equal(@magic.file(path), result)
+    assert_kind_of(String, trace)
+  end
+
+  def test_magic_file_into
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+    png = File.binread(path)
+    jpeg = "\xff\xd8\xff\xe0\x00\x10JFIF\x00".b
+    result = String.new(capacity: 2)
+
+    @magic.flags = Magic::MIME_TYPE
+    assert_same(result, @magic.file_into(path, result))
+    assert_equal('image/png', result)
+    assert_same(result, @magic.buffer_into("#!/bin/sh\necho\n", result))
+    assert_equal('text/x-shellscript', result)
+    File.open(path) do |file|
+      assert_same(result, @magic.descriptor_into(file, result))
+    end
+    assert_equal('image/png', result)
+
+    assert_equal(@magic.file(path, flags: Magic::MIME), @magic.file_into(path, result, flags: Magic::MIME))
+    assert_equal('jpeg/jpg/jpe/jfif', @magic.buffer_into(jpeg, result, flags: Magic::EXTENSION))
+
+    assert_equal(0, allocations { @magic.file_into(path, result) })
+    assert_equal(0, allocations { @magic.buffer_into(png, result) })
+    assert_equal('image/png', result)
+
+    assert_raise FrozenError do
+      @magic.file_into(path, String.new.freeze)
+    end
+
+    assert_raise TypeError do
+      @magic.buffer_into(png, nil)
+    end
+  end
+
+  def test_magic_intern_results
+    path = File.join(__dir__, 'fixtures', 'ruby.png')
+    png = File.binread(path)
+
+    @magic.flags = Magic::MIME_TYPE
+    assert_false(@magic.intern_results)
+    assert_false(@magic.buffer(png).frozen?)
+
+    @magic.intern_results = true
+    assert_true(@magic.intern_results)
+
+    result = @magic.buffer(png)
+    assert_equal('image/png', result)
+    assert_true(result.frozen?)
+    assert_equal(Encoding::US_ASCII, result.encoding)
+    assert_same(result, @magic.buffer(png))
+    assert_same(result, @magic.file(path))
+    assert_same(result, Magic.new.tap { |m| m.intern_results = true }.buffer(png, flags: Magic::MIME_TYPE))
+    assert_equal(0, allocations { @magic.buffer(png) })
+
+    jpeg = "\xff\xd8\xff\xe0\x00\x10JFIF\x00".b
+
+    @magic.flags = Magic::EXTENSION
+    assert_equal(%w[jpeg jpg jpe jfif], @magic.buffer(jpeg))
+    assert_true(@magic.buffer(jpeg).all?(&:frozen?))
+    assert_same(@magic.buffer(jpeg).last, @magic.buffer(jpeg).last)
+  end
+
+  def test_magic_buffer_with_offset_and_length
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    string = +"#{'x' * 1024}#{png}#!/bin/sh\n"
+
+    assert_equal('image/png', @magic.buffer(string, offset: 1024, length: png.bytesize))
+    assert_equal('image/png', @magic.buffer(string, offset: 1024))
+    assert_equal('text/x-shellscript', @magic.buffer(string, offset: -10, length: 1024))
+    assert_equal('application/x-empty', @magic.buffer(string, offset: string.bytesize))
+    assert_false(string.frozen?)
+
+    assert_raise ArgumentError do
+      @magic.buffer(string, offset: string.bytesize + 1)
+    end
+
+    assert_raise ArgumentError do
+      @magic.buffer(string, offset: -string.bytesize - 1)
+    end
+
+    assert_raise ArgumentError do
+      @magic.buffer(string, length: -1)
+    end
+
+    assert_raise TypeError do
+      @magic.buffer(string, offset: '1024')
+    end
+  end
+
+  def test_magic_buffer_with_io_buffer
+    omit('IO::Buffer is not supported') unless defined?(IO::Buffer)
+
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    buffer = IO::Buffer.for(png)
+
+    assert_equal('image/png', @magic.buffer(buffer))
+    assert_equal('image/png', Magic.buffer_type(buffer, Magic::MIME_TYPE))
+    assert_false(buffer.locked?)
+
+    script = IO::Buffer.new(64)
+    script.set_string("#!/bin/sh\n")
+
+    assert_equal('text/x-shellscript', script.locked { @magic.buffer(script) })
+    assert_equal(%w[image/png text/x-shellscript image/png], @magic.buffers([buffer, script, png]))
+    assert_false(script.locked?)
+  end
+
+  def test_magic_buffer_with_memory_view
+    begin
+      require 'fiddle'
+    rescue LoadError
+      omit('Fiddle is not available')
+    end
+
+    omit('memory views are not supported') unless defined?(Fiddle::MemoryView)
+
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    pointer = Fiddle::Pointer[png]
+
+    assert_equal('image/png', @magic.buffer(pointer))
+    assert_equal(['image/png'], @magic.buffers([pointer]))
+  end
+
+  def test_magic_file_with_fiber_scheduler
+    omit('Fiber scheduler is not supported') unless Fiber.respond_to?(:set_scheduler)
+
+    require_relative 'helpers/fiber_scheduler'
+
+    @magic.flags = Magic::MIME_TYPE
+
+    png = File.join(__dir__, 'fixtures', 'ruby.png')
+    reader, writer = IO.pipe
+    scheduler = MagicTestScheduler.new
+    results = []
+
+    thread = Thread.new do
+      Fiber.set_scheduler(scheduler)
+
+      Fiber.schedule { results << @magic.descriptor(reader) }
+      Fiber.schedule { results << @magic.file(png) }
+      Fiber.schedule do
+        @magic.file('/does/not/exist')
+      rescue Magic::MagicError => error
+        results << error.class
+      end
+      Fiber.schedule do
+        writer.write("#!/bin/sh\n")
+        writer.close
+      end
+    end
+
+    assert_not_nil(thread.join(10))
+    assert_equal(['image/png', Magic::MagicError, 'text/x-shellscript'].sort_by(&:to_s), results.sort_by(&:to_s))
+    assert_operator(scheduler.waits, :>=, 1)
+  ensure
+    reader&.close
+    writer&.close unless writer&.closed?
+  end
+
+  def test_magic_io
+    require 'stringio'
+    require 'socket'
+
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+
+    string_io = StringIO.new("#!/bin/sh\n#{png}")
+    string_io.gets
+    assert_equal('image/png', @magic.io(string_io))
+    assert_equal(png, string_io.read)
+
+    reader, writer = IO.pipe
+    thread = Thread.new { writer.write(png) && writer.close }
+    assert_equal('image/png', @magic.io(reader))
+    assert_equal(png, reader.read.b)
+    thread.join
+
+    # The writer is still open, and only some of the content has arrived.
+    open_reader, open_writer = IO.pipe
+    open_writer.write("#!/bin/sh\n")
+    thread = Thread.new { @magic.io(open_reader) }
+    assert_equal('text/x-shellscript', thread.join(5)&.value)
+    open_writer.write("echo\n")
+    open_writer.close
+    assert_equal("#!/bin/sh\necho\n", open_reader.read)
+
+    local, remote = UNIXSocket.pair
+    local.write("#!/bin/sh\n")
+    assert_equal('text/x-shellscript', @magic.io(remote))
+    assert_equal("#!/bin/sh\n", remote.read(10))
+
+    assert_equal('application/x-empty', @magic.io(StringIO.new))
+
+    assert_raise TypeError do
+      @magic.io(Object.new)
+    end
+  ensure
+    [reader, writer, open_reader, open_writer, local, remote].each { |io| io&.close unless io&.closed? }
+  end
+
+  def test_magic_identify
+    require 'pathname'
+    require 'stringio'
+
+    png = File.join(__dir__, 'fixtures', 'ruby.png')
+    result = @magic.identify(png)
+
+    assert_true(result.frozen?)
+    assert_equal([:mime_type, :encoding, :description, :extensions], result.keys)
+    assert_equal('image/png', result[:mime_type])
+    assert_equal('binary', result[:encoding])
+    assert_equal(@magic.file(png), result[:description])
+    assert_equal(@magic.file(png, flags: Magic::EXTENSION), result[:extensions])
+    assert_equal(Magic::NONE, @magic.flags)
+
+    assert_equal({ mime: 'image/png; charset=binary' }, @magic.identify(Pathname.new(png), want: [:mime, :mime]))
+    assert_equal({ mime_type: 'inode/directory', extensions: '' }, @magic.identify(__dir__, want: [:mime_type, :extensions]))
+    assert_equal({ mime_type: @magic.file(RbConfig.ruby, flags: Magic::MIME_TYPE), description: @magic.file(RbConfig.ruby) },
+                 @magic.identify(RbConfig.ruby, want: [:mime_type, :description]))
+
+    string_io = StringIO.new("#!/bin/sh\necho\n")
+    assert_equal({ mime_type: 'text/x-shellscript', encoding: 'us-ascii' }, @magic.identify(string_io, want: [:mime_type, :encoding]))
+    assert_equal(0, string_io.pos)
+
+    assert_raise Magic::MagicError do
+      @magic.identify('/does/not/exist')
+    end
+
+    assert_raise ArgumentError do
+      @magic.identify(png, want: [:unknown])
+    end
+
+    assert_raise TypeError do
+      @magic.identify(png, want: ['mime_type'])
+    end
+  end
+
+  def test_magic_result
+    require 'stringio'
+
+    png = File.join(__dir__, 'fixtures', 'ruby.png')
+    result = @magic.result(png)
+
+    assert_kind_of(Magic::Result, result)
+    assert_true(result.frozen?)
+    assert_equal('image/png', result.mime_type)
+    assert_equal('binary', result.charset)
+    assert_equal(@magic.file(png), result.description)
+    assert_equal([@magic.file(png, flags: Magic::EXTENSION)], result.extensions)
+    assert_equal(Array(@magic.file(png, flags: Magic::CONTINUE)), result.all_matches)
+    assert_true(result.extensions.frozen?)
+    assert_true(result.description.frozen?)
+    assert_same(result.description, result.description)
+    assert_equal([:mime_type, :charset, :description, :extensions, :all_matches], result.to_h.keys)
+    assert_equal(Magic::NONE, @magic.flags)
+
+    result = @magic.result(__dir__)
+    assert_equal('inode/directory', result.mime_type)
+    assert_equal([], result.extensions)
+
+    result = @magic.result(StringIO.new("#!/bin/sh\necho\n"))
+    assert_equal('text/x-shellscript', result.mime_type)
+    assert_equal('us-ascii', result.charset)
+
+    assert_raise TypeError do
+      Magic::Result.new
+    end
+
+    assert_raise Magic::MagicError do
+      @magic.result('/does/not/exist')
+    end
+  end
+
+  def test_magic_stream
+    require 'stringio'
+
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    stream = Magic::Stream.new(@magic, size: 16 * 1024)
+
+    assert_equal(16 * 1024, stream.size)
+    assert_false(stream.ready?)
+    assert_nil(stream.result)
+
+    png.each_char.each_slice(10 * 1024).map(&:join).each { |chunk| stream << chunk }
+
+    assert_true(stream.ready?)
+    assert_equal(16 * 1024, stream.bytesize)
+    assert_equal('image/png', stream.result)
+    assert_same(stream.result, stream.finish)
+
+    stream = Magic::Stream.new(@magic)
+    assert_equal(@magic.get_parameter(Magic::PARAM_BYTES_MAX), stream.size)
+
+    IO.copy_stream(StringIO.new("#!/bin/sh\n"), stream)
+    assert_false(stream.ready?)
+    assert_equal('text/x-shellscript', stream.finish)
+    assert_true(stream.ready?)
+
+    assert_equal('application/x-empty', Magic::Stream.new(@magic, size: 1).finish)
+
+    assert_raise ArgumentError do
+      Magic::Stream.new(@magic, size: 0)
+    end
+
+    assert_raise TypeError do
+      Magic::Stream.new(nil)
+    end
+  end
+
+  def test_magic_file_with_mmap
+    require 'tmpdir'
+    require 'zlib'
+
+    Dir.mktmpdir do |dir|
+      Zlib::GzipWriter.open(File.join(dir, 'text.gz')) { |gz| gz.write('x' * 4096) }
+      File.write(File.join(dir, 'empty'), '')
+
+      paths = Dir[File.join(__dir__, 'fixtures', '*')] + Dir[File.join(dir, '*')] + [dir, RbConfig.ruby]
+
+      [Magic::NONE, Magic::MIME].each do |flags|
+        @magic.flags = flags
+        assert_equal(paths.map { |path| @magic.file(path) }, paths.map { |path| @magic.file(path, io: :mmap) })
+      end
+
+      @magic.set_parameter(Magic::PARAM_BYTES_MAX, 16)
+      assert_equal(@magic.file(paths.first), @magic.file(paths.first, io: :mmap))
+    end
+
+    assert_raise Magic::MagicError do
+      @magic.file('/does/not/exist', io: :mmap)
+    end
+
+    assert_raise ArgumentError do
+      @magic.file(__FILE__, io: :unknown)
+    end
+  end
+
+  def test_magic_file_with_flags
+    png = File.join(__dir__, 'fixtures', 'ruby.png')
+    string = with_fixtures { File.binread('ruby.png') }
+
+    assert_match(/^PNG image data/, @magic.file(png))
+    assert_equal('image/png', @magic.file(png, flags: Magic::MIME_TYPE))
+    assert_equal('image/png', @magic.buffer(string, flags: Magic::MIME_TYPE))
+    assert_equal('image/png', File.open(png) { |file| @magic.descriptor(file, flags: Magic::MIME_TYPE) })
+    assert_equal('image/png', File.open(png) { |file| @magic.file(file, flags: Magic::MIME_TYPE) })
+    assert_kind_of(Array, @magic.file(png, flags: Magic::CONTINUE))
+    assert_match(/^PNG image data/, @magic.file(png))
+    assert_equal(Magic::NONE, @magic.flags)
+
+    # More combinations of flags than the object keeps handles for.
+    [Magic::MIME_ENCODING, Magic::EXTENSION, Magic::APPLE, Magic::MIME, Magic::MIME_TYPE].each do |flags|
+      assert_equal(@magic.buffer(string, flags: flags), @magic.file(png, flags: flags))
+    end
+    assert_match(/^PNG image data/, @magic.file(png))
+
+    @magic.set_parameter(Magic::PARAM_BYTES_MAX, 4)
+    assert_not_equal('image/png', @magic.file(png, flags: Magic::MIME_TYPE))
+
+    assert_raise Magic::FlagsError do
+      @magic.file(png, flags: -1)
+    end
+
+    assert_raise TypeError do
+      @magic.buffer(string, flags: 'MIME')
+    end
+  end
+
+  def test_magic_files
+    @magic.flags = Magic::MIME_TYPE
+
+    with_fixtures do
+      paths = ['ruby.png', '.', 'ruby.png', '.']
+
+      assert_equal([], @magic.files([]))
+      assert_equal(['image/png', 'inode/directory'] * 2, @magic.files(paths))
+      assert_equal(['image/png', 'inode/directory'] * 2, @magic.files(paths, threads: 1))
+      assert_equal(['image/png'], @magic.files('ruby.png', threads: 16))
+
+      results = []
+      assert_same(@magic, @magic.files(paths, threads: 2) { |*pair| results << pair })
+      assert_equal(paths.zip(['image/png', 'inode/directory'] * 2).sort, results.sort)
+    end
+
+    assert_raise ArgumentError do
+      @magic.files(['/'], threads: 0)
+    end
+
+    assert_raise TypeError do
+      @magic.files([nil])
+    end
+  end
+
+  def test_magic_files_with_errors
+    @magic.flags = Magic::MIME_TYPE
+
+    error = assert_raise Magic::MagicError do
+      @magic.files(['/', '/does/not/exist'])
+    end
+
+    assert_match(%r{cannot (stat|open) `/does/not/exist'}, error.message)
+
+    @magic.do_not_stop_on_error = true
+    assert_equal('inode/directory', @magic.files(['/', '/does/not/exist']).first)
+  end
+
+  def test_magic_files_with_parameters
+    @magic.set_parameter(Magic::PARAM_BYTES_MAX, 1)
+
+    with_fixtures do
+      assert_equal([@magic.file('ruby.png')], @magic.files(['ruby.png']))
+    end
+  end
+
+  def test_magic_files_with_prefetch
+    @magic.do_not_stop_on_error = true
+
+    with_fixtures do
+      paths = Dir['*'] + ['.', '/does/not/exist'] + Dir['*'].reverse * 10
+
+      assert_equal(@magic.files(paths), @magic.files(paths, prefetch: true))
+      assert_equal(@magic.files(paths), @magic.files(paths, prefetch: true, threads: 1))
+
+      results = {}
+      assert_same(@magic, @magic.files(paths, prefetch: true) { |path, result| results[path] = result })
+      assert_equal(paths.zip(@magic.files(paths)).to_h, results)
+
+      @magic.set_parameter(Magic::PARAM_BYTES_MAX, 1)
+      assert_equal([@magic.file('ruby.png')], @magic.files(['ruby.png'], prefetch: true))
+    end
+  end
+
+  def test_magic_buffers
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    strings = ["#!/bin/sh\n", png] * 50
+
+    assert_equal([], @magic.buffers([]))
+    assert_equal(strings.map { |s| @magic.buffer(s) }, @magic.buffers(strings))
+    assert_equal(['text/x-shellscript'], @magic.buffers("#!/bin/sh\n", threads: 8))
+
+    results = []
+    assert_same(@magic, @magic.buffers(strings.first(2)) { |*pair| results << pair })
+    assert_equal({ "#!/bin/sh\n" => 'text/x-shellscript', png => 'image/png' }, results.to_h)
+
+    assert_raise TypeError do
+      @magic.buffers([nil])
+    end
+  end
+
+  def test_magic_buffers_with_slices
+    @magic.flags = Magic::MIME_TYPE
+
+    png = with_fixtures { File.binread('ruby.png') }
+    string = +"#{'x' * 1024}#{png}#!/bin/sh\n"
+    slices = [[1024, png.bytesize], [-10, nil], [0, 1024]]
+
+    assert_equal([], @magic.buffers(string, slices: []))
+    assert_equal(%w[image/png text/x-shellscript text/plain], @magic.buffers(string, slices: slices, threads: 2))
+
+    results = []
+    assert_same(@magic, @magic.buffers(string, slices: slices.first(1)) { |*pair| results << pair })
+    assert_equal([[[1024, png.bytesize], 'image/png']], results)
+    assert_nothing_raised { string << "exit 0\n" }
+
+    assert_raise ArgumentError do
+      @magic.buffers(string, slices: [[string.bytesize + 1, 1]])
+    end
+
+    assert_raise TypeError do
+      @magic.buffers(string, slices: [1024])
+    end
+
+    assert_raise TypeError do
+      @magic.buffers([string], slices: [[0, 1]])
+    end
+  end
+
+  def test_magic_buffers_with_compaction
+    omit('GC.compact is not supported') unless GC.respond_to?(:compact)
+
+    @magic.flags = Magic::MIME_TYPE
+    strings = Array.new(20) { |i| i.even? ? "#!/bin/sh\n" : "{\"a\": #{i}}\n" }
+
+    results = {}
+    @magic.buffers(strings, threads: 2) do |string, result|
+      GC.compact
+      results[string] = result
+    end
+
+    assert_equal(strings.map { |s| @magic.buffer(s) }, strings.map { |s| results[s] })
+  end
+
+  def test_magic_scan
+    require 'tmpdir'
+    require 'fileutils'
+
+    @magic.flags = Magic::MIME_TYPE
+
+    Dir.mktmpdir do |root|
+      FileUtils.mkdir_p(File.join(root, 'a', 'b'))
+      FileUtils.mkdir_p(File.join(root, '.git'))
+      with_fixtures { |path| FileUtils.cp(File.join(path, 'ruby.png'), File.join(root, 'a')) }
+      File.write(File.join(root, 'a', 'b', 'test.sh'), "#!/bin/sh\n")
+      File.write(File.join(root, '.git', 'config'), "[core]\n")
+      File.write(File.join(root, 'README'), "Hello\n")
+
+      results = []
+      assert_same(@magic, @magic.scan(root) { |*pair| results << pair })
+      assert_equal([
+        ["#{root}/.git/config", 'text/plain'],
+        ["#{root}/README", 'text/plain'],
+        ["#{root}/a/b/test.sh", 'text/x-shellscript'],
+        ["#{root}/a/ruby.png", 'image/png']
+      ], results.sort)
+
+      enumerator = @magic.scan(root, threads: 1, exclude: '.git')
+      assert_kind_of(Enumerator, enumerator)
+      assert_equal(3, enumerator.to_a.size)
+
+      assert_equal([["#{root}/README", 'text/plain']], @magic.scan(root, recursive: false).to_a)
+      assert_equal([["#{root}/a/ruby.png", 'image/png']], @magic.scan(root, include: '*.png').to_a)
+      assert_equal(["#{root}/a/b/test.sh"], @magic.scan("#{root}/", include: 'a/b/*').map { |path, _| path })
+      assert_equal(1, @magic.scan(root).lazy.map { |path, _| path }.first(1).size)
+      assert_equal(results.sort, @magic.scan(root, prefetch: true).to_a.sort)
+      assert_equal([[File.join(root, 'README'), 'text/plain']], @magic.scan(File.join(root, 'README')).to_a)
+    end
+  end
+
+  def test_magic_scan_with_errors
+    error = assert_raise Magic::MagicError do
+      @magic.scan('/does/not/exist').to_a
+    end
+
+    assert_match(%r{cannot open `/does/not/exist'}, error.message)
+
+    @magic.do_not_stop_on_error = true
+    assert_equal(['/does/not/exist'], @magic.scan('/does/not/exist').map { |path, _| path })
+
+    assert_raise ArgumentError do
+      @magic.scan('/', threads: 0) {}
+    end
+
+    assert_raise TypeError do
+      @magic.scan('/', include: [1]) {}
+    end
+  end
+
+  def test_magic_pool_instance_methods
+    pool = Magic::Pool.new(size: 1)
+
+    [
+      :with,
+      :file,
+      :buffer,
+      :descriptor,
+      :fd,
+      :io,
+      :size,
+      :available,
+      :stats,
+      :close
+    ].each do |i|
+      assert_respond_to(pool, i)
+    end
+  end
+
+  def test_magic_pool_with
+    pool = Magic::Pool.new(size: 2, flags: Magic::MIME_TYPE)
+
+    assert_equal(2, pool.size)
+    assert_equal(2, pool.available)
+
+    pool.with do |magic|
+      assert_kind_of(Magic, magic)
+      assert_equal(Magic::MIME_TYPE, magic.flags)
+      assert_equal(1, pool.available)
+    end
+
+    assert_equal(2, pool.available)
+    assert_equal('text/x-shellscript', pool.buffer("#!/bin/sh\n"))
+    assert_equal('text/x-shellscript; charset=us-ascii', pool.buffer("#!/bin/sh\n", flags: Magic::MIME))
+    assert_equal('text/plain', pool.buffer("#!/bin/sh\n", offset: 2))
+
+    with_fixtures do
+      assert_equal('image/png; charset=binary', pool.file('ruby.png', flags: Magic::MIME, io: :mmap))
+    end
+  end
+
+  def test_magic_pool_with_interrupted_wait
+    pool = Magic::Pool.new(size: 1)
+    queue = Queue.new
+
+    holder = Thread.new { pool.with { queue.pop } }
+    Thread.pass until pool.available.zero?
+
+    waiter = Thread.new { pool.with {} }
+    Thread.pass until pool.stats[:waiting] == 1
+
+    3.times do
+      waiter.wakeup
+      Thread.pass
+    end
+
+    queue << true
+    [holder, waiter].each(&:join)
+
+    assert_equal(1, pool.stats[:waits])
+    assert_equal(2, pool.stats[:checkouts])
+  end
+
+  def test_magic_pool_with_invalid_size
+    error = assert_raise ArgumentError do
+      Magic::Pool.new(size: 0)
+    end
+
+    assert_equal('pool size must be greater than zero', error.message)
+  end
+
+  def test_magic_pool_with_timeout
+    pool = Magic::Pool.new(size: 1)
+
+    error = assert_raise Magic::TimeoutError do
+      pool.with { pool.with(timeout: 0.01) {} }
+    end
+
+    assert_equal('timed out waiting for an available Magic object', error.message)
+    assert_equal(Errno::ETIMEDOUT::Errno, error.errno)
+
+    stats = pool.stats
+
+    assert_equal(1, stats[:available])
+    assert_equal(1, stats[:waits])
+    assert_equal(1, stats[:timeouts])
+    assert_operator(stats[:wait_time], :>, 0)
+  end
+
+  def test_magic_pool_with_threads
+    pool = Magic::Pool.new(size: 2, flags: Magic::MIME_TYPE)
+
+    results = 4.times.map do
+      Thread.new do
+        10.times.map { pool.buffer("#!/bin/sh\n") }
+      end
+    end.flat_map(&:value)
+
+    assert_equal(['text/x-shellscript'], results.uniq)
+    assert_equal(40, pool.stats[:checkouts])
+    assert_equal(2, pool.available)
   end
 
   def test_gc_compaction